@@ -0,0 +1,134 @@
+//
+// Created by Right on 25/6/17 14:10.
+//
+// Throughput of many small calls against a SauriApplication, sent one rpc-request at a time or
+// grouped into rpc-batch-requests, as a dock does when a page loads. A stand-in dock keeps
+// --inflight messages outstanding. The app logs every message to stdout; results go to stderr.
+//
+//   batch-bench --mode single --requests 20000 --inflight 32
+//   batch-bench --mode batch --batch-size 32 --requests 20000 --inflight 4
+//   batch-bench --mode stream --batch-size 32 --requests 20000 --inflight 4 --work-us 200
+//
+#include <chrono>
+#include <future>
+#include <CLI/CLI.hpp>
+#include <sauri/sauri.h>
+
+INITIALIZE_EASYLOGGINGPP
+
+namespace {
+    // The calls a page load makes: small arguments, small results
+    RpcRequest make_request(std::size_t index, std::size_t work_us) {
+        return {std::to_string(index), "lookup", {json(static_cast<int>(index)), json(work_us)}};
+    }
+}
+
+int main(int argc, char **argv) {
+    CLI::App cmd{"Batch RPC benchmark"};
+
+    std::string mode = "batch";
+    cmd.add_option("--mode", mode, "single, batch or stream")
+            ->check(CLI::IsMember({"single", "batch", "stream"}));
+    std::size_t requests = 20000;
+    cmd.add_option("--requests", requests, "Calls to make");
+    std::size_t batch_size = 32;
+    cmd.add_option("--batch-size", batch_size, "Calls per batch");
+    std::size_t inflight = 4;
+    cmd.add_option("--inflight", inflight, "Outstanding messages");
+    std::size_t work_us = 0;
+    cmd.add_option("--work-us", work_us, "Time each call spends in the bound function, in microseconds");
+    int workers = 0;
+    cmd.add_option("--workers", workers, "App worker threads, 0 for one per core");
+    std::string pipe_name = "sauri_batch_bench";
+    cmd.add_option("--pipe-name", pipe_name, "Pipe name");
+
+    CLI11_PARSE(cmd, argc, argv);
+    requests = std::max<std::size_t>(requests, 1);
+    batch_size = mode == "single" ? 1 : std::clamp<std::size_t>(batch_size, 1, requests);
+    auto messages = (requests + batch_size - 1) / batch_size;
+    inflight = std::clamp<std::size_t>(inflight, 1, messages);
+
+    // App side
+    SauriApplication app("batch-bench", "batch-bench", "", "", pipe_name, "", "", pipe_name + "_main", workers);
+    app.setFrameMode(FrameMode::length_prefixed);
+    app.bind("lookup", [](int key, std::size_t spin_us) {
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+        while (std::chrono::steady_clock::now() < until) {
+        }
+        return json{{"key", key}, {"value", key * 2}};
+    });
+    if (!app.initialize()) {
+        std::cerr << "app pipe server failed to start" << std::endl;
+        return 1;
+    }
+
+    // Stand-in dock
+    asio::io_context dock_io;
+    auto guard = asio::make_work_guard(dock_io);
+    std::thread dock_thread([&dock_io]() { dock_io.run(); });
+    auto dock = std::make_shared<NamedPipeClient>(dock_io, pipe_name, FrameMode::length_prefixed);
+
+    std::size_t sent = 0;
+    std::size_t completed = 0;
+    std::promise<void> run_done;
+    auto send_next = [&]() {
+        if (sent >= requests) {
+            return;
+        }
+        if (mode == "single") {
+            dock->write(json(CreateRpcMessage("batch-bench", "rpc-request", make_request(sent, work_us))).dump());
+            ++sent;
+            return;
+        }
+        RpcBatchRequest batch;
+        batch.id = std::to_string(sent);
+        batch.stream = mode == "stream";
+        for (std::size_t i = 0; i < batch_size && sent < requests; ++i, ++sent) {
+            batch.requests.push_back(make_request(sent, work_us));
+        }
+        dock->write(json(CreateBatchRequestMessage("batch-bench", batch)).dump());
+    };
+
+    // Responses arrive on the dock session's strand, one at a time
+    dock->set_message_handler([&](std::string_view message) {
+        auto msg = json::parse(message).get<BaseRpcMessage>();
+        bool message_done = false;
+        if (msg.type == "rpc-response") {
+            ++completed;
+            message_done = mode == "single";
+        } else if (msg.type == "rpc-batch-response") {
+            completed += msg.payload["responses"].size();
+            message_done = true;
+        }
+        if (message_done) {
+            send_next();
+        }
+        if (completed == requests && message_done) {
+            run_done.set_value();
+        }
+    });
+
+    if (!dock->connect()) {
+        std::cerr << "connect failed" << std::endl;
+        return 1;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    asio::post(dock_io, [&]() {
+        for (std::size_t i = 0; i < inflight; ++i) {
+            send_next();
+        }
+    });
+    run_done.get_future().get();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::cerr << "mode: " << mode << ", batch size: " << batch_size << ", inflight: " << inflight
+              << ", work: " << work_us << " us" << std::endl;
+    std::cerr << requests << " calls in " << messages << " messages, " << elapsed << " s: "
+              << static_cast<double>(requests) / elapsed << " calls/s" << std::endl;
+
+    dock->close();
+    guard.reset();
+    dock_thread.join();
+    return 0;
+}
@@ -0,0 +1,107 @@
+//
+// Created by Right on 25/6/13 11:30.
+//
+// Per-call cost of decoding an rpc-request and invoking the bound function, from the received
+// payload to the result. Compares the generic path, which materializes the params as
+// std::vector<json> and converts each element with get<T>(), with the decoder bind() generates
+// for the function's signature.
+//
+//   call-bench --iterations 200000
+//   call-bench --codec msgpack
+//
+#include <chrono>
+#include <numeric>
+#include <CLI/CLI.hpp>
+#include <sauri/sauri.h>
+
+INITIALIZE_EASYLOGGINGPP
+
+namespace {
+    struct Point {
+        double x = 0;
+        double y = 0;
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE(Point, x, y)
+    };
+
+    // Keeps the optimizer from dropping the calls
+    volatile std::size_t sink = 0;
+
+    // One frame per iteration, as the pipe would hand it over
+    BufferSlice make_frame(const std::string &encoded) {
+        auto buffer = BufferPool::shared().copy(encoded);
+        auto size = buffer->size();
+        return {SharedBuffer(std::move(buffer)), 0, size};
+    }
+
+    template<typename F>
+    void run_case(const std::string &name, const MessageCodec &codec, F &&f, const json &params,
+                  std::size_t iterations) {
+        json payload = {{"id", "1"}, {"method", name}, {"params", params}};
+        std::string encoded;
+        codec.encode(json(CreateRpcMessage("call-bench", "rpc-request", payload)), encoded);
+
+        auto generic = [&]() {
+            auto envelope = decode_envelope(codec, make_frame(encoded));
+            auto request = envelope.take_payload().get<RpcRequest>();
+            auto result = rpc::detail::call_with_json_params(f, request.params);
+            sink = sink + result.size();
+        };
+        auto typed = [&]() {
+            auto envelope = decode_envelope(codec, make_frame(encoded));
+            auto call = take_rpc_call(envelope);
+            auto result = rpc::detail::call_with_wire_params(f, call.params);
+            sink = sink + result.size();
+        };
+
+        auto measure = [iterations](auto &&path) {
+            for (std::size_t i = 0; i < iterations / 10 + 1; ++i) {
+                path();
+            }
+            auto begin = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < iterations; ++i) {
+                path();
+            }
+            auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin);
+            return elapsed.count() / static_cast<double>(iterations);
+        };
+
+        auto generic_ns = measure(generic);
+        auto typed_ns = measure(typed);
+        std::cout << std::left << std::setw(10) << name
+                  << " generic " << std::right << std::setw(9) << std::fixed << std::setprecision(1)
+                  << generic_ns << " ns/call, typed " << std::setw(9) << typed_ns << " ns/call, "
+                  << std::setprecision(2) << generic_ns / typed_ns << "x" << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    CLI::App cmd{"RPC argument decoding benchmark"};
+
+    std::size_t iterations = 200000;
+    cmd.add_option("--iterations", iterations, "Calls per case");
+    std::string codec_name = "json";
+    cmd.add_option("--codec", codec_name, "Wire codec: json, msgpack or cbor")
+            ->check(CLI::IsMember({"json", "msgpack", "cbor"}));
+
+    CLI11_PARSE(cmd, argc, argv);
+    iterations = std::max<std::size_t>(iterations, 1);
+    auto codec = CodecRegistry::shared().find(codec_name);
+    std::cout << "codec: " << codec->name() << ", iterations: " << iterations << std::endl;
+
+    run_case("add", *codec, [](double a, double b) { return a + b; }, json::array({1.5, 2}), iterations);
+    run_case("concat", *codec, [](const std::string &a, const std::string &b) { return a + b; },
+             json::array({std::string(64, 'a'), std::string(64, 'b')}), iterations);
+    run_case("flags", *codec, [](int id, bool enabled, const std::string &name) {
+        return enabled ? id + static_cast<int>(name.size()) : id;
+    }, json::array({42, true, "overlay"}), iterations);
+
+    std::vector<double> samples(256);
+    std::iota(samples.begin(), samples.end(), 0.5);
+    run_case("sum", *codec, [](const std::vector<double> &values) {
+        return std::accumulate(values.begin(), values.end(), 0.0);
+    }, json::array({samples}), iterations / 10);
+    run_case("point", *codec, [](const Point &a, const Point &b) {
+        return Point{a.x + b.x, a.y + b.y};
+    }, json::array({Point{1, 2}, Point{3, 4}}), iterations);
+    return 0;
+}
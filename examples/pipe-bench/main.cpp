@@ -0,0 +1,275 @@
+//
+// Created by Right on 25/6/9 18:10.
+//
+// Round-trip benchmark of the pipe transports with a stand-in dock.
+// The app side echoes every data message; the dock keeps --inflight messages outstanding.
+// Control messages use the same handshake as SauriApplication, without its per-message logging.
+//
+//   pipe-bench --transport stream --payload 1048576 --requests 2000
+//   pipe-bench --transport shm --payload 1048576 --requests 2000
+//   pipe-bench --backend io_uring --payload 256 --requests 200000 --inflight 64
+//   pipe-bench --compression lz4 --threshold 65536 --payload 4194304 --requests 500
+//
+#include <chrono>
+#include <future>
+#include <random>
+#include <CLI/CLI.hpp>
+#include <sauri/sauri.h>
+
+INITIALIZE_EASYLOGGINGPP
+
+namespace {
+    // Data messages start with this byte, everything else is a JSON control message
+    constexpr char kDataTag = 'D';
+
+    // Payload bytes after the tag. "inventory" is file-listing JSON like the large results real
+    // methods return; "random" does not compress at all.
+    std::string make_content(const std::string &content, std::size_t size) {
+        std::mt19937_64 random(42);
+        std::string out;
+        out.reserve(size + 256);
+        if (content == "random") {
+            while (out.size() < size) {
+                out.push_back(static_cast<char>('!' + random() % 94));
+            }
+        } else if (content == "inventory") {
+            static const char *dirs[] = {"textures", "sounds", "maps", "shaders", "scripts", "movies"};
+            static const char *exts[] = {"dds", "wem", "bsp", "hlsl", "lua", "bk2"};
+            static constexpr char hex[] = "0123456789abcdef";
+            out += "[";
+            while (out.size() < size) {
+                auto kind = random() % 6;
+                out += R"({"path":"C:/Games/Title/assets/)";
+                out += dirs[kind];
+                out += "/file_" + std::to_string(random() % 100000) + "." + exts[kind];
+                out += R"(","size":)" + std::to_string(random() % 50000000);
+                out += R"(,"modified":)" + std::to_string(1718000000 + random() % 10000000);
+                out += R"(,"hash":")";
+                for (int k = 0; k < 16; ++k) {
+                    out.push_back(hex[random() % 16]);
+                }
+                out += "\"},";
+            }
+        } else {
+            out.assign(size, 'x');
+        }
+        out.resize(size);
+        return out;
+    }
+
+    // Echo server standing in for the app, with the app's side of the shm and compression
+    // negotiation
+    class BenchApp {
+    public:
+        BenchApp(NamedPipeServer &server, std::size_t threshold) : server_(server), threshold_(threshold) {
+            server_.set_message_handler([this](session_id session, const BufferSlice &frame) {
+                auto message = frame.view();
+                if (message.front() == kDataTag) {
+                    server_.write(session, message);
+                    return;
+                }
+
+                auto msg = json::parse(message).get<BaseRpcMessage>();
+                if (msg.type == "handshake") {
+                    handleHandshake(session, msg.payload.get<HandshakeMessage>());
+                } else if (msg.type == "shm-attach") {
+                    handleShmAttach(session, msg.payload.get<ShmAttachMessage>());
+                }
+            });
+        }
+
+    private:
+        void handleHandshake(session_id session, const HandshakeMessage &handshake) {
+            json step2 = {{"step", 2}};
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+            if (!handshake.transports.empty()) {
+                auto token = std::to_string(session) + "-shm";
+                pending_[token] = {session, server_.create_shm_channel(session)};
+                step2["transport"] = "shm";
+                step2["token"] = token;
+            }
+#endif
+            auto compression = Compression::none;
+            for (const auto &name: handshake.compressions) {
+                auto algorithm = compression_from_name(name);
+                if (algorithm && compression_supported(*algorithm)) {
+                    compression = *algorithm;
+                    step2["compression"] = name;
+                    break;
+                }
+            }
+            server_.write(session, json(CreateHandshakeMessage("pipe-bench", step2)).dump());
+            if (compression != Compression::none) {
+                server_.set_compression(session, {compression, threshold_});
+            }
+        }
+
+        void handleShmAttach(session_id session, const ShmAttachMessage &attach) {
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+            auto it = pending_.find(attach.token);
+            if (it != pending_.end()) {
+                server_.send_fds(session, it->second.second->native_handles());
+                server_.attach_shm(it->second.first, it->second.second);
+                pending_.erase(it);
+            }
+#endif
+        }
+
+        NamedPipeServer &server_;
+        std::size_t threshold_;
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+        // Handlers all run on the server's io thread
+        std::unordered_map<std::string, std::pair<session_id, std::shared_ptr<ShmChannel>>> pending_;
+#endif
+    };
+}
+
+int main(int argc, char **argv) {
+    CLI::App cmd{"Pipe transport benchmark"};
+
+    std::string transport = "stream";
+    cmd.add_option("--transport", transport, "stream or shm")->check(CLI::IsMember({"stream", "shm"}));
+    std::size_t requests = 10000;
+    cmd.add_option("--requests", requests, "Round trips to run");
+    std::size_t inflight = 8;
+    cmd.add_option("--inflight", inflight, "Outstanding messages");
+    std::size_t payload_size = 64 * 1024;
+    cmd.add_option("--payload", payload_size, "Payload size in bytes");
+    std::string backend = "asio";
+    cmd.add_option("--backend", backend, "I/O backend of the app side: asio or io_uring")
+            ->check(CLI::IsMember({"asio", "io_uring"}));
+    std::string compression = "none";
+    cmd.add_option("--compression", compression, "Frame compression: none, lz4 or zstd")
+            ->check(CLI::IsMember({"none", "lz4", "zstd"}));
+    std::size_t threshold = kDefaultCompressionThreshold;
+    cmd.add_option("--threshold", threshold, "Smallest payload that is compressed, in bytes");
+    std::string content = "inventory";
+    cmd.add_option("--content", content, "Payload content: inventory, random or repeated")
+            ->check(CLI::IsMember({"inventory", "random", "repeated"}));
+    std::string pipe_name = "sauri_pipe_bench";
+    cmd.add_option("--pipe-name", pipe_name, "Pipe name");
+
+    CLI11_PARSE(cmd, argc, argv);
+
+#if !defined(SAURI_HAS_SHM_TRANSPORT)
+    if (transport == "shm") {
+        std::cerr << "shm transport is not available on this platform" << std::endl;
+        return 1;
+    }
+#endif
+    auto algorithm = *compression_from_name(compression);
+    if (!compression_supported(algorithm)) {
+        std::cerr << compression << " is not available in this build" << std::endl;
+        return 1;
+    }
+    requests = std::max<std::size_t>(requests, 1);
+    inflight = std::clamp<std::size_t>(inflight, 1, requests);
+    payload_size = std::max<std::size_t>(payload_size, 1);
+
+    // App side
+    asio::io_context app_io;
+    auto server = std::make_shared<NamedPipeServer>(app_io, pipe_name, FrameMode::length_prefixed);
+    server->set_io_backend(backend == "io_uring" ? IoBackend::io_uring : IoBackend::asio);
+    BenchApp app(*server, threshold);
+    server->start();
+    std::thread app_thread([&app_io]() { app_io.run(); });
+
+    // Stand-in dock
+    asio::io_context dock_io;
+    auto guard = asio::make_work_guard(dock_io);
+    std::thread dock_thread([&dock_io]() { dock_io.run(); });
+    auto dock = std::make_shared<NamedPipeClient>(dock_io, pipe_name, FrameMode::length_prefixed);
+
+    std::promise<HandshakeMessage> handshake_done;
+    std::promise<void> run_done;
+    std::size_t sent = 0;
+    std::size_t completed = 0;
+    // One framed payload, shared by every write
+    auto buffer = BufferPool::shared().acquire(payload_size + kFrameHeaderSize);
+    auto frame_start = begin_frame(*buffer, FrameMode::length_prefixed);
+    buffer->push_back(kDataTag);
+    buffer->append(make_content(content, payload_size - 1));
+    end_frame(*buffer, frame_start, FrameMode::length_prefixed);
+    SharedBuffer payload = std::move(buffer);
+
+    // Responses arrive on the dock session's strand, one at a time
+    dock->set_message_handler([&](std::string_view message) {
+        if (message.front() != kDataTag) {
+            auto msg = json::parse(message).get<BaseRpcMessage>();
+            if (msg.type == "handshake") {
+                handshake_done.set_value(msg.payload.get<HandshakeMessage>());
+            }
+            return;
+        }
+        if (sent < requests) {
+            ++sent;
+            dock->write(payload);
+        }
+        if (++completed == requests) {
+            run_done.set_value();
+        }
+    });
+
+    if (!dock->connect()) {
+        std::cerr << "connect failed" << std::endl;
+        return 1;
+    }
+
+    HandshakeMessage step1{.step = 1};
+    if (transport == "shm") {
+        step1.transports = {"shm"};
+    }
+    if (algorithm != Compression::none) {
+        step1.compressions = {compression};
+    }
+    dock->write(json(CreateHandshakeMessage("pipe-bench", step1)).dump());
+    auto step2 = handshake_done.get_future().get();
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    if (step2.transport == "shm") {
+        if (!dock->attach_shm(json(CreateShmAttachMessage("pipe-bench", step2.token)).dump())) {
+            return 1;
+        }
+    }
+#endif
+    std::size_t wire_size = payload_size;
+    if (!step2.compression.empty()) {
+        CompressionOptions options{algorithm, threshold};
+        dock->set_compression(options);
+        // What one message costs on the wire; the echo is compressed the same way
+        FrameCompressor compressor(options);
+        if (auto compressed = compressor.compress(frame_payload(*payload, FrameMode::length_prefixed))) {
+            wire_size = compressed->size() - kFrameHeaderSize;
+        }
+    }
+    std::cout << "transport: " << (step2.transport.empty() ? "stream" : step2.transport)
+              << ", backend: " << (server->io_backend() == IoBackend::io_uring ? "io_uring" : "asio")
+              << ", payload: " << payload_size << " bytes (" << content << "), inflight: " << inflight << std::endl;
+    std::cout << "compression: " << (step2.compression.empty() ? "none" : step2.compression)
+              << ", threshold: " << threshold << " bytes, on the wire: " << wire_size << " bytes ("
+              << 100.0 * static_cast<double>(wire_size) / static_cast<double>(payload_size) << "%)" << std::endl;
+
+    auto begin = std::chrono::steady_clock::now();
+    asio::post(dock_io, [&]() {
+        for (std::size_t i = 0; i < inflight; ++i) {
+            ++sent;
+            dock->write(payload);
+        }
+    });
+    run_done.get_future().get();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    double bytes = 2.0 * static_cast<double>(requests) * static_cast<double>(payload_size);
+    std::cout << requests << " round trips in " << elapsed << " s: "
+              << static_cast<double>(requests) / elapsed << " msg/s, "
+              << bytes / elapsed / (1024 * 1024) << " MiB/s" << std::endl;
+
+    // Let the dock drain its close before stopping the app side
+    dock->close();
+    guard.reset();
+    dock_thread.join();
+    server->stop();
+    app_io.stop();
+    app_thread.join();
+    return 0;
+}
@@ -108,7 +108,9 @@ int main(int argc, char **argv) {
 
     app.bind("alert", [&app](const std::string &message) {
         std::cout << "Alert: " << message << std::endl;
+#if defined(_WIN32)
         MessageBoxA(0, message.c_str(), "Messagebox from C++", MB_OK | MB_ICONINFORMATION);
+#endif
         app.emitEvent("alert", {{"message", std::string(message) + " from C++"}});
     });
     app.declareEvents({"refresh-ui", "messagebox", "alert"});
@@ -0,0 +1,408 @@
+//
+// Created by Right on 25/6/17 09:40.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "detail/call_impl.h"
+#include "detail/response_writer.h"
+#include "exec/work_stealing_executor.h"
+
+// Bound functions that answer later. Besides plain functions, bind() accepts:
+//
+//   rpc::reply<T> as the last parameter: call it once, from any thread, with the result
+//     app.bind("load", [](std::string path, rpc::reply<std::string> reply) { ... reply(text); });
+//   an rpc::task<T> coroutine, which can co_await other tasks and app.schedule()
+//     app.bind("fetch", [&app](int id) -> rpc::task<Item> { co_await app.schedule(); co_return ...; });
+//   a std::future<T>, answered when it becomes ready; one thread per app checks the pending
+//     futures, so prefer rpc::reply or rpc::task for many slow calls in flight
+//
+// The worker that received the request is free again as soon as the function returns or the
+// coroutine suspends; the response goes out when the result arrives.
+namespace rpc {
+    namespace detail {
+        // Ends one call: the result is in the call's result_sink, or error is set.
+        // Called exactly once, from any thread.
+        using completion = std::function<void(std::exception_ptr error)>;
+
+        // Finishes the calls whose function returned a std::future. std::future has no
+        // continuation to hook, so one thread looks at the pending futures, less often the longer
+        // none of them is ready. Owned by the app and stopped with its workers.
+        class future_waiter {
+        public:
+            future_waiter() = default;
+
+            future_waiter(const future_waiter &) = delete;
+
+            future_waiter &operator=(const future_waiter &) = delete;
+
+            ~future_waiter() { stop(); }
+
+            // poll finishes the call and returns true once its future is ready. Calls still
+            // pending at stop() are failed through cancel instead.
+            void watch(std::function<bool()> poll, completion cancel);
+
+            // Fail the pending calls and join the thread; later calls to watch() fail at once
+            void stop();
+
+        private:
+            struct entry {
+                std::function<bool()> poll;
+                completion cancel;
+            };
+
+            void run();
+
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            std::vector<entry> pending_;
+            std::thread thread_;
+            bool stopping_ = false;
+        };
+    }
+
+    // Completion handle passed as the last argument of a bound function. Copies share one
+    // call; the first reply wins. If every copy is dropped without a reply, the call fails.
+    template<typename T = void>
+    class reply {
+    public:
+        template<typename U = T> requires (!std::is_void_v<U>)
+        void operator()(const U &value) const {
+            complete([&value](detail::result_sink &sink) { sink.set(value); });
+        }
+
+        void operator()() const requires std::is_void_v<T> {
+            complete([](detail::result_sink &sink) { sink.set(nullptr); });
+        }
+
+        // Answer with an error response carrying the exception's message
+        void fail(std::exception_ptr error) const {
+            if (!state_->replied.exchange(true)) {
+                state_->done(std::move(error));
+            }
+        }
+
+        void fail(const std::string &message) const {
+            fail(std::make_exception_ptr(std::runtime_error(message)));
+        }
+
+        // Used by bind(); the sink must stay valid until done is called
+        reply(detail::result_sink &sink, detail::completion done)
+                : state_(std::make_shared<state>(&sink, std::move(done))) {}
+
+    private:
+        struct state {
+            state(detail::result_sink *sink, detail::completion done) : sink(sink), done(std::move(done)) {}
+
+            ~state() {
+                if (!replied.exchange(true)) {
+                    done(std::make_exception_ptr(std::runtime_error("Handler dropped its reply")));
+                }
+            }
+
+            detail::result_sink *sink;
+            detail::completion done;
+            std::atomic<bool> replied{false};
+        };
+
+        template<typename Set>
+        void complete(Set &&set) const {
+            if (state_->replied.exchange(true)) {
+                return;
+            }
+            try {
+                set(*state_->sink);
+            } catch (...) {
+                state_->done(std::current_exception());
+                return;
+            }
+            state_->done(nullptr);
+        }
+
+        std::shared_ptr<state> state_;
+    };
+
+    template<typename T = void>
+    class task;
+
+    namespace detail {
+        template<typename T>
+        struct task_result {
+            std::optional<T> value;
+
+            void return_value(T v) { value.emplace(std::move(v)); }
+
+            T take() { return std::move(*value); }
+        };
+
+        template<>
+        struct task_result<void> {
+            void return_void() {}
+
+            void take() {}
+        };
+
+        template<typename T>
+        struct task_promise : task_result<T> {
+            std::exception_ptr error;
+            // The coroutine awaiting this task, resumed when it finishes
+            std::coroutine_handle<> continuation;
+            // Set instead for a task started on its own; the frame is freed after it runs
+            std::function<void(task_promise &)> on_done;
+
+            task<T> get_return_object() noexcept;
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<task_promise> handle) noexcept {
+                    auto &promise = handle.promise();
+                    if (promise.continuation) {
+                        return promise.continuation;
+                    }
+                    auto done = std::move(promise.on_done);
+                    done(promise);
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept { return {}; }
+
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+    }
+
+    // Lazily started coroutine returning T. co_await on a task runs it and resumes the awaiting
+    // coroutine on the thread that finishes it.
+    template<typename T>
+    class [[nodiscard]] task {
+    public:
+        using promise_type = detail::task_promise<T>;
+
+        task(task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+        task &operator=(task &&other) noexcept {
+            if (this != &other) {
+                if (handle_) {
+                    handle_.destroy();
+                }
+                handle_ = std::exchange(other.handle_, {});
+            }
+            return *this;
+        }
+
+        ~task() {
+            if (handle_) {
+                handle_.destroy();
+            }
+        }
+
+        auto operator co_await() && noexcept {
+            struct awaiter {
+                std::coroutine_handle<promise_type> handle;
+
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                    handle.promise().continuation = awaiting;
+                    return handle;
+                }
+
+                T await_resume() {
+                    auto &promise = handle.promise();
+                    if (promise.error) {
+                        std::rethrow_exception(promise.error);
+                    }
+                    return promise.take();
+                }
+            };
+            return awaiter{handle_};
+        }
+
+        // Run on the calling thread up to the first suspension, and hand the finished promise
+        // to on_done on whichever thread completes it. Used by bind().
+        void start(std::function<void(promise_type &)> on_done) && {
+            auto handle = std::exchange(handle_, {});
+            handle.promise().on_done = std::move(on_done);
+            handle.resume();
+        }
+
+    private:
+        friend struct detail::task_promise<T>;
+
+        explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    template<typename T>
+    task<T> detail::task_promise<T>::get_return_object() noexcept {
+        return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+    }
+
+    // co_await rpc::resume_on(executor) continues the coroutine on one of the executor's workers
+    inline auto resume_on(WorkStealingExecutor &executor) {
+        struct awaiter {
+            WorkStealingExecutor &executor;
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> handle) const {
+                executor.post([handle] { handle.resume(); });
+            }
+
+            void await_resume() const noexcept {}
+        };
+        return awaiter{executor};
+    }
+
+    namespace detail {
+        template<typename T>
+        struct is_future : std::false_type {};
+
+        template<typename T>
+        struct is_future<std::future<T>> : std::true_type {};
+
+        template<typename T>
+        struct is_task : std::false_type {};
+
+        template<typename T>
+        struct is_task<task<T>> : std::true_type {};
+
+        template<typename T>
+        struct is_reply : std::false_type {};
+
+        template<typename T>
+        struct is_reply<reply<T>> : std::true_type {};
+
+        // Last parameter is an rpc::reply, by value or reference
+        template<typename Tuple>
+        constexpr bool takes_reply() {
+            if constexpr (std::tuple_size_v<Tuple> == 0) {
+                return false;
+            } else {
+                return is_reply<param_type<std::tuple_element_t<std::tuple_size_v<Tuple> - 1, Tuple>>>::value;
+            }
+        }
+
+        template<typename Tuple, typename Seq = std::make_index_sequence<std::tuple_size_v<Tuple> - 1>>
+        struct drop_last;
+
+        template<typename Tuple, std::size_t... I>
+        struct drop_last<Tuple, std::index_sequence<I...>> {
+            using type = std::tuple<std::tuple_element_t<I, Tuple>...>;
+        };
+
+        // Hand a finished value or error to the sink and the completion
+        template<typename Get>
+        void complete_with(result_sink &sink, const completion &done, Get &&get) {
+            try {
+                if constexpr (std::is_void_v<decltype(get())>) {
+                    get();
+                    sink.set(nullptr);
+                } else {
+                    sink.set(get());
+                }
+            } catch (...) {
+                done(std::current_exception());
+                return;
+            }
+            done(nullptr);
+        }
+
+        // Decode the params, call f in whichever form it was written, and call done once its
+        // result is in sink. Does not throw: failures, including bad params, go to done.
+        template<typename F>
+        void invoke_bound(F &f, wire_params &params, result_sink &sink, completion done, future_waiter &waiter) {
+            using traits = function_traits<std::decay_t<F>>;
+            using return_type = typename traits::return_type;
+            using args_tuple = typename traits::args_tuple;
+
+            if constexpr (takes_reply<args_tuple>()) {
+                using reply_type = param_type<std::tuple_element_t<std::tuple_size_v<args_tuple> - 1, args_tuple>>;
+                reply_type handle(sink, std::move(done));
+                try {
+                    auto args = args_decoder<typename drop_last<args_tuple>::type>::decode(params);
+                    std::apply([&](auto &&... arg) {
+                        std::invoke(f, std::move(arg)..., handle);
+                    }, std::move(args));
+                } catch (...) {
+                    handle.fail(std::current_exception());
+                }
+            } else if constexpr (is_task<return_type>::value) {
+                // The coroutine only keeps references for reference parameters, so the decoded
+                // arguments live with the completion until the coroutine frame is gone
+                using decoded_args = typename args_decoder<args_tuple>::args_tuple;
+                std::shared_ptr<decoded_args> args;
+                std::optional<return_type> coroutine;
+                try {
+                    args = std::make_shared<decoded_args>(args_decoder<args_tuple>::decode(params));
+                    coroutine.emplace(std::apply(f, std::move(*args)));
+                } catch (...) {
+                    done(std::current_exception());
+                    return;
+                }
+                std::move(*coroutine).start([args, &sink, done = std::move(done)](auto &promise) {
+                    complete_with(sink, done, [&promise]() {
+                        if (promise.error) {
+                            std::rethrow_exception(promise.error);
+                        }
+                        return promise.take();
+                    });
+                });
+            } else if constexpr (is_future<return_type>::value) {
+                auto future = std::make_shared<return_type>();
+                try {
+                    auto args = args_decoder<args_tuple>::decode(params);
+                    *future = std::apply(f, std::move(args));
+                } catch (...) {
+                    done(std::current_exception());
+                    return;
+                }
+                auto get = [future]() { return future->get(); };
+                // A deferred future only runs when asked for its value, so it runs here
+                if (future->wait_for(std::chrono::seconds(0)) != std::future_status::timeout) {
+                    complete_with(sink, done, get);
+                    return;
+                }
+                auto cancel = done;
+                waiter.watch([future, get, &sink, done = std::move(done)]() {
+                    if (future->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        return false;
+                    }
+                    complete_with(sink, done, get);
+                    return true;
+                }, std::move(cancel));
+            } else {
+                try {
+                    call_with_wire_params(f, params, sink);
+                } catch (...) {
+                    done(std::current_exception());
+                    return;
+                }
+                done(nullptr);
+            }
+        }
+    }
+}
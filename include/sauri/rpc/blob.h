@@ -0,0 +1,66 @@
+//
+// Created by Right on 25/6/14 10:15.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "nlohmann/json.hpp"
+#include "pipe/buffer_pool.h"
+
+using json = nlohmann::json;
+
+// Key of the object that stands in for an attachment inside a message: {"$attachment": 0}
+// refers to the first attachment frame sent ahead of the message
+constexpr const char *kAttachmentKey = "$attachment";
+
+// Binary data for bound functions. An argument or return value of this type travels as a raw
+// attachment frame when the dock negotiated attachments, and as an array of byte values, like
+// std::vector<uint8_t>, otherwise. A received Blob shares the receive buffer; no copy is made.
+class Blob {
+public:
+    Blob() = default;
+
+    explicit Blob(BufferSlice slice) : slice_(std::move(slice)) {}
+
+    // Copy bytes into a pooled buffer
+    Blob(const void *data, std::size_t size);
+
+    explicit Blob(std::span<const uint8_t> bytes) : Blob(bytes.data(), bytes.size()) {}
+
+    const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(view().data()); }
+
+    std::size_t size() const { return slice_.size; }
+
+    bool empty() const { return slice_.empty(); }
+
+    std::span<const uint8_t> bytes() const { return {data(), size()}; }
+
+    std::string_view view() const { return slice_.view(); }
+
+    const BufferSlice &slice() const { return slice_; }
+
+    std::vector<uint8_t> to_vector() const { return {data(), data() + size()}; }
+
+private:
+    BufferSlice slice_;
+};
+
+void to_json(json &j, const Blob &blob);
+
+// Accepts an array of byte values or a binary value, e.g. from msgpack
+void from_json(const json &j, Blob &blob);
+
+// Length-prefixed frame carrying bytes as an attachment (kFrameAttachment)
+SharedBuffer attachment_frame(std::string_view bytes);
+
+// {"$attachment": index}
+json attachment_reference(std::size_t index);
+
+// The attachment node refers to, nullptr when node is not a reference. Throws
+// json::out_of_range when no such attachment came with the message.
+const BufferSlice *find_attachment(const json &node, const std::vector<BufferSlice> &attachments);
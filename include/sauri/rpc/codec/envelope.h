@@ -0,0 +1,126 @@
+//
+// Created by Right on 25/6/12 10:20.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "nlohmann/json.hpp"
+#include "message_codec.h"
+#include "../detail/call_impl.h"
+#include "../pipe/buffer_pool.h"
+
+using json = nlohmann::json;
+
+// BaseRpcMessage::type, interned. The values are what the compact envelope sends.
+enum class MessageType {
+    unknown = 0,
+    handshake = 1,
+    shm_attach = 2,
+    rpc_request = 3,
+    rpc_response = 4,
+    rpc_event = 5,
+    rpc_batch_request = 6,
+    rpc_batch_response = 7,
+};
+
+// "rpc-request" -> MessageType::rpc_request; names we do not handle map to unknown
+MessageType message_type(std::string_view name);
+
+// MessageType::rpc_request -> "rpc-request"; empty for unknown
+std::string_view message_type_name(MessageType type);
+
+// Envelope fields interned for one session in the handshake (HandshakeMessage::compactEnvelope).
+// A message then reads {"i":id,"p":payload,"s":token,"t":type,"ts":timestamp}: the token stands
+// for the appId, the type is a MessageType value, and the message id and the request id in
+// rpc-request and rpc-response payloads are integers. decode_envelope() expands it again.
+struct CompactEnvelope {
+    uint32_t token = 0;
+    std::string appId;
+};
+
+// The compact form of a BaseRpcMessage, with a fresh next_message_number() id. Payload ids
+// made of decimal digits become numbers. Messages of a type without a number are returned as
+// they are.
+json compact_message(const json &message, const CompactEnvelope &session);
+
+// The routing fields of a BaseRpcMessage, read without decoding its payload. Text JSON frames
+// are scanned once for the top-level keys and the payload is left as a slice of the frame, so
+// the worker that handles the message parses it exactly once.
+struct Envelope {
+    MessageType type = MessageType::unknown;
+    std::string id;
+    std::string appId;
+    uint64_t timestamp{};
+
+    // Undecoded JSON text of the payload; keeps the frame alive
+    BufferSlice rawPayload;
+    // Payload decoded together with the envelope (binary codecs, or text the scan gave up on)
+    json payload;
+    // Attachment frames received ahead of the message, in order
+    std::vector<BufferSlice> attachments;
+
+    // Decode the payload and hand it over; call once. Throws json::exception on malformed input.
+    json take_payload();
+};
+
+// Throws json::exception when the frame is not a message at all. Compact envelopes are expanded
+// with session; without one, or with another token, their appId stays empty.
+Envelope decode_envelope(const MessageCodec &codec, const BufferSlice &frame,
+                         const CompactEnvelope *session = nullptr);
+
+// An rpc-request payload with its params left for the bound function to decode
+struct RpcCall {
+    std::string id;
+    std::string method;
+    // Set instead of method when the dock called by the id the registration advertised
+    std::optional<uint32_t> methodId;
+    // Text of the params array when the payload was still undecoded; params.text points into it
+    BufferSlice rawParams;
+    rpc::detail::wire_params params;
+};
+
+// Take the request out of an rpc-request envelope, along with its attachments.
+// Throws json::exception on malformed input.
+RpcCall take_rpc_call(Envelope &envelope);
+
+// Method of an rpc-request envelope, by name or id, read without decoding its params; false
+// when it cannot be read, which take_rpc_call() then reports
+bool peek_method(const Envelope &envelope, std::string &method, std::optional<uint32_t> &methodId);
+
+// One request of a batch. A malformed entry does not fail the batch: error holds the
+// json::exception it raised, and the entry is answered with an error at its index.
+struct RpcBatchEntry {
+    RpcCall call;
+    std::exception_ptr error;
+};
+
+// An rpc-batch-request payload (RpcBatchRequest); each request's params are left for its
+// bound function to decode
+struct RpcBatch {
+    std::string id;
+    bool stream = false;
+    std::vector<RpcBatchEntry> calls;
+};
+
+// Take the requests out of an rpc-batch-request envelope. Throws json::exception when the batch
+// itself is malformed: no readable id, or requests is not an array.
+RpcBatch take_rpc_batch(Envelope &envelope);
+
+// Routing fields of an rpc-request, read from the first bytes of its frame. The appId is empty
+// for a compact envelope.
+struct RequestHead {
+    std::string appId;
+    std::string requestId;
+    std::string method;
+    std::optional<uint32_t> methodId;
+};
+
+// Read the routing fields from the start of a text JSON frame whose rest has not arrived yet.
+// True once the payload's id and method (name or id) were both found, ahead of its params; the type is not
+// checked, as "type" sorts after "payload".
+bool peek_rpc_call(std::string_view prefix, RequestHead &head);
@@ -0,0 +1,62 @@
+//
+// Created by Right on 25/6/11 09:40.
+//
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+// Wire encoding of RPC messages. The dock lists the codecs it speaks in handshake step 1 and
+// the app picks one in step 2; until then, and with docks that list none, messages are JSON.
+class MessageCodec {
+public:
+    virtual ~MessageCodec() = default;
+
+    // Name used in the handshake, e.g. "json", "msgpack"
+    virtual const std::string &name() const = 0;
+
+    // Binary output may contain '\n', so binary codecs need FrameMode::length_prefixed
+    virtual bool is_binary() const = 0;
+
+    // Append the encoded message to out
+    virtual void encode(const json &message, std::string &out) const = 0;
+
+    // Throws json::exception on malformed input
+    virtual json decode(std::string_view data) const = 0;
+};
+
+using CodecPtr = std::shared_ptr<const MessageCodec>;
+
+// Codecs available for negotiation, looked up by name
+class CodecRegistry {
+public:
+    // Process-wide registry holding json, msgpack and cbor
+    static CodecRegistry &shared();
+
+    // Add a codec, replacing one with the same name
+    void add(CodecPtr codec);
+
+    // nullptr if no codec has that name
+    CodecPtr find(std::string_view name) const;
+
+    std::vector<std::string> names() const;
+
+    // Text JSON, what peers speak before and without negotiation
+    static const CodecPtr &json_codec();
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<CodecPtr> codecs_;
+};
+
+// Decode a message with the session's codec. Text JSON is accepted from any session, since a
+// peer may still send JSON until it has seen the negotiated codec; JSON messages start with '{',
+// which no binary codec produces for a map.
+json decode_message(const MessageCodec &codec, std::string_view data);
@@ -0,0 +1,47 @@
+//
+// Created by Right on 25/6/14 16:40.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <streambuf>
+#include "envelope.h"
+#include "../pipe/buffer_pool.h"
+
+// The pieces of one large frame, read as a stream while they are still arriving. The session's
+// strand pushes pieces in; a worker reads them through a std::istream and blocks until the next
+// piece comes in. Each piece is released as soon as the reader moves past it, so only the part
+// of the message not parsed yet is held in memory.
+class ChunkStream : public std::streambuf {
+public:
+    // Queue a piece; ignored once the reader abandoned the stream
+    void push(BufferSlice chunk);
+
+    // No more pieces: the frame is complete, or the session went away before it was. The reader
+    // sees the end of input after the queued pieces.
+    void close();
+
+    // The reader is done with the message: drop queued pieces and ignore the rest
+    void abandon();
+
+protected:
+    int_type underflow() override;
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<BufferSlice> chunks_;
+    // Piece the get area points into
+    BufferSlice current_;
+    bool closed_ = false;
+    bool abandoned_ = false;
+};
+
+// Read a text JSON rpc-request from the stream up to the start of its params, which are left in
+// the stream for the bound function's decoder (RpcCall::params.stream). The payload's id and
+// method must come before the params. Throws json::exception on malformed input.
+RpcCall read_rpc_call(std::istream &in);
@@ -3,7 +3,14 @@
 #define GAME_TOOL_BASE_CALL_IMPL_H
 
 #include "nlohmann/json.hpp"
+#include "response_writer.h"
+#include "../blob.h"
 #include <functional>
+#include <istream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
 #include <vector>
@@ -111,6 +118,252 @@ namespace rpc::detail {
             return json(result);
         }
     }
+
+    // Params of one request as they came off the wire: the JSON text of the params array, or,
+    // when text is empty, the array a binary codec already decoded
+    struct wire_params {
+        std::string_view text;
+        json values;
+        // Set instead of text for a request still arriving: the params array is read from the
+        // stream as it comes in, and the rest of the message is left unread
+        std::istream *stream = nullptr;
+        // Attachment frames sent with the request, referred to from the params by position
+        std::vector<BufferSlice> attachments;
+    };
+
+    // Convert a decoded node to T like node.get<T>(), moving out of it where the type allows.
+    // Byte arguments that refer to an attachment are taken from the attachment frame.
+    template<typename T>
+    T take_arg(json &node, const std::vector<BufferSlice> *attachments = nullptr) {
+        if constexpr (std::is_same_v<T, json>) {
+            return std::move(node);
+        } else {
+            if constexpr (is_blob<T>::value) {
+                if (attachments) {
+                    if (auto *slice = find_attachment(node, *attachments)) {
+                        if constexpr (std::is_same_v<T, Blob>) {
+                            return Blob(*slice);
+                        } else {
+                            auto bytes = slice->view();
+                            return T(bytes.begin(), bytes.end());
+                        }
+                    }
+                }
+            }
+            if constexpr (std::is_same_v<T, std::string>) {
+                if (node.is_string()) {
+                    return std::move(node.get_ref<std::string &>());
+                }
+            }
+            return node.get<T>();
+        }
+    }
+
+    inline std::runtime_error param_count_mismatch(std::size_t expected, std::size_t got) {
+        return std::runtime_error("Parameter count mismatch. Expected " +
+                                  std::to_string(expected) + ", got " + std::to_string(got));
+    }
+
+    // SAX handler that decodes a params array straight into the arguments of one signature.
+    // Scalars are stored into their argument as they are read; objects, arrays and scalars that
+    // need a conversion are built as json first and converted the way get<T>() does.
+    template<typename... Args>
+    class args_reader {
+    public:
+        using number_integer_t = json::number_integer_t;
+        using number_unsigned_t = json::number_unsigned_t;
+        using number_float_t = json::number_float_t;
+        using string_t = json::string_t;
+        using binary_t = json::binary_t;
+
+        explicit args_reader(const std::vector<BufferSlice> *attachments = nullptr) : attachments_(attachments) {}
+
+        std::tuple<Args...> args;
+        // Elements in the params array
+        std::size_t count = 0;
+
+        bool null() { return depth_ > 1 ? dom_->null() : store(nullptr); }
+
+        bool boolean(bool val) { return depth_ > 1 ? dom_->boolean(val) : store(val); }
+
+        bool number_integer(number_integer_t val) { return depth_ > 1 ? dom_->number_integer(val) : store(val); }
+
+        bool number_unsigned(number_unsigned_t val) { return depth_ > 1 ? dom_->number_unsigned(val) : store(val); }
+
+        bool number_float(number_float_t val, const string_t &s) {
+            return depth_ > 1 ? dom_->number_float(val, s) : store(val);
+        }
+
+        bool string(string_t &val) { return depth_ > 1 ? dom_->string(val) : store(std::move(val)); }
+
+        bool binary(binary_t &val) { return depth_ > 1 ? dom_->binary(val) : store(json::binary(std::move(val))); }
+
+        bool start_object(std::size_t elements) {
+            open_node();
+            return dom_->start_object(elements);
+        }
+
+        bool key(string_t &val) { return dom_->key(val); }
+
+        bool end_object() {
+            dom_->end_object();
+            return close_node();
+        }
+
+        bool start_array(std::size_t elements) {
+            if (depth_ == 0) {
+                // The params array itself
+                depth_ = 1;
+                return true;
+            }
+            open_node();
+            return dom_->start_array(elements);
+        }
+
+        bool end_array() {
+            if (depth_ == 1) {
+                depth_ = 0;
+                return true;
+            }
+            dom_->end_array();
+            return close_node();
+        }
+
+        bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex) {
+            throw ex;
+        }
+
+    private:
+        static void expect_array(int depth) {
+            if (depth == 0) {
+                throw json::type_error::create(302, "params must be an array", nullptr);
+            }
+        }
+
+        // An object or array starts inside the params array
+        void open_node() {
+            expect_array(depth_);
+            if (depth_++ == 1) {
+                node_ = json();
+                dom_.emplace(node_);
+            }
+        }
+
+        bool close_node() {
+            if (--depth_ == 1) {
+                dom_.reset();
+                return store(std::move(node_));
+            }
+            return true;
+        }
+
+        template<typename V>
+        bool store(V &&val) {
+            expect_array(depth_);
+            auto index = count++;
+            // Extra params are counted and dropped; the caller reports the mismatch
+            store_at(index, std::forward<V>(val), std::index_sequence_for<Args...>{});
+            return true;
+        }
+
+        template<typename V, std::size_t... I>
+        void store_at(std::size_t index, V &&val, std::index_sequence<I...>) {
+            // Cast: with no params the fold is a bare false, which warns as an unused value
+            static_cast<void>(((index == I ? (assign(std::get<I>(args), std::forward<V>(val)), true) : false) || ...));
+        }
+
+        template<typename T, typename V>
+        void assign(T &arg, V &&val) {
+            using value_type = std::decay_t<V>;
+            if constexpr (std::is_same_v<T, bool> && std::is_same_v<value_type, bool>) {
+                arg = val;
+            } else if constexpr (std::is_arithmetic_v<T> && !std::is_same_v<T, bool> &&
+                                 std::is_arithmetic_v<value_type> && !std::is_same_v<value_type, bool>) {
+                arg = static_cast<T>(val);
+            } else if constexpr (std::is_same_v<T, std::string> && std::is_same_v<value_type, std::string>) {
+                arg = std::forward<V>(val);
+            } else {
+                json node(std::forward<V>(val));
+                arg = take_arg<T>(node, attachments_);
+            }
+        }
+
+        const std::vector<BufferSlice> *attachments_;
+        int depth_ = 0;
+        json node_;
+        std::optional<nlohmann::detail::json_sax_dom_parser<json>> dom_;
+    };
+
+    template<typename Tuple>
+    struct args_decoder;
+
+    // Decoder generated for one signature; arguments are stored by value
+    template<typename... Args>
+    struct args_decoder<std::tuple<Args...>> {
+        using args_tuple = std::tuple<param_type<Args>...>;
+
+        static constexpr bool direct = (std::is_default_constructible_v<param_type<Args>> && ...);
+
+        static args_tuple decode(wire_params &params) {
+            if (params.text.empty() && !params.stream) {
+                return from_values(params, params.values, std::index_sequence_for<Args...>{});
+            }
+            if constexpr (direct) {
+                args_reader<param_type<Args>...> reader(&params.attachments);
+                if (params.stream) {
+                    // Not strict: parsing ends with the array, in the middle of the message
+                    json::sax_parse(*params.stream, &reader, json::input_format_t::json, false);
+                } else {
+                    json::sax_parse(params.text.begin(), params.text.end(), &reader);
+                }
+                if (reader.count != sizeof...(Args)) {
+                    throw param_count_mismatch(sizeof...(Args), reader.count);
+                }
+                return std::move(reader.args);
+            } else {
+                // Arguments that cannot be default constructed are converted from a parsed array
+                json values;
+                if (params.stream) {
+                    nlohmann::detail::json_sax_dom_parser<json> dom(values);
+                    json::sax_parse(*params.stream, &dom, json::input_format_t::json, false);
+                } else {
+                    values = json::parse(params.text);
+                }
+                return from_values(params, values, std::index_sequence_for<Args...>{});
+            }
+        }
+
+        template<std::size_t... I>
+        static args_tuple from_values(const wire_params &params, json &values, std::index_sequence<I...>) {
+            auto &array = values.get_ref<json::array_t &>();
+            if (array.size() != sizeof...(Args)) {
+                throw param_count_mismatch(sizeof...(Args), array.size());
+            }
+            return args_tuple(take_arg<param_type<Args>>(array[I], &params.attachments)...);
+        }
+    };
+
+    // Decode the params with the decoder generated for f's signature, call f and hand its
+    // return value to sink
+    template<typename F>
+    void call_with_wire_params(F &&f, wire_params &params, result_sink &sink) {
+        using traits = function_traits<std::decay_t<F>>;
+        auto args = args_decoder<typename traits::args_tuple>::decode(params);
+
+        if constexpr (std::is_void_v<typename traits::return_type>) {
+            std::apply(std::forward<F>(f), std::move(args));
+            sink.set(nullptr);
+        } else {
+            sink.set(std::apply(std::forward<F>(f), std::move(args)));
+        }
+    }
+
+    template<typename F>
+    json call_with_wire_params(F &&f, wire_params &params) {
+        result_sink sink;
+        call_with_wire_params(std::forward<F>(f), params, sink);
+        return std::move(sink.value());
+    }
 }
 
 #endif //GAME_TOOL_BASE_CALL_IMPL_H
\ No newline at end of file
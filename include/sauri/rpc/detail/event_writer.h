@@ -0,0 +1,67 @@
+#pragma once
+#ifndef GAME_TOOL_BASE_EVENT_WRITER_H
+#define GAME_TOOL_BASE_EVENT_WRITER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "json_writer.h"
+
+namespace rpc::detail {
+    // The parts of an rpc-event message that stay the same between emissions, encoded once.
+    // Writes the same text as json(CreateEventMessage(appId, RpcEvent{...})).dump():
+    //   event.begin(*buffer, messageId);
+    //   write_json(*buffer, data);      // or append data that is already JSON text
+    //   event.end(*buffer, eventId, timestamp);
+    // begin_compact() and end_compact() write the compact envelope instead, with integer ids.
+    class event_writer {
+    public:
+        event_writer(std::string_view appId, std::string_view event) {
+            head_ = "{\"appId\":";
+            write_string(head_, appId);
+            head_ += ",\"id\":";
+            event_ = ",\"event\":";
+            write_string(event_, event);
+            event_ += ",\"id\":";
+        }
+
+        // Everything up to the data
+        void begin(std::string &out, std::string_view messageId) const {
+            out += head_;
+            write_string(out, messageId);
+            out += R"(,"payload":{"data":)";
+        }
+
+        // Everything after the data
+        void end(std::string &out, std::string_view eventId, uint64_t timestamp) const {
+            out += event_;
+            write_string(out, eventId);
+            out += "},\"timestamp\":";
+            write_json(out, timestamp);
+            out += ",\"type\":\"rpc-event\"}";
+        }
+
+        void begin_compact(std::string &out, uint64_t messageId) const {
+            out += "{\"i\":";
+            write_json(out, messageId);
+            out += R"(,"p":{"data":)";
+        }
+
+        void end_compact(std::string &out, uint64_t eventId, uint32_t token, uint64_t timestamp) const {
+            out += event_;
+            write_json(out, eventId);
+            // 5 is MessageType::rpc_event
+            out += "},\"s\":";
+            write_json(out, token);
+            out += ",\"t\":5,\"ts\":";
+            write_json(out, timestamp);
+            out.push_back('}');
+        }
+
+    private:
+        std::string head_;
+        std::string event_;
+    };
+}
+
+#endif //GAME_TOOL_BASE_EVENT_WRITER_H
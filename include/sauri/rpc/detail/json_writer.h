@@ -0,0 +1,185 @@
+#pragma once
+#ifndef GAME_TOOL_BASE_JSON_WRITER_H
+#define GAME_TOOL_BASE_JSON_WRITER_H
+
+#include "nlohmann/json.hpp"
+#include <charconv>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace rpc::detail {
+    using json = nlohmann::json;
+
+    // Serialize j as compact JSON appended to out, same output as j.dump()
+    // but without building an intermediate std::string
+    inline void dump_to(std::string &out, const json &j) {
+        nlohmann::detail::serializer<json> serializer(nlohmann::detail::output_adapter<char, std::string>(out), ' ');
+        serializer.dump(j, false, false, 0);
+    }
+
+    // Length of the UTF-8 sequence starting at s[i], 0 if it is malformed
+    inline std::size_t utf8_sequence(std::string_view s, std::size_t i) {
+        auto byte = [&s](std::size_t at) { return static_cast<unsigned char>(s[at]); };
+        auto in = [](unsigned char c, unsigned char lo, unsigned char hi) { return c >= lo && c <= hi; };
+        auto c = byte(i);
+        std::size_t length;
+        unsigned char lo = 0x80, hi = 0xbf;
+        if (in(c, 0xc2, 0xdf)) {
+            length = 2;
+        } else if (in(c, 0xe0, 0xef)) {
+            length = 3;
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        } else if (in(c, 0xf0, 0xf4)) {
+            length = 4;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        } else {
+            return 0;
+        }
+        if (i + length > s.size() || !in(byte(i + 1), lo, hi)) {
+            return 0;
+        }
+        for (std::size_t k = 2; k < length; ++k) {
+            if (!in(byte(i + k), 0x80, 0xbf)) {
+                return 0;
+            }
+        }
+        return length;
+    }
+
+    // Append s as a JSON string, escaped the way dump() does
+    inline void write_string(std::string &out, std::string_view s) {
+        static constexpr char hex[] = "0123456789abcdef";
+        out.reserve(out.size() + s.size() + 2);
+        auto mark = out.size();
+        out.push_back('"');
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < s.size();) {
+            auto c = static_cast<unsigned char>(s[i]);
+            if (c >= 0x80) {
+                auto length = utf8_sequence(s, i);
+                if (length == 0) {
+                    // Let the serializer raise its usual type_error 316
+                    out.resize(mark);
+                    dump_to(out, json(std::string(s)));
+                    return;
+                }
+                i += length;
+                continue;
+            }
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                ++i;
+                continue;
+            }
+            out.append(s.data() + run, i - run);
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    out += "\\u00";
+                    out.push_back(hex[c >> 4]);
+                    out.push_back(hex[c & 0xf]);
+            }
+            run = ++i;
+        }
+        out.append(s.data() + run, s.size() - run);
+        out.push_back('"');
+    }
+
+    inline void write_number(std::string &out, double value) {
+        if (!std::isfinite(value)) {
+            out += "null";
+            return;
+        }
+        char buffer[64];
+        auto *end = nlohmann::detail::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, end);
+    }
+
+    template<typename T, typename = void>
+    struct is_map : std::false_type {};
+
+    template<typename T>
+    struct is_map<T, std::void_t<typename T::key_type, typename T::mapped_type>> : std::true_type {};
+
+    // Maps whose iteration order and unique keys match the json object they convert to:
+    // std::map keyed by text in std::string order. Unordered maps and multimaps do not.
+    template<typename T>
+    struct is_string_map : std::false_type {};
+
+    template<typename K, typename V, typename C, typename A>
+    struct is_string_map<std::map<K, V, C, A>>
+            : std::bool_constant<(std::is_same_v<K, std::string> || std::is_same_v<K, std::string_view>) &&
+                                 (std::is_same_v<C, std::less<K>> || std::is_same_v<C, std::less<>>)> {};
+
+    template<typename T, typename = void>
+    struct is_sequence : std::false_type {};
+
+    template<typename T>
+    struct is_sequence<T, std::void_t<typename T::value_type,
+            decltype(std::begin(std::declval<const T &>())), decltype(std::end(std::declval<const T &>()))>>
+            : std::true_type {};
+
+    // Append value as compact JSON with the same text as json(value).dump(). Strings, numbers,
+    // and sequences and std::string-keyed std::maps of them are written directly; any other
+    // type, other maps included, goes through its to_json().
+    template<typename T>
+    void write_json(std::string &out, const T &value) {
+        if constexpr (std::is_same_v<T, json>) {
+            dump_to(out, value);
+        } else if constexpr (nlohmann::detail::is_basic_json<T>::value) {
+            dump_to(out, json(value));
+        } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+            out += "null";
+        } else if constexpr (std::is_same_v<T, bool>) {
+            out += value ? "true" : "false";
+        } else if constexpr (std::is_integral_v<T>) {
+            char buffer[24];
+            auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+            out.append(buffer, result.ptr);
+        } else if constexpr (std::is_floating_point_v<T>) {
+            write_number(out, static_cast<double>(value));
+        } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+            write_string(out, value);
+        } else if constexpr (is_string_map<T>::value) {
+            out.push_back('{');
+            bool first = true;
+            for (const auto &[key, item]: value) {
+                if (!first) {
+                    out.push_back(',');
+                }
+                first = false;
+                write_string(out, key);
+                out.push_back(':');
+                write_json(out, item);
+            }
+            out.push_back('}');
+        } else if constexpr (!is_map<T>::value && is_sequence<T>::value) {
+            out.push_back('[');
+            bool first = true;
+            for (const auto &item: value) {
+                if (!first) {
+                    out.push_back(',');
+                }
+                first = false;
+                write_json(out, item);
+            }
+            out.push_back(']');
+        } else {
+            dump_to(out, json(value));
+        }
+    }
+}
+
+#endif //GAME_TOOL_BASE_JSON_WRITER_H
@@ -0,0 +1,146 @@
+#pragma once
+#ifndef GAME_TOOL_BASE_RESPONSE_WRITER_H
+#define GAME_TOOL_BASE_RESPONSE_WRITER_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "json_writer.h"
+#include "../blob.h"
+
+namespace rpc::detail {
+    // Streams an rpc-response message into an outgoing buffer, with the same text as
+    // json(CreateResponseMessage(appId, json(response))).dump(), so a handler's return value
+    // goes straight into the frame instead of through a json tree:
+    //   response_writer writer(*buffer, appId, messageId);
+    //   writer.begin(requestId);
+    //   writer.result(value);          // or writer.fail(code, message), at any point
+    //   writer.finish(timestamp);
+    // The second constructor writes the compact envelope instead, the same text as
+    // compact_message() produces for it.
+    class response_writer {
+    public:
+        response_writer(std::string &out, std::string_view appId, std::string_view messageId) : out_(out) {
+            out_ += "{\"appId\":";
+            write_string(out_, appId);
+            out_ += ",\"id\":";
+            write_string(out_, messageId);
+            out_ += ",\"payload\":";
+            payload_ = out_.size();
+        }
+
+        response_writer(std::string &out, uint32_t token, uint64_t messageId) : out_(out), token_(token) {
+            out_ += "{\"i\":";
+            write_json(out_, messageId);
+            out_ += ",\"p\":";
+            payload_ = out_.size();
+        }
+
+        // Successful payload up to the result
+        void begin(std::string_view requestId) {
+            out_ += R"({"error":{"code":0,"data":null,"message":""},"hasError":false,"id":)";
+            write_id(requestId);
+            out_ += ",\"result\":";
+        }
+
+        // Called once, after begin()
+        template<typename T>
+        void result(const T &value) {
+            write_json(out_, value);
+            out_.push_back('}');
+        }
+
+        // Replace whatever was written of the payload with an error
+        void fail(std::string_view requestId, int code, std::string_view message) {
+            out_.resize(payload_);
+            out_ += "{\"error\":{\"code\":";
+            write_json(out_, code);
+            out_ += ",\"data\":null,\"message\":";
+            write_string(out_, message);
+            out_ += "},\"hasError\":true,\"id\":";
+            write_id(requestId);
+            out_ += ",\"result\":null}";
+        }
+
+        void finish(int64_t timestamp) {
+            if (token_) {
+                // 4 is MessageType::rpc_response
+                out_ += ",\"s\":";
+                write_json(out_, *token_);
+                out_ += ",\"t\":4,\"ts\":";
+                write_json(out_, timestamp);
+                out_.push_back('}');
+                return;
+            }
+            out_ += ",\"timestamp\":";
+            write_json(out_, timestamp);
+            out_ += ",\"type\":\"rpc-response\"}";
+        }
+
+    private:
+        // Compact envelopes carry integer request ids; "unknown" stays a string
+        void write_id(std::string_view requestId) {
+            bool number = token_ && !requestId.empty() && requestId.size() < 20 &&
+                          (requestId[0] != '0' || requestId.size() == 1) &&
+                          requestId.find_first_not_of("0123456789") == std::string_view::npos;
+            if (number) {
+                out_ += requestId;
+            } else {
+                write_string(out_, requestId);
+            }
+        }
+
+        std::string &out_;
+        std::size_t payload_;
+        std::optional<uint32_t> token_;
+    };
+
+    // Byte types that travel as attachments when the session negotiated them
+    template<typename T>
+    struct is_blob : std::is_same<T, Blob> {};
+
+    template<>
+    struct is_blob<std::vector<uint8_t>> : std::true_type {};
+
+    // Where a bound function's return value goes: streamed into a response, or kept as json
+    // for codecs that encode a whole message at once. With attachments, a byte result becomes an
+    // attachment frame and the response refers to it.
+    class result_sink {
+    public:
+        explicit result_sink(response_writer *writer = nullptr, std::vector<SharedBuffer> *attachments = nullptr)
+                : writer_(writer), attachments_(attachments) {}
+
+        template<typename T>
+        void set(const T &value) {
+            if constexpr (is_blob<T>::value) {
+                if (attachments_) {
+                    std::string_view bytes(reinterpret_cast<const char *>(value.data()), value.size());
+                    attachments_->push_back(attachment_frame(bytes));
+                    store(attachment_reference(attachments_->size() - 1));
+                    return;
+                }
+            }
+            store(value);
+        }
+
+        json &value() { return value_; }
+
+    private:
+        template<typename T>
+        void store(const T &value) {
+            if (writer_) {
+                writer_->result(value);
+            } else {
+                value_ = json(value);
+            }
+        }
+
+        response_writer *writer_;
+        std::vector<SharedBuffer> *attachments_;
+        json value_;
+    };
+}
+
+#endif //GAME_TOOL_BASE_RESPONSE_WRITER_H
@@ -0,0 +1,37 @@
+//
+// Created by Right on 25/6/17 16:00.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// Caps how many calls of one bound function run at once. Calls over the limit wait here, in
+// arrival order, instead of holding a worker; a finished call starts the next one.
+class ConcurrencyGate {
+public:
+    explicit ConcurrencyGate(std::size_t limit);
+
+    // Call start now if fewer than limit calls hold the gate, otherwise once one releases it.
+    // The call holds the gate until release().
+    void submit(std::function<void()> start);
+
+    // A call admitted by submit() finished; starts the next waiting one on this thread
+    void release();
+
+    std::size_t limit() const { return limit_; }
+
+    // Calls holding the gate and calls waiting for it, racy
+    std::size_t running() const;
+
+    std::size_t waiting() const;
+
+private:
+    const std::size_t limit_;
+    mutable std::mutex mutex_;
+    std::size_t running_ = 0;
+    std::deque<std::function<void()>> waiting_;
+};
@@ -0,0 +1,202 @@
+//
+// Created by Right on 25/6/16 10:30.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Keeps the producer and consumer indices of a queue on separate cache lines
+constexpr std::size_t kCacheLineSize = 64;
+
+// Work-stealing deque (Chase-Lev, with the C11 orderings of Lê et al.). The owning worker pushes
+// and takes at the bottom, LIFO, so the task it just queued runs while its data is still in
+// cache; any thread steals at the top, FIFO. T is a pointer; nullptr means empty.
+template<typename T>
+class TaskDeque {
+public:
+    explicit TaskDeque(std::size_t capacity = 256) {
+        arrays_.push_back(std::make_unique<Array>(capacity));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+
+    TaskDeque(const TaskDeque &) = delete;
+
+    TaskDeque &operator=(const TaskDeque &) = delete;
+
+    // Owner only
+    void push(T item) {
+        auto bottom = bottom_.load(std::memory_order_relaxed);
+        auto top = top_.load(std::memory_order_acquire);
+        auto *array = array_.load(std::memory_order_relaxed);
+        if (bottom - top > static_cast<int64_t>(array->capacity) - 1) {
+            array = grow(array, top, bottom);
+        }
+        array->put(bottom, item);
+        bottom_.store(bottom + 1, std::memory_order_release);
+    }
+
+    // Owner only
+    T take() {
+        auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        auto *array = array_.load(std::memory_order_relaxed);
+        bottom_.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto top = top_.load(std::memory_order_relaxed);
+        if (top > bottom) {
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T item = array->get(bottom);
+        if (top == bottom) {
+            // Last item: race the thieves for it
+            if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. nullptr when empty or when another thread won the item.
+    T steal() {
+        auto top = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto bottom = bottom_.load(std::memory_order_acquire);
+        if (top >= bottom) {
+            return nullptr;
+        }
+        auto *array = array_.load(std::memory_order_acquire);
+        T item = array->get(top);
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    // Racy size, for deciding whether to look closer
+    bool empty() const {
+        return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array {
+        explicit Array(std::size_t capacity) : capacity(capacity), mask(capacity - 1), slots(capacity) {}
+
+        T get(int64_t index) const { return slots[index & mask].load(std::memory_order_relaxed); }
+
+        void put(int64_t index, T item) { slots[index & mask].store(item, std::memory_order_relaxed); }
+
+        std::size_t capacity;
+        std::size_t mask;
+        std::vector<std::atomic<T>> slots;
+    };
+
+    // Thieves may still read the old array, so it is kept until the deque goes away
+    Array *grow(Array *array, int64_t top, int64_t bottom) {
+        auto bigger = std::make_unique<Array>(array->capacity * 2);
+        for (auto i = top; i < bottom; ++i) {
+            bigger->put(i, array->get(i));
+        }
+        arrays_.push_back(std::move(bigger));
+        array = arrays_.back().get();
+        array_.store(array, std::memory_order_release);
+        return array;
+    }
+
+    alignas(kCacheLineSize) std::atomic<int64_t> top_{0};
+    alignas(kCacheLineSize) std::atomic<int64_t> bottom_{0};
+    std::atomic<Array *> array_;
+    std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+// Bounded lock-free multi-producer, multi-consumer queue (Vyukov). Each slot carries a sequence
+// number that says whether it is free for the producer or full for the consumer of a given
+// turn, so producers and consumers only contend on their own index. T is a pointer.
+template<typename T>
+class InjectionQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit InjectionQueue(std::size_t capacity = 4096) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        mask_ = size - 1;
+        slots_ = std::make_unique<Slot[]>(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    InjectionQueue(const InjectionQueue &) = delete;
+
+    InjectionQueue &operator=(const InjectionQueue &) = delete;
+
+    // False when the queue is full
+    bool push(T item) {
+        auto position = enqueue_.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots_[position & mask_];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (diff == 0) {
+                if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = enqueue_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->item = item;
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // nullptr when the queue is empty
+    T pop() {
+        auto position = dequeue_.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots_[position & mask_];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (diff == 0) {
+                if (dequeue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                position = dequeue_.load(std::memory_order_relaxed);
+            }
+        }
+        T item = slot->item;
+        slot->sequence.store(position + mask_ + 1, std::memory_order_release);
+        return item;
+    }
+
+    // Racy, for deciding whether to look closer
+    bool empty() const {
+        return enqueue_.load(std::memory_order_relaxed) == dequeue_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        T item{};
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    std::size_t mask_ = 0;
+    alignas(kCacheLineSize) std::atomic<std::size_t> enqueue_{0};
+    alignas(kCacheLineSize) std::atomic<std::size_t> dequeue_{0};
+};
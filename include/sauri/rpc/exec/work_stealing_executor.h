@@ -0,0 +1,132 @@
+//
+// Created by Right on 25/6/16 10:30.
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "task_queues.h"
+
+// Lane a task queues in
+enum class Priority {
+    high = 0,
+    normal = 1,
+    low = 2,
+};
+
+constexpr std::size_t kPriorityCount = 3;
+
+// How workers pick the next lane to take a task from
+enum class LaneScheduling {
+    // A lower lane runs only while every higher one is empty
+    strict,
+    // Lanes take turns in proportion to their weights, so lower lanes keep moving under load.
+    // An empty lane gives its turn to the others.
+    weighted,
+};
+
+// Time from post() to the start of the task, for the tasks one lane ran
+struct LaneStats {
+    uint64_t tasks = 0;
+    std::chrono::nanoseconds totalWait{0};
+    std::chrono::nanoseconds maxWait{0};
+};
+
+// Thread pool for RPC work.
+//
+// Every worker owns a TaskDeque per lane: tasks posted from a worker go to its own deque, and an
+// idle worker steals from the others before it gives up. Tasks posted from other threads (the
+// I/O strands) go through a lock-free InjectionQueue per lane; only when that is full do they
+// fall back to a mutex-guarded overflow list. Idle workers spin for a short while and then park;
+// a post only takes the parking lock when a worker is actually asleep.
+class WorkStealingExecutor {
+public:
+    using task = std::function<void()>;
+
+    // threads == 0: one worker per core
+    explicit WorkStealingExecutor(std::size_t threads = 0);
+
+    // Call before start(). weights are for LaneScheduling::weighted, by Priority; 0 counts as 1.
+    // Defaults to strict.
+    void set_lane_scheduling(LaneScheduling scheduling, std::array<unsigned, kPriorityCount> weights = {8, 4, 1});
+
+    // Stops the workers
+    ~WorkStealingExecutor();
+
+    WorkStealingExecutor(const WorkStealingExecutor &) = delete;
+
+    WorkStealingExecutor &operator=(const WorkStealingExecutor &) = delete;
+
+    void start();
+
+    // Let the workers finish every queued task, then join them. Tasks posted after the workers
+    // are gone are destroyed without running.
+    void stop();
+
+    // Thread-safe
+    void post(task t, Priority priority = Priority::normal);
+
+    std::size_t size() const { return workers_.size(); }
+
+    // Totals since start, summed over the workers
+    LaneStats lane_stats(Priority priority) const;
+
+    // The calling thread is one of this executor's workers
+    bool running_in_this_thread() const;
+
+private:
+    struct Worker;
+
+    // A posted task with the time it was posted
+    struct item {
+        task fn;
+        std::chrono::steady_clock::time_point posted;
+    };
+
+    void run(std::size_t index);
+
+    // Lane by lane in the order the scheduling gives: own deque, then the injection queue,
+    // then the other workers' deques
+    item *find_task(std::size_t index, std::size_t &lane);
+
+    item *take_from_lane(std::size_t index, std::size_t lane);
+
+    item *steal(std::size_t thief, std::size_t lane);
+
+    // Anything queued anywhere, racy
+    bool has_work() const;
+
+    void park();
+
+    // Wake one parked worker, if any
+    void notify();
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::array<InjectionQueue<item *>, kPriorityCount> injection_;
+    std::mutex overflow_mutex_;
+    std::array<std::deque<item *>, kPriorityCount> overflow_;
+    std::atomic<std::size_t> overflow_size_{0};
+
+    LaneScheduling scheduling_ = LaneScheduling::strict;
+    // Weighted: the lane each turn prefers, interleaved by smooth weighted round robin
+    std::vector<std::size_t> turns_;
+
+    // Event count for parking: a waiter reads the epoch before its last look at the queues,
+    // and sleeps only while nobody bumped it since
+    std::mutex park_mutex_;
+    std::condition_variable park_cv_;
+    std::atomic<uint64_t> wake_epoch_{0};
+    std::atomic<std::size_t> sleepers_{0};
+
+    std::atomic<bool> started_{false};
+    std::atomic<bool> stopping_{false};
+};
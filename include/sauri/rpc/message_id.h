@@ -0,0 +1,50 @@
+//
+// Created by Right on 25/6/13 15:10.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Strategy for the id of every message the app sends (BaseRpcMessage::id, RpcEvent::id).
+// Ids only have to be unique among the messages one app sends to a dock.
+class MessageIdGenerator {
+public:
+    virtual ~MessageIdGenerator() = default;
+
+    // Called concurrently from the worker and I/O threads
+    virtual std::string next() = 0;
+};
+
+// Default: a random 24-bit prefix chosen when the process starts, followed by a 40-bit counter,
+// as 13 base32 characters. One atomic increment per id; the counter wraps after 2^40 messages.
+class CounterIdGenerator : public MessageIdGenerator {
+public:
+    CounterIdGenerator();
+
+    std::string next() override;
+
+private:
+    uint64_t prefix_;
+    std::atomic<uint64_t> counter_{0};
+};
+
+// RFC 4122 UUIDs from the system generator, what released versions sent. Each id reads the OS
+// random source, so only opt in when the dock needs ids unique across processes.
+class UuidIdGenerator : public MessageIdGenerator {
+public:
+    std::string next() override;
+};
+
+// Replace the process-wide generator; call before any message is sent
+void set_message_id_generator(std::shared_ptr<MessageIdGenerator> generator);
+
+// Id for the next outgoing message
+std::string next_message_id();
+
+// Integer id for the next outgoing message on a session using the compact envelope.
+// A process-wide counter starting at 1.
+uint64_t next_message_number();
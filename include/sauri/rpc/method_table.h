@@ -0,0 +1,84 @@
+//
+// Created by Right on 25/6/16 15:20.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "async.h"
+#include "exec/concurrency_gate.h"
+#include "exec/work_stealing_executor.h"
+
+// A bound function, as bind() wraps it. It calls the completion once its result is in the sink,
+// possibly later and on another thread, and does not throw.
+using MethodHandler = std::function<void(rpc::detail::wire_params &, rpc::detail::result_sink &,
+                                         rpc::detail::completion)>;
+
+// How the app schedules the calls of a bound function
+struct BindOptions {
+    // Lane the calls queue in on the workers (see SauriApplication::setLaneScheduling())
+    Priority priority = Priority::normal;
+    // Calls running at once, until their response is out; 0 for no limit. Further calls wait
+    // in arrival order without holding a worker.
+    std::size_t maxConcurrency = 0;
+    // Run the calls on a pool of this many threads of the method's own ("bulkhead"), so they
+    // neither hold nor wait for the app's workers; 0 to share the app's workers
+    std::size_t dedicatedThreads = 0;
+};
+
+// A bound function with its options and the state they need
+struct BoundMethod {
+    MethodHandler handler;
+    BindOptions options;
+    // Set with options.maxConcurrency
+    std::shared_ptr<ConcurrencyGate> gate;
+    // Set with options.dedicatedThreads
+    std::shared_ptr<WorkStealingExecutor> pool;
+};
+
+// The bound functions, frozen before the app starts serving. Each method gets a dense integer
+// id, in order of name, which the registration advertises so the dock can call by number: a
+// lookup by id is an index into an array. Names are found through a perfect hash picked for this
+// set of names at freeze time, so a lookup by name hashes once and compares one string.
+class MethodTable {
+public:
+    // Replace the table's contents; ids follow the order of the names
+    void freeze(const std::unordered_map<std::string, BoundMethod> &methods);
+
+    bool frozen() const { return frozen_; }
+
+    // nullptr if no method has that id or name
+    const BoundMethod *find(uint32_t id) const {
+        return id < methods_.size() ? &methods_[id].method : nullptr;
+    }
+
+    const BoundMethod *find(std::string_view name) const;
+
+    std::vector<std::string> names() const;
+
+    // name -> id, for the registration
+    std::map<std::string, uint32_t> ids() const;
+
+private:
+    uint64_t slot(std::string_view name, uint64_t seed) const;
+
+    struct Method {
+        std::string name;
+        BoundMethod method;
+    };
+
+    std::vector<Method> methods_;
+    // Perfect hash: slot -> id, or -1 for a slot no name hashes to
+    std::vector<int32_t> slots_;
+    uint64_t seed_ = 0;
+    uint64_t mask_ = 0;
+    bool frozen_ = false;
+};
@@ -8,6 +8,7 @@
 
 #include <unordered_set>
 #include <cstddef>
+#include <map>
 #include <nlohmann/json.hpp>
 #include <utility>
 #if !defined(__cpp_lib_byte) && !defined(STD_BYTE_DEFINED)
@@ -18,6 +19,7 @@ namespace std {
 #endif
 #include <stduuid/uuid.h>
 #include "../utils/utils.h"
+#include "message_id.h"
 
 using json = nlohmann::json;
 
@@ -32,6 +34,8 @@ struct RegisterMsg {
         std::string httpUrl;
         std::string localPath;
         std::vector<std::string> functions;
+        // Numeric id of each function, which the dock may send in place of the name
+        std::map<std::string, uint32_t> methodIds;
         std::unordered_set<std::string> events;
     } appInfo;
 
@@ -47,6 +51,9 @@ struct RegisterMsg {
         if (!appInfo.functions.empty()) {
             j["appInfo"]["functions"] = appInfo.functions;
         }
+        if (!appInfo.methodIds.empty()) {
+            j["appInfo"]["methodIds"] = appInfo.methodIds;
+        }
         if (!appInfo.events.empty()) {
             j["appInfo"]["events"] = appInfo.events;
         }
@@ -74,6 +81,9 @@ struct RegisterMsg {
         if (j["appInfo"].contains("localPath")) {
             msg.appInfo.localPath = j["appInfo"]["localPath"];
         }
+        if (j["appInfo"].contains("methodIds")) {
+            msg.appInfo.methodIds = j["appInfo"]["methodIds"];
+        }
         return msg;
     }
 };
@@ -103,6 +113,25 @@ struct RpcResponse {
     NLOHMANN_DEFINE_TYPE_INTRUSIVE(RpcResponse, id, hasError, result, error)
 };
 
+// Requests sent together (rpc-batch-request). The app runs them in parallel and answers with one
+// rpc-batch-response holding a response per request, in request order. With stream set, each
+// request is answered by its own rpc-response as soon as it completes instead, and an
+// rpc-batch-response without responses follows the last of them.
+struct RpcBatchRequest {
+    std::string id;
+    std::vector<RpcRequest> requests;
+    bool stream = false;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(RpcBatchRequest, id, requests, stream)
+};
+
+struct RpcBatchResponse {
+    std::string id;
+    std::vector<RpcResponse> responses;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE(RpcBatchResponse, id, responses)
+};
+
 // RPC Event
 struct RpcEvent {
     std::string id;
@@ -113,8 +142,39 @@ struct RpcEvent {
 
 struct HandshakeMessage {
     int step = 2;
+    // step 1: transports the dock can use besides the stream, e.g. "shm"
+    std::vector<std::string> transports;
+    // step 1: message codecs the dock can decode, most preferred first, e.g. "msgpack"
+    std::vector<std::string> codecs;
+    // step 1: frame compression the dock can decode, most preferred first, e.g. "lz4"
+    std::vector<std::string> compressions;
+    // step 1: the dock can send and receive attachment frames (see Blob);
+    // step 2: the app sends byte results as attachments
+    bool attachments = false;
+    // step 2: transport picked by the app, and the token the dock attaches with
+    std::string transport;
+    std::string token;
+    // step 2: codec for every message after this one; absent means JSON
+    std::string codec;
+    // step 2: compression both sides may apply to frames after this one; absent means none.
+    // Each side picks its own size threshold.
+    std::string compression;
+    // step 1: the dock can read and write the compact envelope (see CompactEnvelope);
+    // step 2: both sides use it for every message after this one
+    bool compactEnvelope = false;
+    // step 2: with compactEnvelope, the token that stands for the appId
+    uint32_t session = 0;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(HandshakeMessage, step, transports, codecs, compressions,
+                                                attachments, transport, token, codec, compression,
+                                                compactEnvelope, session)
+};
+
+// Sent by the dock on a side connection to pick up the shared-memory channel offered in step 2
+struct ShmAttachMessage {
+    std::string token;
 
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE(HandshakeMessage, step)
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE(ShmAttachMessage, token)
 };
 
 // Base message class with common fields and serialization
@@ -139,8 +199,7 @@ inline BaseRpcMessage CreateRpcMessage(const std::string &appId, const std::stri
     BaseRpcMessage message;
     message.appId = appId;
     message.type = type;
-    auto const id = uuids::uuid_system_generator{}();
-    message.id = to_string(id);
+    message.id = next_message_id();
     message.timestamp = get_current_time_ms();
     message.payload = std::move(payload);
     return message;
@@ -154,6 +213,18 @@ inline BaseRpcMessage CreateResponseMessage(const std::string &appId, nlohmann::
     return CreateRpcMessage(appId, "rpc-response", std::move(payload));
 }
 
+inline BaseRpcMessage CreateBatchRequestMessage(const std::string &appId, const RpcBatchRequest &batch) {
+    return CreateRpcMessage(appId, "rpc-batch-request", batch);
+}
+
+inline BaseRpcMessage CreateBatchResponseMessage(const std::string &appId, nlohmann::json payload) {
+    return CreateRpcMessage(appId, "rpc-batch-response", std::move(payload));
+}
+
 inline BaseRpcMessage CreateEventMessage(const std::string &appId, nlohmann::json payload) {
     return CreateRpcMessage(appId, "rpc-event", std::move(payload));
+}
+
+inline BaseRpcMessage CreateShmAttachMessage(const std::string &appId, const std::string &token) {
+    return CreateRpcMessage(appId, "shm-attach", ShmAttachMessage{token});
 }
\ No newline at end of file
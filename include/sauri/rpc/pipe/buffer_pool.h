@@ -0,0 +1,62 @@
+//
+// Created by Right on 25/6/6 10:05.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Reference-counted message buffer. Queues and readers share one allocation;
+// when the last handle goes away the storage returns to the pool it came from.
+using MessageBuffer = std::shared_ptr<std::string>;
+using SharedBuffer = std::shared_ptr<const std::string>;
+
+// A view into a shared buffer that keeps the buffer alive
+struct BufferSlice {
+    SharedBuffer buffer;
+    std::size_t offset = 0;
+    std::size_t size = 0;
+
+    std::string_view view() const {
+        return buffer ? std::string_view(buffer->data() + offset, size) : std::string_view();
+    }
+
+    bool empty() const { return size == 0; }
+};
+
+class BufferPool {
+public:
+    // Buffers grown beyond max_pooled_capacity are freed instead of recycled
+    explicit BufferPool(std::size_t max_pooled_buffers = 256,
+                        std::size_t max_pooled_capacity = 4 * 1024 * 1024);
+
+    ~BufferPool();
+
+    BufferPool(const BufferPool &) = delete;
+
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // Process-wide pool used by the transport and the serializers
+    static BufferPool &shared();
+
+    // Empty buffer with at least min_capacity bytes reserved
+    MessageBuffer acquire(std::size_t min_capacity = 0);
+
+    // Pooled copy of data
+    MessageBuffer copy(std::string_view data);
+
+    std::size_t pooled() const;
+
+private:
+    struct State;
+
+    static void release(const std::shared_ptr<State> &state, std::string *buffer);
+
+    // Shared with outstanding buffers so they can be released after the pool is gone
+    std::shared_ptr<State> state_;
+};
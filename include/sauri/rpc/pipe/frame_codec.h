@@ -0,0 +1,136 @@
+//
+// Created by Right on 25/6/4 09:30.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "boost/asio/buffer.hpp"
+#include "buffer_pool.h"
+
+// How messages are delimited on the byte stream
+enum class FrameMode {
+    // 4-byte little-endian length header followed by the payload
+    length_prefixed,
+    // Legacy mode: payload terminated by '\n'
+    delimited,
+};
+
+// Frame header layout for FrameMode::length_prefixed.
+// The low 28 bits carry the payload length, the upper 4 bits are reserved for frame flags.
+constexpr std::size_t kFrameHeaderSize = 4;
+constexpr uint32_t kFrameLengthMask = 0x0FFFFFFF;
+// The payload is compressed with the algorithm negotiated for the connection (see FrameCompressor)
+constexpr uint32_t kFrameCompressed = 0x10000000;
+// Raw bytes belonging to the next message frame, which refers to them by position (see Blob)
+constexpr uint32_t kFrameAttachment = 0x20000000;
+constexpr std::size_t kDefaultMaxFrameSize = 64 * 1024 * 1024;
+
+// Append one framed payload to out
+void append_frame(std::string &out, std::string_view payload, FrameMode mode);
+
+// Frame a single payload
+std::string encode_frame(std::string_view payload, FrameMode mode);
+
+// Frame a payload in place: begin_frame() reserves the header and returns the frame start,
+// the caller appends the payload, then end_frame() fills in the header or the delimiter.
+// Flags only exist in FrameMode::length_prefixed.
+//   auto start = begin_frame(*buffer, mode);
+//   serialize_into(*buffer);
+//   end_frame(*buffer, start, mode);
+std::size_t begin_frame(std::string &out, FrameMode mode);
+
+void end_frame(std::string &out, std::size_t frame_start, FrameMode mode, uint32_t flags = 0);
+
+// Payload of a single framed buffer
+std::string_view frame_payload(std::string_view frame, FrameMode mode);
+
+// Header flags of a single framed buffer; always 0 in FrameMode::delimited
+uint32_t frame_flags(std::string_view frame, FrameMode mode);
+
+// Piece of a frame handed out as it arrives (see FrameDecoder::set_stream_threshold)
+struct FrameChunk {
+    BufferSlice data;
+    // Position of data in the frame's payload
+    std::size_t offset = 0;
+    // Payload size of the whole frame
+    std::size_t total = 0;
+
+    bool first() const { return offset == 0; }
+
+    bool last() const { return offset + data.size == total; }
+};
+
+// Incremental frame parser over a growable receive buffer.
+//
+// Usage from a read loop:
+//   stream.async_read_some(decoder.prepare(), ...);
+//   decoder.commit(n);
+//   std::string_view frame;
+//   while (decoder.next(frame)) { ... }
+//
+// Views stay valid until the next prepare() call. Slices share the pooled receive buffer and
+// stay valid for as long as they are held; the decoder switches to a fresh buffer instead of
+// compacting one that is still referenced.
+class FrameDecoder {
+public:
+    explicit FrameDecoder(FrameMode mode = FrameMode::length_prefixed,
+                          std::size_t max_frame_size = kDefaultMaxFrameSize);
+
+    // Writable region for the next read, at least min_size bytes
+    boost::asio::mutable_buffer prepare(std::size_t min_size = 64 * 1024);
+
+    // Mark n bytes of the prepared region as received
+    void commit(std::size_t n);
+
+    // Extract the next complete frame. Throws std::runtime_error on an oversized frame, or on
+    // a frame with flags that were not accepted.
+    bool next(std::string_view &frame);
+
+    bool next(BufferSlice &frame);
+
+    // Also report the frame's flags
+    bool next(BufferSlice &frame, uint32_t &flags);
+
+    // Next piece of a streamed frame. While one is in progress next() returns false, so a read
+    // loop calls next() and then next_chunk() until both return false.
+    bool next_chunk(FrameChunk &chunk);
+
+    // Frames whose payload is at least threshold bytes are not assembled: their bytes are handed
+    // out by next_chunk() as they arrive. Only plain frames in FrameMode::length_prefixed are
+    // streamed; compressed and attachment frames are always assembled. 0, the default, turns
+    // streaming off.
+    void set_stream_threshold(std::size_t threshold) { stream_threshold_ = threshold; }
+
+    // Header flags next() lets through; none by default
+    void set_accepted_flags(uint32_t flags) { accepted_flags_ = flags & ~kFrameLengthMask; }
+
+    std::size_t max_frame_size() const { return max_frame_size_; }
+
+    void set_mode(FrameMode mode);
+
+    FrameMode mode() const { return mode_; }
+
+    // Bytes received but not yet returned as frames
+    std::size_t buffered() const { return end_ - begin_; }
+
+    void reset();
+
+private:
+    bool next_range(std::size_t &offset, std::size_t &length, uint32_t &flags);
+
+    FrameMode mode_;
+    std::size_t max_frame_size_;
+    uint32_t accepted_flags_ = 0;
+    // size() is the usable capacity; [begin_, end_) holds unconsumed bytes
+    MessageBuffer buffer_;
+    std::size_t begin_ = 0;   // first unconsumed byte
+    std::size_t end_ = 0;     // one past the last received byte
+    std::size_t scanned_ = 0; // delimited mode: bytes already searched for '\n'
+    std::size_t pending_ = 0; // length_prefixed mode: size of the frame being assembled
+    std::size_t stream_threshold_ = 0;
+    std::size_t stream_total_ = 0;     // payload size of the frame being streamed
+    std::size_t stream_remaining_ = 0; // bytes of it not handed out yet
+};
@@ -0,0 +1,82 @@
+//
+// Created by Right on 25/6/13 17:20.
+//
+
+#pragma once
+
+#if defined(SAURI_ENABLE_LZ4)
+#define SAURI_HAS_LZ4 1
+#endif
+#if defined(SAURI_ENABLE_ZSTD)
+#define SAURI_HAS_ZSTD 1
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "buffer_pool.h"
+
+enum class Compression {
+    none,
+    // Fast, modest ratio; builds with SAURI_ENABLE_LZ4 only
+    lz4,
+    // Better ratio at a higher CPU cost; builds with SAURI_ENABLE_ZSTD only
+    zstd,
+};
+
+// Payloads below this size are not worth a compression pass
+constexpr std::size_t kDefaultCompressionThreshold = 64 * 1024;
+
+struct CompressionOptions {
+    Compression algorithm = Compression::none;
+    // Smaller payloads go out as they are
+    std::size_t threshold = kDefaultCompressionThreshold;
+    // zstd compression level, or lz4 acceleration; 0 picks the library default
+    int level = 0;
+};
+
+// Name used in the handshake: "lz4", "zstd" or "none"
+std::string_view compression_name(Compression algorithm);
+
+std::optional<Compression> compression_from_name(std::string_view name);
+
+// False for algorithms this build was compiled without
+bool compression_supported(Compression algorithm);
+
+// Names of the algorithms this build supports, most preferred first
+std::vector<std::string> supported_compressions();
+
+// Compresses and decompresses the frames of one connection, reusing the library contexts between
+// frames. Not thread-safe; a session only touches it on its strand.
+//
+// A compressed frame carries kFrameCompressed in its header; its payload is the original size as
+// a 4-byte little-endian integer followed by the compressed bytes.
+class FrameCompressor {
+public:
+    explicit FrameCompressor(const CompressionOptions &options);
+
+    ~FrameCompressor();
+
+    FrameCompressor(const FrameCompressor &) = delete;
+
+    FrameCompressor &operator=(const FrameCompressor &) = delete;
+
+    // Length-prefixed frame with the compressed payload, or nullptr when the payload is below
+    // the threshold or does not get smaller
+    SharedBuffer compress(std::string_view payload);
+
+    // Payload of a compressed frame. Throws std::runtime_error on corrupt data or when the
+    // original size exceeds max_size.
+    BufferSlice decompress(std::string_view payload, std::size_t max_size);
+
+    const CompressionOptions &options() const { return options_; }
+
+private:
+    struct Contexts;
+
+    CompressionOptions options_;
+    std::unique_ptr<Contexts> contexts_;
+};
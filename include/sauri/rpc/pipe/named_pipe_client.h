@@ -3,49 +3,180 @@
 #include <iostream>
 #include <string>
 #include <memory>
-#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string_view>
 #include "boost/asio.hpp"
+#include "pipe_stream.h"
+#include "frame_codec.h"
+#include "pipe_session.h"
 
 namespace asio = boost::asio;
 
+// Retry schedule for start(): exponential backoff with jitter, so apps that lost the same dock
+// do not all reconnect in lockstep
+struct ReconnectPolicy {
+    // Keep reconnecting after the connection drops; when false start() still retries until the
+    // first connection, but a drop is final
+    bool enabled = true;
+    std::chrono::milliseconds initial_delay{20};
+    std::chrono::milliseconds max_delay{500};
+    double multiplier = 2.0;
+    // Each delay is scaled by a random factor in [1 - jitter, 1 + jitter]
+    double jitter = 0.2;
+};
+
+enum class ConnectionState {
+    disconnected,
+    // Connecting, or waiting for the next attempt
+    connecting,
+    connected,
+};
+
+struct ConnectionStats {
+    ConnectionState state = ConnectionState::disconnected;
+    uint64_t connect_attempts = 0;
+    uint64_t connect_failures = 0;
+    uint64_t connects = 0;
+    uint64_t disconnects = 0;
+    // From start() or the last drop until connected again, for the most recent connection
+    std::chrono::milliseconds last_recovery_time{0};
+};
+
 class NamedPipeClient : public std::enable_shared_from_this<NamedPipeClient> {
 public:
-    using MessageHandler = std::function<void(const std::string&)>;
+    using MessageHandler = std::function<void(std::string_view)>;
     using ConnectionHandler = std::function<void(bool)>;
+    using WritableHandler = std::function<void()>;
+    using AttachmentHandler = std::function<void(const BufferSlice &)>;
 
-    NamedPipeClient(asio::io_context& io_context, std::string  server_name);
+    NamedPipeClient(asio::io_context& io_context, std::string  server_name,
+                    FrameMode frame_mode = FrameMode::length_prefixed);
 
-    // connect to the named pipe server
+    // connect to the named pipe server, blocking; a single attempt
     bool connect();
 
-    // send a message to the server
-    void write(const std::string& message);
+    // connect in the background, retrying per the reconnect policy; the connection handler
+    // reports each connect and drop. close() stops it.
+    void start();
+
+    // send a message to the server, framed according to the frame mode.
+    // returns false if not connected or the overflow policy dropped the message
+    bool write(const std::string& message, OverflowPolicy policy = OverflowPolicy::block);
+
+    // send an already framed buffer without copying it
+    bool write(SharedBuffer frame, OverflowPolicy policy = OverflowPolicy::block);
 
-    // set message handler
+    // send framed buffers back to back, e.g. attachments followed by their message
+    bool write(std::vector<SharedBuffer> frames, OverflowPolicy policy = OverflowPolicy::block);
+
+    // set message handler, called once per complete frame
     void set_message_handler(MessageHandler handler);
 
+    // set the framing used on the stream; call before connect()
+    void set_frame_mode(FrameMode mode);
+
+    FrameMode frame_mode() const { return frame_mode_; }
+
+    // cap on bytes per gather write; call before connect()
+    void set_max_write_batch(std::size_t bytes);
+
+    // watermarks for the write queue; call before connect()
+    void set_write_queue_limits(const WriteQueueLimits &limits);
+
+    // called when a full write queue drains below the low watermark; call before connect()
+    void set_writable_handler(WritableHandler handler);
+
+    // accept attachment frames, passed to the handler before the message they belong to;
+    // call before connect()
+    void set_attachment_handler(AttachmentHandler handler);
+
+    // keepalive for the connection; call before connect()
+    void set_heartbeat(const HeartbeatOptions &options);
+
+    // compress frames on the current connection once the server agreed to it; a reconnect starts
+    // uncompressed. false if not connected or the connection cannot use the algorithm
+    bool set_compression(const CompressionOptions &options);
+
+    // false while the write queue is above its high watermark
+    bool is_writable() const;
+
+    // block until the write queue is writable; false on timeout or disconnect
+    bool wait_writable(std::chrono::milliseconds timeout);
+
+    // called with true on every (re)connect and false on every drop; call before connecting
     void set_connection_handler(ConnectionHandler handler);
 
+    // call before start()
+    void set_reconnect_policy(const ReconnectPolicy &policy);
+
+    ConnectionState state() const { return state_; }
+
+    ConnectionStats stats() const;
+
     void close();
 
     bool is_connected() const;
 
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    // Attach a shared-memory channel offered by the server: opens a side connection, sends
+    // attach_request on it and maps the descriptors that come back. Messages then travel through
+    // the channel; the main connection stays open for oversized messages and liveness.
+    bool attach_shm(const std::string &attach_request);
+#endif
+
 private:
-    void start_read();
+    void start_session(pipe_stream stream);
 
-    void handle_read(const boost::system::error_code& ec, std::size_t bytes_transferred);
+    // The rest run on strand_
+    void try_connect();
 
-    void do_write();
+    void on_connect_failed();
+
+    void schedule_retry();
+
+    void on_session_closed(uint64_t generation);
+
+    void stop_connecting();
+
+    std::shared_ptr<PipeSession> current_session() const;
 
     asio::io_context& io_context_;
+    asio::strand<asio::io_context::executor_type> strand_;
     std::string server_name_;
-    std::unique_ptr<asio::windows::stream_handle> pipe_;
-    std::vector<char> buffer_;
-    bool connected_;
-
-    asio::io_context::strand strand_{io_context_};
-    std::deque<std::string> write_queue_{};
+    // Read loop, framing and write queue live in the session. Replaced on reconnect while
+    // writers copy it, so only read through current_session().
+    mutable std::mutex session_mutex_;
+    std::shared_ptr<PipeSession> session_;
+    FrameMode frame_mode_;
+    std::size_t max_write_batch_;
+    WriteQueueLimits write_queue_limits_;
+    HeartbeatOptions heartbeat_;
+    std::atomic<bool> connected_;
+    // Set by start(), cleared by close(): whether dropped connections are re-established
+    std::atomic<bool> wanted_;
+    // Bumped per session so a late close from an old session is ignored
+    std::atomic<uint64_t> generation_;
+    std::atomic<ConnectionState> state_;
+
+    ReconnectPolicy reconnect_;
+    asio::steady_timer retry_timer_;
+#if !defined(_WIN32)
+    std::unique_ptr<pipe_stream> connecting_;
+#endif
+    unsigned retry_count_;
+    std::mt19937 rng_;
+    std::chrono::steady_clock::time_point down_since_;
+    std::atomic<uint64_t> connect_attempts_;
+    std::atomic<uint64_t> connect_failures_;
+    std::atomic<uint64_t> connects_;
+    std::atomic<uint64_t> disconnects_;
+    std::atomic<int64_t> last_recovery_ms_;
 
     MessageHandler message_handler_;
     ConnectionHandler connection_handler_;
+    WritableHandler writable_handler_;
+    AttachmentHandler attachment_handler_;
 };
\ No newline at end of file
@@ -8,27 +8,80 @@
 #include <thread>
 #include <functional>
 #include <atomic>
-#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <string_view>
 #include "boost/asio.hpp"
 #include "boost/bind/bind.hpp"
-
-using boost::asio::windows::stream_handle;
+#include "pipe_stream.h"
+#include "frame_codec.h"
+#include "pipe_session.h"
 
 // Define callback function types
-using message_handler = std::function<void(const std::string &)>;
+using message_handler = std::function<void(session_id, const BufferSlice &)>;
 using error_handler = std::function<void(const boost::system::error_code &)>;
-using connect_handler = std::function<void()>;
-using disconnect_handler = std::function<void()>;
+using connect_handler = std::function<void(session_id)>;
+using disconnect_handler = std::function<void(session_id)>;
+using writable_handler = std::function<void(session_id)>;
+using attachment_handler = std::function<void(session_id, const BufferSlice &)>;
+using chunk_handler = std::function<void(session_id, const FrameChunk &)>;
+
+// What runs the sessions' reads and writes
+enum class IoBackend {
+    // The asio reactor: epoll on Linux, IOCP on Windows
+    asio,
+    // io_uring; Linux builds with SAURI_ENABLE_IO_URING only. Falls back to asio when the
+    // kernel cannot run it.
+    io_uring,
+};
 
-class NamedPipeServer {
+// Must be owned by a std::shared_ptr: pending accepts and the sessions' callbacks hold it weakly.
+class NamedPipeServer : public std::enable_shared_from_this<NamedPipeServer> {
 public:
-    NamedPipeServer(boost::asio::io_context &io_context, const std::string &pipe_name);
+    NamedPipeServer(boost::asio::io_context &io_context, const std::string &pipe_name,
+                    FrameMode frame_mode = FrameMode::length_prefixed);
 
     ~NamedPipeServer();
 
-    // Set handler for incoming messages
+    // Set handler for incoming messages, called once per complete frame with the sending session.
+    // The slice shares the pooled receive buffer; keep a copy of it to use the frame later.
     void set_message_handler(message_handler handler);
 
+    // Set the framing used on the stream; call before start()
+    void set_frame_mode(FrameMode mode);
+
+    FrameMode frame_mode() const { return frame_mode_; }
+
+    // Maximum number of concurrent client sessions; call before start()
+    void set_max_sessions(std::size_t max_sessions);
+
+    // Cap on bytes per gather write for sessions accepted after the call
+    void set_max_write_batch(std::size_t bytes);
+
+    // Watermarks for each session's write queue, for sessions accepted after the call
+    void set_write_queue_limits(const WriteQueueLimits &limits);
+
+    // Called when a session's full write queue drains below the low watermark
+    void set_writable_handler(writable_handler handler);
+
+    // Accept attachment frames, for sessions accepted after the call. Each is passed to the
+    // handler on the session's strand, before the message frame it belongs to.
+    void set_attachment_handler(attachment_handler handler);
+
+    // Pass frames of at least threshold bytes to the handler piece by piece as they arrive
+    // instead of to the message handler once complete, for sessions accepted after the call.
+    // FrameMode::length_prefixed only; a null handler turns it off.
+    void set_chunk_handler(chunk_handler handler, std::size_t threshold);
+
+    // Keepalive for sessions accepted after the call; off by default
+    void set_heartbeat(const HeartbeatOptions &options);
+
+    // Pick the I/O backend; call before start()
+    void set_io_backend(IoBackend backend);
+
+    // Backend in use, after any fallback in start()
+    IoBackend io_backend() const { return io_backend_; }
+
     // Set handler for errors
     void set_error_handler(error_handler handler);
 
@@ -42,42 +95,110 @@ public:
 
     void stop();
 
-    // Write payload to the connected client
+    // Write payload to one client session.
+    // Returns false if the session is gone or the overflow policy dropped the message.
+    bool write(session_id session, std::string_view message, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Write an already framed buffer to one client without copying it
+    bool write(session_id session, SharedBuffer frame, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Write framed buffers back to back, e.g. attachments followed by their message
+    bool write(session_id session, std::vector<SharedBuffer> frames, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Write payload to every connected client
+    void broadcast(std::string_view message, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Write an already framed buffer to every connected client; all sessions share the buffer.
+    // The policy applies to each session on its own, so one slow client does not hold up the rest
+    // unless the policy is block.
+    void broadcast(SharedBuffer frame, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Same as broadcast(), kept for single-client callers
     void write(const std::string &message);
 
-    // Check if a client is connected
+    // Check if at least one client is connected
     bool is_connected() const;
 
+    std::size_t session_count() const;
+
+    // Ids of the connected sessions
+    std::vector<session_id> session_ids() const;
+
+    // False while the session's write queue is above its high watermark, or the session is gone
+    bool is_writable(session_id session) const;
+
+    // Compress the session's frames once the peer agreed to it, e.g. in a handshake; writes
+    // queued before the call are sent as they are. False if the session is gone or the
+    // session cannot use the algorithm, e.g. it already compresses with another one
+    // (see PipeSession::set_compression).
+    bool set_compression(session_id session, const CompressionOptions &options);
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    // Create a shared-memory channel bound to the session's strand. Returns nullptr if the
+    // session is gone.
+    std::shared_ptr<ShmChannel> create_shm_channel(session_id session,
+                                                   std::size_t ring_size = kDefaultShmRingSize);
+
+    // Route the session's messages through channel from now on
+    bool attach_shm(session_id session, std::shared_ptr<ShmChannel> channel);
+
+    // Pass descriptors to the client connected on session
+    bool send_fds(session_id session, std::vector<int> fds);
+#endif
+
 private:
     void create_pipe();
 
     void wait_for_connection();
 
-    void close_pipe();
+#if !defined(_WIN32)
+    // Report a failed accept and accept again after a backoff
+    void retry_accept(const boost::system::error_code &ec);
+#endif
 
-    void start_read();
+    void accept_next();
 
-    void do_write();
+    void close_pipe();
 
-    void handle_error(const boost::system::error_code &ec);
+    void add_session(pipe_stream stream);
 
-    void start_client_check_timer();
+    void remove_session(session_id id, const boost::system::error_code &ec);
 
-    void check_client_connection();
+    std::shared_ptr<PipeSession> find_session(session_id id) const;
 
-    bool check_pipe_connected();
+    std::vector<std::shared_ptr<PipeSession>> snapshot_sessions() const;
 
     boost::asio::io_context &io_context_;
     std::string pipe_name_;
     boost::asio::strand<boost::asio::io_context::executor_type> strand_;
-    stream_handle pipe_;
-    boost::asio::steady_timer timer_;
-    std::vector<char> buffer_;
-    std::deque<std::string> write_queue_;
-    std::atomic<bool> is_connected_;
+#if !defined(_WIN32)
+    std::unique_ptr<pipe_acceptor> acceptor_;
+#endif
+    // Pipe instance (Windows) or socket (POSIX) waiting for the next client
+    pipe_stream pipe_;
+    // Backoff after a failed accept (POSIX)
+    boost::asio::steady_timer accept_retry_timer_;
+    std::chrono::milliseconds accept_retry_delay_;
+    FrameMode frame_mode_;
+    std::size_t max_sessions_;
+    std::size_t max_write_batch_;
+    WriteQueueLimits write_queue_limits_;
+    HeartbeatOptions heartbeat_;
+    std::size_t stream_threshold_ = 0;
+    IoBackend io_backend_;
+#if defined(SAURI_HAS_IO_URING)
+    std::shared_ptr<UringService> uring_;
+#endif
+    bool accepting_;
+    session_id next_session_id_;
+    mutable std::mutex sessions_mutex_;
+    std::unordered_map<session_id, std::shared_ptr<PipeSession>> sessions_;
     std::atomic<bool> is_stopped_;
     message_handler on_message_;
     error_handler on_error_;
     connect_handler on_connect_;
     disconnect_handler on_disconnect_;
+    writable_handler on_writable_;
+    attachment_handler on_attachment_;
+    chunk_handler on_chunk_;
 };
@@ -0,0 +1,253 @@
+//
+// Created by Right on 25/6/5 14:20.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "boost/asio.hpp"
+#include "pipe_stream.h"
+#include "frame_codec.h"
+#include "frame_compressor.h"
+#include "buffer_pool.h"
+#include "../shm/shm_channel.h"
+#include "../uring/uring_service.h"
+
+using session_id = uint64_t;
+
+// Upper bound on bytes handed to one gather write
+constexpr std::size_t kDefaultMaxWriteBatch = 256 * 1024;
+// Buffers per gather write; asio passes at most 64 iovecs to one writev
+constexpr std::size_t kMaxWriteBatchBuffers = 64;
+
+// What write() does when the session's queue is above its high watermark
+enum class OverflowPolicy {
+    // Wait until the queue drains below the low watermark. Callers on an I/O thread are never
+    // blocked; their message is queued over the limit instead.
+    block,
+    // Accept the message and discard the oldest messages not yet handed to the stream
+    drop_oldest,
+    // Discard the message; write() returns false
+    drop_newest,
+};
+
+// Watermarks for unsent messages on one session. A queue that reached either high watermark
+// stays "full" until both bytes and count are back at or below the low watermarks.
+struct WriteQueueLimits {
+    std::size_t high_watermark_bytes = 16 * 1024 * 1024;
+    std::size_t low_watermark_bytes = 4 * 1024 * 1024;
+    std::size_t high_watermark_count = 8192;
+    std::size_t low_watermark_count = 2048;
+};
+
+// Application-level keepalive for connections that stay open on a peer that stopped responding.
+// Off by default: a peer that exits is already detected by the read loop.
+struct HeartbeatOptions {
+    // Send an empty frame after this long without writing anything; zero disables
+    std::chrono::milliseconds interval{0};
+    // Close the session after this long without receiving anything, checked once per interval;
+    // zero disables. The peer must send heartbeats or traffic at least this often.
+    std::chrono::milliseconds timeout{0};
+};
+
+// One connected peer: owns the stream, its read loop and its write queue.
+// All I/O for a session runs on the session's own strand.
+class PipeSession : public std::enable_shared_from_this<PipeSession> {
+public:
+    // The slice shares the receive buffer; hold on to it to use the frame after the call
+    using frame_handler = std::function<void(session_id, const BufferSlice &)>;
+    using close_handler = std::function<void(session_id, const boost::system::error_code &)>;
+    // Called on the session's strand when a full queue drains below the low watermark
+    using writable_handler = std::function<void(session_id)>;
+    // Called on the session's strand with each attachment frame, ahead of the frame it belongs to
+    using attachment_handler = std::function<void(session_id, const BufferSlice &)>;
+    // Called on the session's strand with each piece of a large frame, in order
+    using chunk_handler = std::function<void(session_id, const FrameChunk &)>;
+
+    PipeSession(session_id id, pipe_stream stream, FrameMode frame_mode);
+
+    // Start the read loop. on_frame is called once per complete frame;
+    // on_close is called exactly once when the session ends.
+    void start(frame_handler on_frame, close_handler on_close);
+
+    // Queue a payload; it is copied into a pooled buffer and framed.
+    // Everything queued while a write is in flight goes out in the next gather write.
+    // Returns false if the session is closed or the message was dropped by the policy.
+    bool write(std::string_view message, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Queue an already framed buffer (see begin_frame/end_frame) without copying it.
+    // The same buffer may be queued on several sessions.
+    bool write(SharedBuffer frame, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Queue framed buffers back to back, e.g. attachments and the message that refers to them:
+    // nothing else is queued between them and drop_oldest never drops part of the group.
+    // They always go over the stream, even with a shared-memory channel attached.
+    bool write(std::vector<SharedBuffer> frames, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Call before start()
+    void set_write_queue_limits(const WriteQueueLimits &limits) { limits_ = limits; }
+
+    void set_writable_handler(writable_handler handler) { on_writable_ = std::move(handler); }
+
+    // Accept attachment frames from the peer (FrameMode::length_prefixed only); without a
+    // handler they are a framing error. Call before start().
+    void set_attachment_handler(attachment_handler handler) { on_attachment_ = std::move(handler); }
+
+    // Hand frames of at least threshold bytes to the handler piece by piece as they arrive,
+    // instead of assembling them for the frame handler (see FrameDecoder::set_stream_threshold).
+    // Call before start().
+    void set_chunk_handler(chunk_handler handler, std::size_t threshold);
+
+    // Call before start()
+    void set_heartbeat(const HeartbeatOptions &options) { heartbeat_ = options; }
+
+    // False while the queue is above its high watermark
+    bool is_writable() const { return !full_; }
+
+    // Block until the queue is writable or the session closes; false on timeout or close
+    bool wait_writable(std::chrono::milliseconds timeout);
+
+    // Unsent bytes and messages, including those still on their way to the strand
+    std::size_t queued_bytes() const { return queued_bytes_; }
+
+    std::size_t queued_count() const { return queued_count_; }
+
+    // Messages discarded by drop_oldest / drop_newest
+    uint64_t dropped_count() const { return dropped_count_; }
+
+    FrameMode frame_mode() const { return frame_mode_; }
+
+    // Cap on bytes per gather write; one oversized message is still written on its own
+    void set_max_write_batch(std::size_t bytes) { max_write_batch_ = bytes; }
+
+    // Compress outgoing frames at or above the threshold and accept compressed frames from the
+    // peer, once every write queued before the call has been handled. FrameMode::length_prefixed
+    // only; returns false otherwise, if the build lacks the algorithm, or if the session already
+    // uses another one. Compression::none stops compressing outgoing frames, while compressed
+    // frames from the peer are still accepted.
+    bool set_compression(const CompressionOptions &options);
+
+    // Producers blocked on a full queue return at once; the stream closes on the strand
+    void close();
+
+    bool is_open() const { return open_; }
+
+    session_id id() const { return id_; }
+
+    // Executor all of this session's handlers run on
+    boost::asio::any_io_executor executor() const { return strand_; }
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    // Move message traffic onto a shared-memory channel created on executor().
+    // Messages too large for the ring still go over the stream, which also stays
+    // the liveness signal: when it closes the channel is closed with it.
+    void attach_shm(std::shared_ptr<ShmChannel> channel);
+
+    // Pass descriptors to the peer over the underlying socket, after any queued writes
+    void send_fds(std::vector<int> fds);
+#endif
+
+#if defined(SAURI_HAS_IO_URING)
+    // Run the read loop and writes on an io_uring instead of the asio reactor; call before start()
+    void use_uring(std::shared_ptr<UringService> uring);
+#endif
+
+private:
+    void start_read();
+
+    // Feed bytes_transferred newly received bytes to the decoder; false once the session closed
+    bool on_read(std::size_t bytes_transferred);
+
+    // Compress the frame if it qualifies and append it to the write queue
+    void enqueue(SharedBuffer frame);
+
+    // Header flags the decoder lets through, for the handlers and compression in place
+    void update_accepted_flags();
+
+    // Count a write before it reaches the strand; false if the policy drops it
+    bool admit(std::size_t bytes, std::size_t count, OverflowPolicy policy);
+
+    void do_write();
+
+    void start_heartbeat();
+
+    void close(const boost::system::error_code &ec);
+
+    bool above_high_watermark(std::size_t incoming_bytes, std::size_t incoming_count) const;
+
+    bool below_low_watermark() const;
+
+    // Account for messages that left the queue
+    void release(std::size_t count, std::size_t bytes);
+
+    // Leave the full state: wake blocked producers and call the writable handler
+    void mark_writable();
+
+    // Wake producers blocked in admit() so they see the session closed
+    void wake_blocked_writers();
+
+    void drop_oldest();
+
+    // True on a thread running the session's io_context, where blocking would deadlock
+    bool on_io_thread() const;
+
+    session_id id_;
+    pipe_stream stream_;
+    boost::asio::strand<pipe_stream::executor_type> strand_;
+    FrameMode frame_mode_;
+    FrameDecoder decoder_;
+    HeartbeatOptions heartbeat_;
+    boost::asio::steady_timer heartbeat_timer_;
+    // Only touched on the strand. Once set, kept for decoding even if compression is turned off.
+    std::unique_ptr<FrameCompressor> compressor_;
+    bool compress_outgoing_ = false;
+    // Algorithm negotiated for the session; none until the first set_compression()
+    std::atomic<Compression> compression_{Compression::none};
+    std::chrono::steady_clock::time_point last_read_;
+    std::chrono::steady_clock::time_point last_write_;
+    std::deque<SharedBuffer> write_queue_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+#if defined(_WIN32)
+    // Pipe handles write one buffer per WriteFile, so batches are linearized
+    std::string write_staging_;
+#endif
+    std::size_t max_write_batch_ = kDefaultMaxWriteBatch;
+    std::size_t write_batch_count_ = 0;
+    bool write_in_progress_ = false;
+    WriteQueueLimits limits_;
+    std::atomic<std::size_t> queued_bytes_{0};
+    std::atomic<std::size_t> queued_count_{0};
+    std::atomic<uint64_t> dropped_count_{0};
+    // Set by producers under writable_mutex_, cleared on the strand once below the low watermark
+    std::atomic<bool> full_{false};
+    std::mutex writable_mutex_;
+    std::condition_variable writable_cv_;
+    std::atomic<bool> open_{false};
+    std::atomic<bool> closed_{false};
+    frame_handler on_frame_;
+    close_handler on_close_;
+    writable_handler on_writable_;
+    attachment_handler on_attachment_;
+    chunk_handler on_chunk_;
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    std::shared_ptr<ShmChannel> shm_;
+#endif
+#if defined(SAURI_HAS_IO_URING)
+    void start_uring_read();
+
+    std::shared_ptr<UringService> uring_;
+    std::shared_ptr<UringService::BufferGroup> uring_buffers_;
+    uint64_t uring_receive_ = 0;
+    uint64_t uring_send_ = 0;
+#endif
+};
@@ -0,0 +1,23 @@
+//
+// Created by Right on 25/6/3 10:12.
+//
+
+#pragma once
+
+#include <string>
+#include "boost/asio.hpp"
+
+// Stream type used by the pipe transport, picked per platform:
+// Windows named pipes on Windows, Unix domain sockets everywhere else.
+#if defined(_WIN32)
+using pipe_stream = boost::asio::windows::stream_handle;
+#else
+using pipe_stream = boost::asio::local::stream_protocol::socket;
+using pipe_acceptor = boost::asio::local::stream_protocol::acceptor;
+using pipe_endpoint = boost::asio::local::stream_protocol::endpoint;
+#endif
+
+// Map a logical pipe name to the platform path.
+// Windows: \\.\pipe\<name>
+// POSIX:   /tmp/<name>.sock, or the name itself when it is already an absolute path
+std::string resolve_pipe_path(const std::string &pipe_name);
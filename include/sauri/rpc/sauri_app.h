@@ -9,22 +9,63 @@
 #include <functional>
 #include <thread>
 #include <mutex>
+#include <array>
 #include <atomic>
-#include <queue>
+#include <optional>
+#include <stdexcept>
 #include <unordered_set>
 #include "pipe/named_pipe_client.h"
 #include "pipe/named_pipe_server.h"
+#include "codec/message_codec.h"
+#include "codec/envelope.h"
+#include "codec/request_stream.h"
+#include "exec/work_stealing_executor.h"
+#include "async.h"
+#include "blob.h"
+#include "method_table.h"
 #include "nlohmann/json.hpp"
 #include "model.h"
 #include "detail/call_impl.h"
+#include "detail/json_writer.h"
+#include "detail/event_writer.h"
 
 using json = nlohmann::json;
 
+// Requests at least this large are parsed while they arrive (see setStreamThreshold())
+constexpr std::size_t kDefaultStreamThreshold = 1024 * 1024;
+
+class SauriApplication;
+
+// An event with its envelope encoded once by SauriApplication::prepareEvent(), for events
+// emitted often: each emission only adds the ids, timestamp and data. Must not outlive the
+// application.
+class PreparedEvent {
+public:
+    // Broadcast to every connected dock session, like SauriApplication::emitEvent()
+    void emit(const json &data) const;
+
+    // Same with data that is already JSON text, like SauriApplication::emitEncodedEvent()
+    void emitEncoded(std::string_view data) const;
+
+    const std::string &name() const { return name_; }
+
+private:
+    friend class SauriApplication;
+
+    PreparedEvent(SauriApplication *app, std::string name, rpc::detail::event_writer writer)
+            : app_(app), name_(std::move(name)), writer_(std::move(writer)) {}
+
+    SauriApplication *app_;
+    std::string name_;
+    rpc::detail::event_writer writer_;
+};
+
 class SauriApplication {
 public:
     using MessageCallback = std::function<void(const json &, json &)>;
 
-    // Constructor with app information
+    // Constructor with app information. workerThreads sizes the pool that runs bound functions;
+    // 0 or less means one worker per core.
     SauriApplication(
             std::string appId,
             std::string name,
@@ -39,39 +80,217 @@ public:
 
     ~SauriApplication();
 
-    // Initialize local pipe server
+    // Select the stream framing for both pipes; call before initialize().
+    // Defaults to FrameMode::delimited, which is what released docks speak.
+    void setFrameMode(FrameMode mode);
+
+    // Offer a shared-memory channel to docks that announce "shm" in handshake step 1.
+    // The pipe stays open as the control channel and carries messages that do not fit the ring.
+    // Linux only; ignored elsewhere.
+    void enableShmTransport(bool enable, std::size_t ringSize = 4 * 1024 * 1024);
+
+    // Watermarks for each dock session's write queue; call before initialize()
+    void setWriteQueueLimits(const WriteQueueLimits &limits);
+
+    // What emitEvent() does when a dock session's queue is full. Defaults to block;
+    // progress-style events can use drop_oldest so a stalled dock only sees the latest ones.
+    void setEventOverflowPolicy(OverflowPolicy policy);
+
+    // Called when a full dock session queue drains below its low watermark; call before initialize()
+    void setWritableHandler(std::function<void()> handler);
+
+    // Empty-frame keepalive on dock sessions, for docks that hang without closing the pipe.
+    // Off by default; call before initialize().
+    void setHeartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds timeout);
+
+    // I/O backend for dock sessions; io_uring needs a build with SAURI_ENABLE_IO_URING and falls
+    // back to asio otherwise. Call before initialize().
+    void setIoBackend(IoBackend backend);
+
+    // Ids of outgoing messages and events. Defaults to CounterIdGenerator; pass a
+    // UuidIdGenerator for the UUIDs older versions sent. Process-wide; call before initialize().
+    void setMessageIdGenerator(std::shared_ptr<MessageIdGenerator> generator);
+
+    // Codecs the app accepts when a dock offers them in handshake step 1, by name; the dock's
+    // order decides among them. Binary codecs are only picked with FrameMode::length_prefixed.
+    // Defaults to every codec in CodecRegistry; an empty list keeps every session on JSON.
+    void setCodecs(std::vector<std::string> codecs);
+
+    // Frame compression the app accepts when a dock offers it in handshake step 1, by name
+    // ("lz4", "zstd"); the dock's order decides among them. Frames below threshold bytes are sent
+    // as they are; level is the zstd level or lz4 acceleration, 0 for the library default.
+    // Needs FrameMode::length_prefixed. Defaults to every algorithm the build supports; an empty
+    // list turns compression off. Call before initialize().
+    void setCompression(std::vector<std::string> algorithms,
+                        std::size_t threshold = kDefaultCompressionThreshold, int level = 0);
+
+    // Send Blob and std::vector<uint8_t> results as raw attachment frames to docks that announce
+    // attachments in handshake step 1, instead of as arrays of numbers. Needs
+    // FrameMode::length_prefixed; on by default. Blob arguments are accepted either way.
+    void setAttachments(bool enable);
+
+    // Switch docks that announce compactEnvelope in handshake step 1 to the compact envelope
+    // (see CompactEnvelope): the appId, type and ids travel as small integers. Handlers and logs
+    // still see the expanded fields. On by default.
+    void setCompactEnvelope(bool enable);
+
+    // Requests of at least this many bytes are routed as soon as their method arrives and their
+    // params are decoded into the bound function's arguments while the rest is still coming in,
+    // on a worker that waits for the data; a request for an unknown method is answered before
+    // its body arrives. Other large frames are assembled as usual. Needs
+    // FrameMode::length_prefixed; 0 turns it off. Call before initialize().
+    void setStreamThreshold(std::size_t bytes);
+
+    // How the workers pick among the BindOptions::priority lanes: strict by default, or
+    // weighted by the given weights (high, normal, low). Call before initialize().
+    void setLaneScheduling(LaneScheduling scheduling, std::array<unsigned, kPriorityCount> weights = {8, 4, 1});
+
+    // Queueing time of the calls that ran in a lane on the app's workers, from the request's
+    // arrival (or its admission under BindOptions::maxConcurrency) to the start of its call.
+    // Dedicated pools are not included.
+    LaneStats laneStats(Priority priority) const;
+
+    // Initialize local pipe server. The bound functions are frozen first, before any request
+    // can arrive, and given numeric ids.
     bool initialize();
 
-    // Connect to Dock and register the app
+    // Connect to the dock in the background and register the app, advertising the method ids.
+    // Registration is sent again whenever the dock connection comes back, e.g. after a dock
+    // restart. Freezes the bound functions too if initialize() has not.
     bool registerSelf();
 
+    // Backoff for reaching the dock; call before registerSelf()
+    void setReconnectPolicy(const ReconnectPolicy &policy);
+
+    // Connection attempts, drops and recovery time of the dock connection
+    ConnectionStats dockConnectionStats() const;
+
     bool unregisterApp();
 
     bool startPipeServer();
 
+    // Send a message to every connected dock session
     bool sendMessage(const json &message);
 
     void exec();
 
+    // Throws std::logic_error after initialize() or registerSelf(), once the methods are frozen.
+    // func may also answer later: see rpc/async.h for the rpc::reply, rpc::task and std::future forms.
     template<typename Func>
-    void bind(const std::string &method_name, Func &&func) {
-        function_map_[method_name] = [f = std::forward<Func>(func)](const std::vector<json> &params) -> json {
-            return rpc::detail::call_with_json_params(f, params);
+    void bind(const std::string &method_name, Func &&func, const BindOptions &options = {}) {
+        if (methods_.frozen()) {
+            throw std::logic_error("bind() after the methods were frozen: " + method_name);
+        }
+        BoundMethod method;
+        // Params are decoded straight into the function's argument types, and the return value
+        // is written straight into the response
+        method.handler = [this, f = std::forward<Func>(func)](rpc::detail::wire_params &params,
+                                                              rpc::detail::result_sink &result,
+                                                              rpc::detail::completion done) {
+            rpc::detail::invoke_bound(f, params, result, std::move(done), futureWaiter_);
         };
+        method.options = options;
+        if (options.maxConcurrency > 0) {
+            method.gate = std::make_shared<ConcurrencyGate>(options.maxConcurrency);
+        }
+        if (options.dedicatedThreads > 0) {
+            method.pool = std::make_shared<WorkStealingExecutor>(options.dedicatedThreads);
+            method.pool->start();
+        }
+        function_map_[method_name] = std::move(method);
     }
 
+    // co_await app.schedule() in an rpc::task continues the coroutine on one of the app's workers
+    auto schedule() { return rpc::resume_on(executor_); }
+
     void declareEvent(const std::string &event_name);
 
     void declareEvents(const std::vector<std::string> &event_names);
 
+    // Broadcast an event to every connected dock session
     void emitEvent(const std::string &event_name, const json &data);
 
+    // Broadcast an event whose data is already serialized as one JSON value. The text goes
+    // into the message as it is and is not validated, unless a dock on a binary codec needs it
+    // re-encoded: then invalid text is logged and the event goes to no session.
+    void emitEncodedEvent(const std::string &event_name, std::string_view data);
+
+    // Encode the static parts of an event once, for repeated emission.
+    // Throws std::runtime_error if the event was not declared.
+    PreparedEvent prepareEvent(const std::string &event_name);
+
 private:
+    friend class PreparedEvent;
+
     bool connectToDock();
 
-    void handleRpcRequest(const BaseRpcMessage &message);
+    void sendRegistration();
+
+    // A complete frame from a dock session
+    void handleMessage(session_id session, const BufferSlice &frame);
+
+    // A piece of a frame at or above the stream threshold
+    void handleChunk(session_id session, const FrameChunk &chunk);
+
+    void handleRpcRequest(session_id session, Envelope message);
+
+    // Runs each request of the batch on the worker pool
+    void handleBatchRequest(session_id session, Envelope msg);
+
+    // A request from the moment its bound function is called until the response goes out
+    struct PendingCall;
+
+    // An rpc-batch-request until its last request completes
+    struct BatchCall;
+
+    // Call the bound function, and send the response once it completes. takeCall runs on the
+    // worker and may throw json::exception for a malformed request; the params are decoded
+    // before this returns. With batch, the response is for request index of that batch. gate
+    // is released once the response is out.
+    void runRpcCall(session_id session, const std::string &appId, const std::function<RpcCall()> &takeCall,
+                    std::shared_ptr<BatchCall> batch = nullptr, std::size_t index = 0,
+                    std::shared_ptr<ConcurrencyGate> gate = nullptr);
+
+    // error is what the bound function failed with, if it did
+    void finishRpcCall(PendingCall &call, std::exception_ptr error);
+
+    // Send the rpc-batch-response, with the collected responses unless the batch streamed them
+    void finishBatch(BatchCall &batch);
+
+    // Bound function called by id or by name; nullptr if there is none
+    const BoundMethod *findMethod(const std::string &name, std::optional<uint32_t> id) const;
+
+    // Post run to the lane and pool of method, once its concurrency limit admits it; method may
+    // be null for the defaults. run gets the gate it holds, to release when the call completes.
+    void scheduleCall(const BoundMethod *method,
+                      std::function<void(const std::shared_ptr<ConcurrencyGate> &)> run);
+
+    bool handleHandshake(session_id session, const HandshakeMessage &message);
+
+    void handleShmAttach(session_id session, const ShmAttachMessage &message);
 
-    bool handleHandshake(const HandshakeMessage &message);
+    // First codec in the dock's list that the app accepts, nullptr to stay on JSON
+    CodecPtr pickCodec(const std::vector<std::string> &offered) const;
+
+    // Codec negotiated with the session, JSON until then
+    CodecPtr codecFor(session_id session) const;
+
+    // First algorithm in the dock's list that the app accepts, Compression::none if there is none
+    Compression pickCompression(const std::vector<std::string> &offered) const;
+
+    // The session negotiated attachments: byte results go out as attachment frames
+    bool sendsAttachments(session_id session) const;
+
+    // Interned envelope fields of a session that switched to the compact envelope
+    std::optional<CompactEnvelope> compactFor(session_id session) const;
+
+    // Attachment frames the session sent since its last message
+    std::vector<BufferSlice> takeAttachments(session_id session);
+
+    void submitTask(std::function<void()> task);
+
+    // Add the built-in methods and freeze the table; once only
+    void freezeMethods();
 
     void startWorkerThreads();
 
@@ -86,10 +305,58 @@ private:
     std::string iconPath_;
     std::string httpUrl_;
     std::string localPath_;
+    FrameMode frameMode_ = FrameMode::delimited;
+    OverflowPolicy eventOverflowPolicy_ = OverflowPolicy::block;
+    bool shmEnabled_ = false;
+    std::size_t shmRingSize_ = 4 * 1024 * 1024;
+    std::optional<std::vector<std::string>> codecs_;
+    bool attachmentsEnabled_ = true;
+    bool compactEnabled_ = true;
+    // Per-session state negotiated in the handshake
+    mutable std::mutex sessionMutex_;
+    // Sessions that negotiated a codec other than JSON
+    std::unordered_map<session_id, CodecPtr> sessionCodecs_;
+    std::unordered_set<session_id> attachmentSessions_;
+    // Sessions on the compact envelope, with their token
+    std::unordered_map<session_id, uint32_t> sessionTokens_;
+    uint32_t lastSessionToken_ = 0;
+    std::unordered_map<session_id, std::vector<BufferSlice>> pendingAttachments_;
+    std::optional<std::vector<std::string>> compressions_;
+    CompressionOptions compression_;
+    // A large frame on its way in, one per session
+    struct StreamedFrame {
+        enum class Mode {
+            // Pieces are held until the routing fields are in
+            routing,
+            // Pieces go to the worker parsing the request
+            streaming,
+            // Not a request that can be streamed: pieces are joined into one frame at the end
+            assembling,
+            // Already answered; pieces are dropped
+            discarding,
+        };
+        Mode mode = Mode::routing;
+        std::vector<BufferSlice> chunks;
+        std::size_t received = 0;
+        std::shared_ptr<ChunkStream> stream;
+    };
+    // Entries are only touched on their session's strand; the mutex guards the map itself
+    std::mutex streamMutex_;
+    std::unordered_map<session_id, StreamedFrame> streamedFrames_;
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    // Channels offered in handshake step 2, by token, until the dock attaches
+    struct PendingShm {
+        session_id session;
+        std::shared_ptr<ShmChannel> channel;
+    };
+    std::mutex shmMutex_;
+    std::unordered_map<std::string, PendingShm> pendingShm_;
+#endif
 
     std::thread serverThread_;
     std::atomic<bool> running_;
-
+    // registerSelf() was called: re-register after the dock goes away
+    std::atomic<bool> registered_{false};
 
     std::thread clientThread_;
 
@@ -97,16 +364,41 @@ private:
     std::shared_ptr<NamedPipeServer> server_;
     asio::io_context io_context_client_;
     asio::io_context io_context_server_;
+    // Keeps the client thread alive between dock connections
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> clientWork_;
 
-    std::unordered_map<std::string, std::function<json(const json &)>> function_map_;
+    // Filled by bind(); dispatch goes through methods_, frozen before the server starts and
+    // read-only from then on
+    std::unordered_map<std::string, BoundMethod> function_map_;
+    MethodTable methods_;
     std::unordered_set<std::string> event_list_;
 
-    bool sendMessage(const BaseRpcMessage &message);
+    bool sendMessage(const BaseRpcMessage &message, OverflowPolicy policy = OverflowPolicy::block);
+
+    // Attachments go out right before the message, which refers to them
+    bool sendMessage(session_id session, const BaseRpcMessage &message, std::vector<SharedBuffer> attachments = {});
+
+    // Encode once per codec in use and write to every session
+    bool broadcastMessage(const json &message, OverflowPolicy policy);
+
+    // Call encode once per codec in use and write its frame to every session on that codec.
+    // Sessions on the compact envelope get a frame of their own, encoded with their fields.
+    // prepare, if set, runs before the first encode with whether any session uses a binary
+    // codec, taken from the same snapshot the frames follow; false from it sends nothing.
+    bool broadcastFrames(const std::function<SharedBuffer(const MessageCodec &, const CompactEnvelope *)> &encode,
+                         OverflowPolicy policy, const std::function<bool(bool binary)> &prepare = nullptr);
+
+    // Data is either *data or, when data is null, JSON text in encoded
+    void broadcastEvent(const rpc::detail::event_writer &writer, const std::string &event_name,
+                        const json *data, std::string_view encoded);
+
+    // Serialize straight into a pooled, framed buffer ready for the transport, in the compact
+    // envelope when compact is set
+    SharedBuffer encodeFrame(const json &message,
+                             const MessageCodec &codec = *CodecRegistry::json_codec(),
+                             const CompactEnvelope *compact = nullptr) const;
 
-    std::vector<std::thread> worker_threads_;
-    std::queue<std::function<void()>> tasks_;
-    std::mutex task_mutex_;
-    std::condition_variable task_cv_;
-    bool shutdown_ = false;
-    const size_t num_workers_ = 4; // Adjust based on your needs
+    WorkStealingExecutor executor_;
+    // Finishes calls answered with a std::future; stopped with the workers
+    rpc::detail::future_waiter futureWaiter_;
 };
\ No newline at end of file
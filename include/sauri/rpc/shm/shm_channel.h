@@ -0,0 +1,173 @@
+//
+// Created by Right on 25/6/9 15:40.
+//
+
+#pragma once
+
+#if defined(__linux__)
+#define SAURI_HAS_SHM_TRANSPORT 1
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "boost/asio.hpp"
+#include "../pipe/buffer_pool.h"
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+
+constexpr std::size_t kDefaultShmRingSize = 4 * 1024 * 1024;
+
+// Control block at the start of each ring. Lives in shared memory, so only
+// address-free lock-free atomics are allowed here.
+struct ShmRingHeader {
+    alignas(64) std::atomic<uint64_t> head;   // producer position
+    alignas(64) std::atomic<uint64_t> tail;   // consumer position
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+    uint64_t capacity;
+};
+
+// Single-producer single-consumer ring of length-prefixed records.
+// Records never wrap: if one does not fit before the end a padding record is written first.
+class ShmRing {
+public:
+    ShmRing() = default;
+
+    ShmRing(void *base, std::size_t capacity, bool initialize);
+
+    // Append one record; false when there is not enough free space
+    bool try_write(std::string_view record);
+
+    // Look at the oldest record without consuming it. Throws std::runtime_error if the
+    // positions or the record length written by the peer do not fit the ring.
+    bool peek(std::string_view &record);
+
+    // Consume the record returned by the last peek()
+    void pop();
+
+    // Largest record that can ever fit
+    std::size_t max_record() const { return capacity_ / 2 - kRecordHeader; }
+
+    ShmRingHeader *header() const { return header_; }
+
+    static std::size_t mapped_size(std::size_t capacity) { return sizeof(ShmRingHeader) + capacity; }
+
+private:
+    static constexpr std::size_t kRecordHeader = 8;
+    static constexpr uint32_t kPadding = 0xFFFFFFFF;
+
+    ShmRingHeader *header_ = nullptr;
+    char *data_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t peeked_ = 0;
+};
+
+// Bidirectional shared-memory channel: one memfd holding two rings, and eventfd
+// doorbells for "data available" and "space available" in each direction.
+// The creating side (the app) writes ring B and reads ring A; the attaching side (the dock)
+// does the opposite.
+//
+// All methods except create()/attach()/connect() must be called from the executor passed in,
+// which is normally the strand of the session the channel belongs to.
+class ShmChannel : public std::enable_shared_from_this<ShmChannel> {
+public:
+    using frame_handler = std::function<void(const BufferSlice &)>;
+    // Called after queued messages were copied into the ring: message count and buffer bytes
+    using drain_handler = std::function<void(std::size_t, std::size_t)>;
+
+    enum class WriteResult {
+        // Larger than the ring can ever hold; send it over the stream instead
+        too_large,
+        // Copied into the ring
+        written,
+        // Queued until the peer frees space; reported later through the drain handler
+        queued,
+    };
+
+    ~ShmChannel();
+
+    // Create a new channel with the given ring capacity (rounded up to a power of two)
+    static std::shared_ptr<ShmChannel> create(const boost::asio::any_io_executor &executor,
+                                              std::size_t ring_capacity = kDefaultShmRingSize);
+
+    // Map a channel from the descriptors sent by the creator; takes ownership of fds
+    static std::shared_ptr<ShmChannel> attach(const boost::asio::any_io_executor &executor,
+                                              const std::vector<int> &fds);
+
+    // Dock side of the attach handshake: open a side connection to pipe_name, send the framed
+    // attach request and wait for the channel descriptors.
+    static std::shared_ptr<ShmChannel> connect(const boost::asio::any_io_executor &executor,
+                                               const std::string &pipe_name,
+                                               const SharedBuffer &request_frame,
+                                               std::chrono::milliseconds timeout = std::chrono::seconds(5));
+
+    // Descriptors the peer needs to attach: memfd, then the four eventfds
+    std::vector<int> native_handles() const;
+
+    // Start delivering inbound records
+    void start(frame_handler on_frame);
+
+    // Write one message. A queued message keeps its own reference to the buffer until the
+    // payload is copied in; on too_large the caller's buffer is untouched.
+    WriteResult write(const SharedBuffer &buffer, std::string_view payload);
+
+    void set_drain_handler(drain_handler handler) { on_drain_ = std::move(handler); }
+
+    void close();
+
+    bool is_open() const { return open_; }
+
+    std::size_t max_message_size() const { return tx_.max_record(); }
+
+private:
+    ShmChannel(const boost::asio::any_io_executor &executor, int memfd, std::size_t ring_capacity,
+               bool creator, const int (&eventfds)[4]);
+
+    void wait_for_data();
+
+    void drain_inbound();
+
+    // Close after the inbound ring turned out inconsistent
+    void fail(const std::exception &e);
+
+    void wait_for_space();
+
+    void flush_pending();
+
+    struct Pending {
+        SharedBuffer buffer;
+        std::string_view payload;
+    };
+
+    boost::asio::any_io_executor executor_;
+    int memfd_;
+    void *mapping_ = nullptr;
+    std::size_t mapping_size_ = 0;
+    int eventfds_[4];
+    ShmRing tx_;
+    ShmRing rx_;
+    // Doorbells: we wait on rx_data_ and tx_space_, and ring the peer's counterparts
+    boost::asio::posix::stream_descriptor rx_data_;
+    boost::asio::posix::stream_descriptor tx_space_;
+    int tx_data_fd_;
+    int rx_space_fd_;
+    std::deque<Pending> pending_;
+    bool waiting_for_space_ = false;
+    bool open_ = false;
+    frame_handler on_frame_;
+    drain_handler on_drain_;
+};
+
+// Pass descriptors over a connected Unix domain socket with SCM_RIGHTS
+bool send_fds(int socket, const std::vector<int> &fds);
+
+std::vector<int> receive_fds(int socket, std::size_t max_fds, std::chrono::milliseconds timeout);
+
+#endif
@@ -0,0 +1,167 @@
+//
+// Created by Right on 25/6/10 10:05.
+//
+
+#pragma once
+
+#if defined(__linux__) && defined(SAURI_ENABLE_IO_URING)
+#define SAURI_HAS_IO_URING 1
+#endif
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "boost/asio.hpp"
+
+#if defined(SAURI_HAS_IO_URING)
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+
+// Receive buffers per connection and their size; a connection can have this much data
+// in flight between the kernel and its strand before its receive has to be re-armed
+constexpr uint16_t kUringReceiveBuffers = 8;
+constexpr std::size_t kUringReceiveBufferSize = 64 * 1024;
+
+// One io_uring instance driving socket receives and sends for many connections.
+//
+// Receives are multishot: armed once, they complete every time data arrives, into buffers the
+// kernel picks from a per-connection provided-buffer ring. Sends are sendmsg over the caller's
+// buffers. Submissions are batched into one io_uring_enter per pass of the event loop, and
+// completions are reaped on the io_context when the ring's eventfd is signalled.
+//
+// Methods are thread-safe. Handlers are called on a thread running the io_context, outside the
+// service's lock; they should hand the result to the connection's own strand.
+class UringService : public std::enable_shared_from_this<UringService> {
+public:
+    // Provided receive buffers for one connection, registered with the ring as one buffer group.
+    // Buffers handed out by completions go back with recycle(), from one thread at a time.
+    class BufferGroup {
+    public:
+        BufferGroup(std::shared_ptr<UringService> service, uint16_t id, uint16_t count, std::size_t size);
+
+        ~BufferGroup();
+
+        BufferGroup(const BufferGroup &) = delete;
+
+        BufferGroup &operator=(const BufferGroup &) = delete;
+
+        uint16_t id() const { return id_; }
+
+        const char *data(uint16_t buffer) const { return buffers_.get() + buffer * size_; }
+
+        // Return a buffer to the kernel
+        void recycle(uint16_t buffer);
+
+    private:
+        void add(uint16_t buffer);
+
+        std::shared_ptr<UringService> service_;
+        uint16_t id_;
+        uint16_t count_;
+        std::size_t size_;
+        std::unique_ptr<char[]> buffers_;
+        io_uring_buf *ring_ = nullptr;
+        std::size_t ring_size_ = 0;
+        uint16_t tail_ = 0;
+    };
+
+    // bytes were received into buffer of the group; more is false when the receive ended and
+    // must be re-armed (ec is set on errors, eof when the peer closed)
+    using receive_handler = std::function<void(const boost::system::error_code &ec, std::size_t bytes,
+                                               uint16_t buffer, bool more)>;
+    // Called once every buffer was sent, or on the first error
+    using send_handler = std::function<void(const boost::system::error_code &ec, std::size_t bytes)>;
+
+    // Returns nullptr when the kernel cannot run this backend (no io_uring, or multishot
+    // receives and buffer rings are missing), so callers can stay on the asio backend
+    static std::shared_ptr<UringService> create(boost::asio::io_context &io_context, unsigned entries = 256);
+
+    ~UringService();
+
+    std::shared_ptr<BufferGroup> create_buffer_group(uint16_t count = kUringReceiveBuffers,
+                                                     std::size_t size = kUringReceiveBufferSize);
+
+    // Start a multishot receive on fd. Returns an id for cancel(), or 0 after shutdown().
+    uint64_t receive(int fd, std::shared_ptr<BufferGroup> buffers, receive_handler handler);
+
+    // Send all of buffers on fd; they must stay valid until the handler runs.
+    // Returns an id for cancel(), or 0 after shutdown().
+    uint64_t send(int fd, const std::vector<boost::asio::const_buffer> &buffers, send_handler handler);
+
+    // Cancel an operation; its handler still runs, with operation_aborted
+    void cancel(uint64_t id);
+
+    // Cancel everything and wait for the kernel to let go of the buffers. Handlers are not called.
+    void shutdown();
+
+private:
+    struct Operation;
+
+    explicit UringService(boost::asio::io_context &io_context);
+
+    bool open(unsigned entries);
+
+    // Called with mutex_ held, like everything below that touches the rings
+    io_uring_sqe *next_sqe();
+
+    void prepare(Operation &op);
+
+    void schedule_flush();
+
+    void submit();
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+    void wait_completions();
+
+    // Submit pending entries and reap completions, then call the handlers without the lock
+    void run_once();
+
+    // Handlers of finished completions are appended to ready
+    void reap(std::vector<std::function<void()>> &ready);
+
+    void complete(const io_uring_cqe &cqe, std::vector<std::function<void()>> &ready);
+
+    uint16_t allocate_group_id();
+
+    void release_group_id(uint16_t id);
+
+    boost::asio::io_context &io_context_;
+    // eventfd registered with the ring, signalled on every completion. Read rather than waited on
+    // so a signal that lands between two waits is not lost.
+    boost::asio::posix::stream_descriptor completions_;
+    uint64_t completions_count_ = 0;
+    int ring_fd_ = -1;
+
+    // Rings shared with the kernel
+    void *ring_ = nullptr;
+    std::size_t ring_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ = nullptr;
+    unsigned *sq_mask_ = nullptr;
+    unsigned *sq_entries_ = nullptr;
+    unsigned *sq_flags_ = nullptr;
+    unsigned *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned *cq_mask_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+
+    std::mutex mutex_;
+    unsigned to_submit_ = 0;
+    bool flush_scheduled_ = false;
+    bool stopped_ = false;
+    uint64_t next_id_ = 1;
+    std::unordered_map<uint64_t, std::shared_ptr<Operation>> operations_;
+    uint16_t next_group_id_ = 0;
+    std::vector<uint16_t> free_group_ids_;
+};
+
+#endif
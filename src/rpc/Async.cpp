@@ -0,0 +1,85 @@
+//
+// Created by Right on 25/6/17 09:40.
+//
+
+#include "sauri/rpc/async.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+    // Pending futures are looked at again after this, doubling up to the maximum while none is ready
+    constexpr auto kMinPollInterval = std::chrono::milliseconds(1);
+    constexpr auto kMaxPollInterval = std::chrono::milliseconds(32);
+
+    std::exception_ptr stopped_error() {
+        return std::make_exception_ptr(std::runtime_error("Application stopped before the future was ready"));
+    }
+}
+
+namespace rpc::detail {
+    void future_waiter::watch(std::function<bool()> poll, completion cancel) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!stopping_) {
+                pending_.push_back({std::move(poll), std::move(cancel)});
+                if (!thread_.joinable()) {
+                    thread_ = std::thread([this] {
+                        run();
+                    });
+                }
+                cv_.notify_one();
+                return;
+            }
+        }
+        cancel(stopped_error());
+    }
+
+    void future_waiter::stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void future_waiter::run() {
+        std::vector<entry> polling;
+        auto interval = kMinPollInterval;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                auto woken = [this] {
+                    return stopping_ || !pending_.empty();
+                };
+                if (polling.empty()) {
+                    cv_.wait(lock, woken);
+                } else if (cv_.wait_for(lock, interval, woken)) {
+                    interval = kMinPollInterval;
+                } else {
+                    interval = std::min(interval * 2, kMaxPollInterval);
+                }
+                std::move(pending_.begin(), pending_.end(), std::back_inserter(polling));
+                pending_.clear();
+                if (stopping_) {
+                    break;
+                }
+            }
+            // Calls finish outside the lock, so a response can bind another future meanwhile
+            auto before = polling.size();
+            polling.erase(std::remove_if(polling.begin(), polling.end(), [](auto &entry) {
+                return entry.poll();
+            }), polling.end());
+            if (polling.size() < before) {
+                interval = kMinPollInterval;
+            }
+        }
+
+        for (auto &entry: polling) {
+            entry.cancel(stopped_error());
+        }
+    }
+}
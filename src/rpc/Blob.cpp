@@ -0,0 +1,59 @@
+//
+// Created by Right on 25/6/14 10:15.
+//
+
+#include "sauri/rpc/blob.h"
+
+#include "sauri/rpc/pipe/frame_codec.h"
+
+Blob::Blob(const void *data, std::size_t size) {
+    auto buffer = BufferPool::shared().acquire(size);
+    buffer->assign(static_cast<const char *>(data), size);
+    slice_ = {SharedBuffer(std::move(buffer)), 0, size};
+}
+
+void to_json(json &j, const Blob &blob) {
+    j = json::array();
+    auto &array = j.get_ref<json::array_t &>();
+    array.reserve(blob.size());
+    for (auto byte: blob.bytes()) {
+        array.emplace_back(byte);
+    }
+}
+
+void from_json(const json &j, Blob &blob) {
+    if (j.is_binary()) {
+        const auto &bytes = j.get_binary();
+        blob = Blob(bytes.data(), bytes.size());
+        return;
+    }
+    auto bytes = j.get<std::vector<uint8_t>>();
+    blob = Blob(bytes.data(), bytes.size());
+}
+
+SharedBuffer attachment_frame(std::string_view bytes) {
+    auto frame = BufferPool::shared().acquire(bytes.size() + kFrameHeaderSize);
+    auto start = begin_frame(*frame, FrameMode::length_prefixed);
+    frame->append(bytes);
+    end_frame(*frame, start, FrameMode::length_prefixed, kFrameAttachment);
+    return frame;
+}
+
+json attachment_reference(std::size_t index) {
+    return {{kAttachmentKey, index}};
+}
+
+const BufferSlice *find_attachment(const json &node, const std::vector<BufferSlice> &attachments) {
+    if (!node.is_object() || node.size() != 1) {
+        return nullptr;
+    }
+    auto it = node.find(kAttachmentKey);
+    if (it == node.end() || !it->is_number_unsigned()) {
+        return nullptr;
+    }
+    auto index = it->get<std::size_t>();
+    if (index >= attachments.size()) {
+        throw json::out_of_range::create(401, "attachment " + std::to_string(index) + " was not sent", &node);
+    }
+    return &attachments[index];
+}
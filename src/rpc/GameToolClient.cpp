@@ -2,11 +2,25 @@
 // Created by Right on 25/5/14 星期三 16:51.
 //
 
+#include <algorithm>
 #include <iostream>
 #include <utility>
 #include "sauri/rpc/sauri_app.h"
 #include "sauri/logger_helper/logger_helper.h"
 
+namespace {
+    // Bytes of a streamed frame searched for the routing fields before giving up on streaming it
+    constexpr std::size_t kStreamPeekSize = 4096;
+
+    // Binary payloads are logged by size only
+    std::string printable(std::string_view payload, const MessageCodec &codec) {
+        if (!codec.is_binary()) {
+            return std::string(payload);
+        }
+        return "<" + codec.name() + " " + std::to_string(payload.size()) + " bytes>";
+    }
+}
+
 // SauriApplication.cpp modifications
 SauriApplication::SauriApplication(
         std::string appId,
@@ -26,15 +40,15 @@ SauriApplication::SauriApplication(
     mainPipeName_(std::move(mainPipeName)),
     httpUrl_(std::move(httpUrl)),
     localPath_(std::move(localPath)),
-    worker_threads_(workerThreads),
-    running_(false) {
+    running_(false),
+    executor_(workerThreads > 0 ? static_cast<std::size_t>(workerThreads) : 0) {
     InitializeLogger(7, "logs");
 //    if (mainPipeName_.empty()) {
 //        mainPipeName_ = appId_ + "_main_pipe";
 //    }
-    client_ = std::make_shared<NamedPipeClient>(io_context_client_, mainPipeName_);
-    server_ = std::make_shared<NamedPipeServer>(io_context_server_, appPipeName_);
-    client_->set_message_handler([this](const std::string &message) {
+    client_ = std::make_shared<NamedPipeClient>(io_context_client_, mainPipeName_, frameMode_);
+    server_ = std::make_shared<NamedPipeServer>(io_context_server_, appPipeName_, frameMode_);
+    client_->set_message_handler([this](std::string_view message) {
         std::cout << "client: " << message << std::endl;
         // 处理消息
         // {"status":"success","message":"Registration request received, initiating handshake"}
@@ -56,48 +70,63 @@ SauriApplication::SauriApplication(
 
 
     // 消息处理
-    server_->set_message_handler([this](const std::string &message) {
-        std::cout << "server recv: " << message << std::endl;
-        try {
-            auto msg = json::parse(message);
-            auto baseMsg = msg.get<BaseRpcMessage>();
-            std::cout << "timestamp: " << baseMsg.timestamp << std::endl;
-            if (baseMsg.type == "handshake") {
-                auto handshakeMsg = baseMsg.payload.get<HandshakeMessage>();
-                // 处理握手消息
-                std::cout << "Handshake step: " << handshakeMsg.step << std::endl;
-                handleHandshake(handshakeMsg);
-            } else if (baseMsg.type == "rpc-event") {
-
-            } else if (baseMsg.type == "rpc-request") {
-                handleRpcRequest(baseMsg);
-            } else if (baseMsg.type == "rpc-response") {
-                (int) 2;
+    server_->set_message_handler([this](session_id session, const BufferSlice &frame) {
+        handleMessage(session, frame);
+    });
+    setStreamThreshold(kDefaultStreamThreshold);
+    server_->set_attachment_handler([this](session_id session, const BufferSlice &frame) {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        pendingAttachments_[session].push_back(frame);
+    });
+    server_->set_disconnect_handler([this](session_id session) {
+        {
+            std::lock_guard<std::mutex> lock(sessionMutex_);
+            sessionCodecs_.erase(session);
+            attachmentSessions_.erase(session);
+            sessionTokens_.erase(session);
+            pendingAttachments_.erase(session);
+        }
+        {
+            // A worker waiting for the rest of a request sees the end of input
+            std::lock_guard<std::mutex> lock(streamMutex_);
+            auto it = streamedFrames_.find(session);
+            if (it != streamedFrames_.end()) {
+                if (it->second.stream) {
+                    it->second.stream->close();
+                }
+                streamedFrames_.erase(it);
             }
-
-        } catch (std::exception &e) {
-            LOG(INFO) << "[E] " << "Error parsing message: " << e.what();
-            return;
         }
-        // 回复该客户端
-//        server->write(client_id, "服务器收到: " + message);
-
-        // 如果消息是"broadcast"，则向所有客户端广播
-        if (message == "broadcast") {
-//            server->broadcast("这是一条广播消息");
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+        {
+            // Drop channels offered to docks that went away before attaching
+            std::lock_guard<std::mutex> lock(shmMutex_);
+            std::erase_if(pendingShm_, [session](const auto &entry) {
+                return entry.second.session == session;
+            });
+        }
+#endif
+        // The dock went away (usually a restart): register again once it is back
+        if (registered_ && running_ && server_->session_count() == 0) {
+            LOG(INFO) << "[D] " << "dock disconnected, reconnecting";
+            client_->start();
         }
     });
 }
 
 SauriApplication::~SauriApplication() {
+    // 停止管道服务器
+    running_ = false;
+    // 停止服务器; closing the sessions first releases workers blocked on a stalled dock
+    server_->stop();
     stopWorkerThreads();
     // 注销应用
     unregisterApp();
+    registered_ = false;
+    client_->close();
+    clientWork_.reset();
+    io_context_client_.stop();
 
-    // 停止管道服务器
-    running_ = false;
-    // 停止服务器
-    server_->stop();
     io_context_server_.stop();
 
     // 等待服务器线程结束
@@ -110,22 +139,102 @@ SauriApplication::~SauriApplication() {
     }
 }
 
+void SauriApplication::setFrameMode(FrameMode mode) {
+    frameMode_ = mode;
+    client_->set_frame_mode(mode);
+    server_->set_frame_mode(mode);
+}
+
+void SauriApplication::enableShmTransport(bool enable, std::size_t ringSize) {
+    shmEnabled_ = enable;
+    shmRingSize_ = ringSize;
+}
+
+void SauriApplication::setWriteQueueLimits(const WriteQueueLimits &limits) {
+    server_->set_write_queue_limits(limits);
+}
+
+void SauriApplication::setEventOverflowPolicy(OverflowPolicy policy) {
+    eventOverflowPolicy_ = policy;
+}
+
+void SauriApplication::setWritableHandler(std::function<void()> handler) {
+    server_->set_writable_handler([handler = std::move(handler)](session_id) {
+        handler();
+    });
+}
+
+void SauriApplication::setHeartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds timeout) {
+    server_->set_heartbeat({interval, timeout});
+}
+
+void SauriApplication::setIoBackend(IoBackend backend) {
+    server_->set_io_backend(backend);
+}
+
+void SauriApplication::setMessageIdGenerator(std::shared_ptr<MessageIdGenerator> generator) {
+    set_message_id_generator(std::move(generator));
+}
+
+void SauriApplication::setCodecs(std::vector<std::string> codecs) {
+    codecs_ = std::move(codecs);
+}
+
+void SauriApplication::setCompression(std::vector<std::string> algorithms, std::size_t threshold, int level) {
+    compressions_ = std::move(algorithms);
+    compression_.threshold = threshold;
+    compression_.level = level;
+}
+
+void SauriApplication::setAttachments(bool enable) {
+    attachmentsEnabled_ = enable;
+}
+
+void SauriApplication::setCompactEnvelope(bool enable) {
+    compactEnabled_ = enable;
+}
+
+void SauriApplication::setLaneScheduling(LaneScheduling scheduling, std::array<unsigned, kPriorityCount> weights) {
+    executor_.set_lane_scheduling(scheduling, weights);
+}
+
+LaneStats SauriApplication::laneStats(Priority priority) const {
+    return executor_.lane_stats(priority);
+}
+
+void SauriApplication::setStreamThreshold(std::size_t bytes) {
+    server_->set_chunk_handler([this](session_id session, const FrameChunk &chunk) {
+        handleChunk(session, chunk);
+    }, bytes);
+}
+
 bool SauriApplication::initialize() {
     // Start the pipe server first
     LOG(INFO) << "[D] " << "initialize";
+    // Frozen before workers and sessions exist, so they only ever read the table
+    freezeMethods();
     startWorkerThreads();
     return startPipeServer();
 }
 
-bool SauriApplication::registerSelf() {
-    // Connect to Electron
-    if (!connectToDock()) {
-        return false;
+void SauriApplication::freezeMethods() {
+    if (methods_.frozen()) {
+        return;
     }
     bind("exit", []() {
         LOG(INFO) << "[D] " << "exit";
         exit(0);
     });
+    methods_.freeze(function_map_);
+}
+
+bool SauriApplication::registerSelf() {
+    freezeMethods();
+    registered_ = true;
+    return connectToDock();
+}
+
+void SauriApplication::sendRegistration() {
     // Create registration message
     RegisterMsg msg{
             .command = "register",
@@ -135,7 +244,8 @@ bool SauriApplication::registerSelf() {
                     .description = description_,
                     .icon = iconPath_,
                     .pipeName = appPipeName_,
-                    .functions = std::move(get_map_keys(function_map_)),
+                    .functions = methods_.names(),
+                    .methodIds = methods_.ids(),
                     .events = event_list_
             }
     };
@@ -150,26 +260,31 @@ bool SauriApplication::registerSelf() {
     }
 
     // Send registration message
-    std::string message = msg.toJson().dump() + "\n";
-    LOG(INFO) << "[D] " << "client send: " << message;
-    client_->write(message);
-
-    return true;
+    auto frame = encodeFrame(msg.toJson());
+    LOG(INFO) << "[D] " << "client send: " << frame_payload(*frame, frameMode_);
+    client_->write(frame);
 }
 
 bool SauriApplication::connectToDock() {
     try {
-        if (!client_->connect()) {
-            LOG(INFO) << "[E] " << "Error connecting to dock";
-            return false;
-        }
-        clientThread_ = std::thread([this]() {
-            try {
-                io_context_client_.run();
-            } catch (std::exception &ec) {
-                LOG(INFO) << "[E] " << "io_context_client_: " << ec.what();
+        // Connects in the background and registers on every (re)connect; the dock answers with
+        // the handshake on the app pipe
+        client_->set_connection_handler([this](bool connected) {
+            if (connected) {
+                sendRegistration();
             }
         });
+        client_->start();
+        if (!clientThread_.joinable()) {
+            clientWork_.emplace(asio::make_work_guard(io_context_client_));
+            clientThread_ = std::thread([this]() {
+                try {
+                    io_context_client_.run();
+                } catch (std::exception &ec) {
+                    LOG(INFO) << "[E] " << "io_context_client_: " << ec.what();
+                }
+            });
+        }
         return true;
     } catch (const std::exception &e) {
         LOG(INFO) << "[E] " << "Error connecting to dock: " << e.what();
@@ -177,12 +292,87 @@ bool SauriApplication::connectToDock() {
     return false;
 }
 
-bool SauriApplication::handleHandshake(const HandshakeMessage &message) {
+ConnectionStats SauriApplication::dockConnectionStats() const {
+    return client_->stats();
+}
+
+void SauriApplication::setReconnectPolicy(const ReconnectPolicy &policy) {
+    client_->set_reconnect_policy(policy);
+}
+
+bool SauriApplication::handleHandshake(session_id session, const HandshakeMessage &message) {
     if (message.step == 1) {
-        auto step2 = CreateHandshakeMessage(appId_, {
+        json step2 = {
                 {"step", 2}
-        });
-        sendMessage(json(step2));
+        };
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+        bool dockOffersShm = std::find(message.transports.begin(), message.transports.end(), "shm") !=
+                             message.transports.end();
+        if (shmEnabled_ && dockOffersShm) {
+            try {
+                auto channel = server_->create_shm_channel(session, shmRingSize_);
+                if (channel) {
+                    auto token = to_string(uuids::uuid_system_generator{}());
+                    {
+                        std::lock_guard<std::mutex> lock(shmMutex_);
+                        pendingShm_[token] = {session, channel};
+                    }
+                    step2["transport"] = "shm";
+                    step2["token"] = token;
+                }
+            } catch (const std::exception &e) {
+                // Stay on the stream
+                LOG(INFO) << "[E] " << "Error creating shm channel: " << e.what();
+            }
+        }
+#endif
+        // Step 2 itself still goes out as JSON, the dock switches after reading it
+        auto codec = pickCodec(message.codecs);
+        if (codec) {
+            step2["codec"] = codec->name();
+        }
+        auto compression = pickCompression(message.compressions);
+        if (compression != Compression::none) {
+            step2["compression"] = compression_name(compression);
+        }
+        // Attachments are flagged in the length header
+        bool attachments = attachmentsEnabled_ && message.attachments && frameMode_ == FrameMode::length_prefixed;
+        if (attachments) {
+            step2["attachments"] = true;
+        }
+        bool compact = compactEnabled_ && message.compactEnvelope;
+        uint32_t token = 0;
+        if (compact) {
+            {
+                std::lock_guard<std::mutex> lock(sessionMutex_);
+                token = ++lastSessionToken_;
+            }
+            step2["compactEnvelope"] = true;
+            step2["session"] = token;
+        }
+        auto frame = encodeFrame(json(CreateHandshakeMessage(appId_, step2)));
+        LOG(INFO) << "[D] " << "server send[" << session << "]: " << frame_payload(*frame, frameMode_);
+        {
+            // Step 2 is queued under the lock that publishes the codec and the compact token: a
+            // writer that looks them up afterwards finds step 2 already ahead of its frame. On the
+            // io thread, so the write never waits for queue space.
+            std::lock_guard<std::mutex> lock(sessionMutex_);
+            if (codec) {
+                sessionCodecs_[session] = std::move(codec);
+            }
+            if (attachments) {
+                attachmentSessions_.insert(session);
+            }
+            if (compact) {
+                sessionTokens_[session] = token;
+            }
+            server_->write(session, std::move(frame));
+        }
+        if (compression != Compression::none) {
+            auto options = compression_;
+            options.algorithm = compression;
+            server_->set_compression(session, options);
+        }
     }
     if (message.step == 3) {
         client_->close();
@@ -191,6 +381,103 @@ bool SauriApplication::handleHandshake(const HandshakeMessage &message) {
     return false;
 }
 
+const BoundMethod *SauriApplication::findMethod(const std::string &name, std::optional<uint32_t> id) const {
+    // Requests only arrive once initialize() has frozen the table
+    return id ? methods_.find(*id) : methods_.find(name);
+}
+
+CodecPtr SauriApplication::pickCodec(const std::vector<std::string> &offered) const {
+    for (const auto &name: offered) {
+        if (codecs_ && std::find(codecs_->begin(), codecs_->end(), name) == codecs_->end()) {
+            continue;
+        }
+        auto codec = CodecRegistry::shared().find(name);
+        if (!codec) {
+            continue;
+        }
+        // A binary message can contain the delimiter
+        if (codec->is_binary() && frameMode_ != FrameMode::length_prefixed) {
+            continue;
+        }
+        // JSON is what the session already speaks
+        if (codec == CodecRegistry::json_codec()) {
+            return nullptr;
+        }
+        return codec;
+    }
+    return nullptr;
+}
+
+Compression SauriApplication::pickCompression(const std::vector<std::string> &offered) const {
+    // Compressed frames are flagged in the length header
+    if (frameMode_ != FrameMode::length_prefixed) {
+        return Compression::none;
+    }
+    for (const auto &name: offered) {
+        if (compressions_ && std::find(compressions_->begin(), compressions_->end(), name) == compressions_->end()) {
+            continue;
+        }
+        auto algorithm = compression_from_name(name);
+        if (algorithm && compression_supported(*algorithm)) {
+            return *algorithm;
+        }
+    }
+    return Compression::none;
+}
+
+bool SauriApplication::sendsAttachments(session_id session) const {
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    return attachmentSessions_.contains(session);
+}
+
+std::vector<BufferSlice> SauriApplication::takeAttachments(session_id session) {
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    auto it = pendingAttachments_.find(session);
+    if (it == pendingAttachments_.end()) {
+        return {};
+    }
+    auto attachments = std::move(it->second);
+    pendingAttachments_.erase(it);
+    return attachments;
+}
+
+std::optional<CompactEnvelope> SauriApplication::compactFor(session_id session) const {
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    auto it = sessionTokens_.find(session);
+    if (it == sessionTokens_.end()) {
+        return std::nullopt;
+    }
+    return CompactEnvelope{it->second, appId_};
+}
+
+CodecPtr SauriApplication::codecFor(session_id session) const {
+    std::lock_guard<std::mutex> lock(sessionMutex_);
+    auto it = sessionCodecs_.find(session);
+    return it != sessionCodecs_.end() ? it->second : CodecRegistry::json_codec();
+}
+
+void SauriApplication::handleShmAttach(session_id session, const ShmAttachMessage &message) {
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    PendingShm pending;
+    {
+        std::lock_guard<std::mutex> lock(shmMutex_);
+        auto it = pendingShm_.find(message.token);
+        if (it == pendingShm_.end()) {
+            LOG(INFO) << "[E] " << "Unknown shm token: " << message.token;
+            return;
+        }
+        pending = std::move(it->second);
+        pendingShm_.erase(it);
+    }
+
+    // The descriptors go back on the side connection; traffic moves over on the original one
+    server_->send_fds(session, pending.channel->native_handles());
+    server_->attach_shm(pending.session, pending.channel);
+#else
+    LOG(INFO) << "[E] " << "shm transport not supported, session " << session;
+#endif
+}
+
 bool SauriApplication::unregisterApp() {
     if (!server_->is_connected()) {
         return false;
@@ -203,7 +490,7 @@ bool SauriApplication::unregisterApp() {
     };
 
     // 发送注销消息
-    std::string message = unregisterMsg.dump() + "\n";
+    std::string message = unregisterMsg.dump();
     return true;
 }
 
@@ -232,24 +519,99 @@ bool SauriApplication::startPipeServer() {
     return true;
 }
 
-bool SauriApplication::sendMessage(const BaseRpcMessage &message) {
-    if (server_->is_connected()) {
-        std::string msg = json(message).dump() + "\n";
-        LOG(INFO) << "[D] " << "server send: " << msg;
-        server_->write(msg);
-        return true;
+bool SauriApplication::sendMessage(const BaseRpcMessage &message, OverflowPolicy policy) {
+    return broadcastMessage(json(message), policy);
+}
+
+bool SauriApplication::sendMessage(session_id session, const BaseRpcMessage &message,
+                                    std::vector<SharedBuffer> attachments) {
+    auto codec = codecFor(session);
+    auto compact = compactFor(session);
+    auto frame = encodeFrame(json(message), *codec, compact ? &*compact : nullptr);
+    LOG(INFO) << "[D] " << "server send[" << session << "]: "
+              << printable(frame_payload(*frame, frameMode_), *codec);
+    if (attachments.empty()) {
+        return server_->write(session, std::move(frame));
     }
-    return false;
+    attachments.push_back(std::move(frame));
+    return server_->write(session, std::move(attachments));
 }
 
-bool SauriApplication::sendMessage(const json &message) {
-    if (server_->is_connected()) {
-        std::string msg = message.dump() + "\n";
-        LOG(INFO) << "[D] " << "server send: " << msg;
-        server_->write(msg);
+bool SauriApplication::broadcastMessage(const json &message, OverflowPolicy policy) {
+    return broadcastFrames([this, &message](const MessageCodec &codec, const CompactEnvelope *compact) {
+        return encodeFrame(message, codec, compact);
+    }, policy);
+}
+
+bool SauriApplication::broadcastFrames(
+        const std::function<SharedBuffer(const MessageCodec &, const CompactEnvelope *)> &encode,
+        OverflowPolicy policy, const std::function<bool(bool binary)> &prepare) {
+    if (!server_->is_connected()) {
+        return false;
+    }
+
+    std::unordered_map<session_id, CodecPtr> sessionCodecs;
+    std::unordered_map<session_id, uint32_t> sessionTokens;
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        sessionCodecs = sessionCodecs_;
+        sessionTokens = sessionTokens_;
+    }
+    if (prepare && !prepare(std::any_of(sessionCodecs.begin(), sessionCodecs.end(), [](const auto &entry) {
+        return entry.second->is_binary();
+    }))) {
+        return false;
+    }
+    if (sessionCodecs.empty() && sessionTokens.empty()) {
+        // Every session speaks JSON: one shared frame
+        auto frame = encode(*CodecRegistry::json_codec(), nullptr);
+        LOG(INFO) << "[D] " << "server broadcast: " << frame_payload(*frame, frameMode_);
+        server_->broadcast(std::move(frame), policy);
         return true;
     }
-    return false;
+
+    // Sessions on the same codec share one frame
+    std::vector<std::pair<CodecPtr, SharedBuffer>> frames;
+    for (auto session: server_->session_ids()) {
+        auto it = sessionCodecs.find(session);
+        const auto &codec = it != sessionCodecs.end() ? it->second : CodecRegistry::json_codec();
+        if (auto token = sessionTokens.find(session); token != sessionTokens.end()) {
+            CompactEnvelope compact{token->second, appId_};
+            auto frame = encode(*codec, &compact);
+            LOG(INFO) << "[D] " << "server send[" << session << "]: "
+                      << printable(frame_payload(*frame, frameMode_), *codec);
+            server_->write(session, std::move(frame), policy);
+            continue;
+        }
+        auto encoded = std::find_if(frames.begin(), frames.end(), [&codec](const auto &entry) {
+            return entry.first == codec;
+        });
+        if (encoded == frames.end()) {
+            frames.emplace_back(codec, encode(*codec, nullptr));
+            encoded = std::prev(frames.end());
+            LOG(INFO) << "[D] " << "server broadcast: "
+                      << printable(frame_payload(*encoded->second, frameMode_), *codec);
+        }
+        server_->write(session, encoded->second, policy);
+    }
+    return true;
+}
+
+SharedBuffer SauriApplication::encodeFrame(const json &message, const MessageCodec &codec,
+                                           const CompactEnvelope *compact) const {
+    auto buffer = BufferPool::shared().acquire(1024);
+    auto start = begin_frame(*buffer, frameMode_);
+    if (compact) {
+        codec.encode(compact_message(message, *compact), *buffer);
+    } else {
+        codec.encode(message, *buffer);
+    }
+    end_frame(*buffer, start, frameMode_);
+    return buffer;
+}
+
+bool SauriApplication::sendMessage(const json &message) {
+    return broadcastMessage(message, OverflowPolicy::block);
 }
 
 void SauriApplication::exec() {
@@ -264,48 +626,385 @@ void SauriApplication::exec() {
     }
 }
 
-void SauriApplication::handleRpcRequest(const BaseRpcMessage &msg) {
-    // Make a copy of the message for the task
-    BaseRpcMessage msgCopy = msg;
+void SauriApplication::handleMessage(session_id session, const BufferSlice &frame) {
+    auto message = frame.view();
+    auto codec = codecFor(session);
+    std::cout << "server recv[" << session << "]: " << printable(message, *codec) << std::endl;
+    try {
+        // Attachments belong to this message whether or not it decodes
+        auto attachments = takeAttachments(session);
+        // Only the envelope is decoded here; request payloads are parsed by the worker
+        auto compact = compactFor(session);
+        auto envelope = decode_envelope(*codec, frame, compact ? &*compact : nullptr);
+        envelope.attachments = std::move(attachments);
+        if (compact) {
+            // The raw message only has the interned fields
+            LOG(INFO) << "[D] " << "envelope: " << message_type_name(envelope.type) << " appId=" << envelope.appId
+                      << " id=" << envelope.id;
+        }
+        std::cout << "timestamp: " << envelope.timestamp << std::endl;
+        switch (envelope.type) {
+            case MessageType::handshake: {
+                auto handshakeMsg = envelope.take_payload().get<HandshakeMessage>();
+                // 处理握手消息
+                std::cout << "Handshake step: " << handshakeMsg.step << std::endl;
+                handleHandshake(session, handshakeMsg);
+                break;
+            }
+            case MessageType::shm_attach:
+                handleShmAttach(session, envelope.take_payload().get<ShmAttachMessage>());
+                break;
+            case MessageType::rpc_request:
+                handleRpcRequest(session, std::move(envelope));
+                break;
+            case MessageType::rpc_batch_request:
+                handleBatchRequest(session, std::move(envelope));
+                break;
+            case MessageType::rpc_event:
+            case MessageType::rpc_response:
+            case MessageType::rpc_batch_response:
+            case MessageType::unknown:
+                break;
+        }
+
+    } catch (std::exception &e) {
+        LOG(INFO) << "[E] " << "Error parsing message: " << e.what();
+        return;
+    }
+    // 回复该客户端
+//        server->write(client_id, "服务器收到: " + message);
 
-    // Add task to queue
+    // 如果消息是"broadcast"，则向所有客户端广播
+    if (message == "broadcast") {
+//            server->broadcast("这是一条广播消息");
+    }
+}
+
+void SauriApplication::handleChunk(session_id session, const FrameChunk &chunk) {
+    StreamedFrame *frame;
     {
-        std::lock_guard<std::mutex> lock(task_mutex_);
-        tasks_.emplace([this, msgCopy]() {
-            RpcResponse response;
-            try {
-                auto request = msgCopy.payload.get<RpcRequest>();
-                response.id = request.id;
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        frame = &streamedFrames_[session];
+    }
+    if (chunk.first()) {
+        *frame = {};
+        std::cout << "server recv[" << session << "]: <" << chunk.total << " bytes, streamed>" << std::endl;
+    }
 
-                if (function_map_.find(request.method) != function_map_.end()) {
-                    try {
-                        response.result = function_map_[request.method](request.params);
-                    }
-                    catch (const std::exception &e) {
-                        response.hasError = true;
-                        response.error.code = static_cast<int>(RpcErrorCode::function_internal_error);
-                        response.error.message = e.what();
-                    }
-                } else {
-                    response.hasError = true;
-                    response.error.code = static_cast<int>(RpcErrorCode::function_not_found);
-                    response.error.message = "Method '" + request.method + "' not found";
+    if (frame->mode == StreamedFrame::Mode::routing) {
+        frame->chunks.push_back(chunk.data);
+        frame->received += chunk.data.size;
+        // The routing fields are at the start of the message
+        std::string joined;
+        std::string_view prefix = frame->chunks.front().view();
+        if (frame->chunks.size() > 1) {
+            for (const auto &piece: frame->chunks) {
+                joined.append(piece.view().substr(0, kStreamPeekSize - joined.size()));
+                if (joined.size() == kStreamPeekSize) {
+                    break;
                 }
             }
-            catch (const json::exception &e) {
-                response.id = "unknown";
-                response.hasError = true;
-                response.error.code = static_cast<int>(RpcErrorCode::payload_invalid);
-                response.error.message = "Invalid payload: " + std::string(e.what());
+            prefix = joined;
+        }
+        RequestHead head;
+        bool routed = false;
+        try {
+            routed = prefix.front() == '{' && peek_rpc_call(prefix, head);
+        } catch (const std::exception &) {
+            // Left for the full parse to report
+        }
+        if (routed) {
+            auto attachments = takeAttachments(session);
+            auto *method = findMethod(head.method, head.methodId);
+            if (!method) {
+                // Answer now and skip the body
+                frame->mode = StreamedFrame::Mode::discarding;
+                frame->chunks.clear();
+                submitTask([this, session, head]() {
+                    runRpcCall(session, head.appId, [&head]() {
+                        RpcCall call;
+                        call.id = head.requestId;
+                        call.method = head.method;
+                        call.methodId = head.methodId;
+                        return call;
+                    });
+                });
+            } else {
+                frame->mode = StreamedFrame::Mode::streaming;
+                frame->stream = std::make_shared<ChunkStream>();
+                for (auto &piece: frame->chunks) {
+                    frame->stream->push(std::move(piece));
+                }
+                frame->chunks.clear();
+                // Pieces keep arriving into the stream while the call waits for its turn
+                scheduleCall(method, [this, session, appId = head.appId, stream = frame->stream,
+                        attachments = std::move(attachments)](const auto &gate) mutable {
+                    std::istream in(stream.get());
+                    runRpcCall(session, appId, [&]() {
+                        auto call = read_rpc_call(in);
+                        call.params.attachments = std::move(attachments);
+                        return call;
+                    }, nullptr, 0, gate);
+                    // The response is out; the rest of the message is not needed
+                    stream->abandon();
+                });
             }
+        } else if (frame->received >= kStreamPeekSize || chunk.last()) {
+            frame->mode = StreamedFrame::Mode::assembling;
+        }
+    } else if (frame->mode == StreamedFrame::Mode::streaming) {
+        frame->stream->push(chunk.data);
+    } else if (frame->mode == StreamedFrame::Mode::assembling) {
+        frame->chunks.push_back(chunk.data);
+    }
 
-            auto responseMessage = CreateResponseMessage(msgCopy.appId, json(response));
-            sendMessage(responseMessage);
-        });
+    if (!chunk.last()) {
+        return;
+    }
+    if (frame->stream) {
+        frame->stream->close();
+    }
+    std::optional<BufferSlice> assembled;
+    if (frame->mode == StreamedFrame::Mode::assembling) {
+        auto buffer = BufferPool::shared().acquire(chunk.total);
+        for (const auto &piece: frame->chunks) {
+            buffer->append(piece.view());
+        }
+        assembled = BufferSlice{SharedBuffer(std::move(buffer)), 0, chunk.total};
+    }
+    {
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        streamedFrames_.erase(session);
+    }
+    if (assembled) {
+        handleMessage(session, *assembled);
+    }
+}
+
+void SauriApplication::handleRpcRequest(session_id session, Envelope msg) {
+    // Only the method is read here, to pick the lane; the payload moves along undecoded.
+    // A request whose method cannot be read gets its error from a worker of the normal lane.
+    std::string name;
+    std::optional<uint32_t> id;
+    auto *method = peek_method(msg, name, id) ? findMethod(name, id) : nullptr;
+    scheduleCall(method, [this, session, msg = std::move(msg)](const auto &gate) mutable {
+        runRpcCall(session, msg.appId, [&msg]() {
+            return take_rpc_call(msg);
+        }, nullptr, 0, gate);
+    });
+}
+
+void SauriApplication::scheduleCall(const BoundMethod *method,
+                                    std::function<void(const std::shared_ptr<ConcurrencyGate> &)> run) {
+    auto *pool = method && method->pool ? method->pool.get() : &executor_;
+    auto priority = method ? method->options.priority : Priority::normal;
+    auto gate = method ? method->gate : nullptr;
+    // Called once, so the request moves along instead of being copied
+    auto post = [pool, priority, gate, run = std::move(run)]() mutable {
+        pool->post([gate, run = std::move(run)]() {
+            run(gate);
+        }, priority);
+    };
+    if (gate) {
+        gate->submit(std::move(post));
+    } else {
+        post();
+    }
+}
+
+struct SauriApplication::BatchCall {
+    session_id session;
+    std::string appId;
+    std::string id;
+    bool stream = false;
+    // By request index; filled as requests complete, unless stream is set
+    std::vector<RpcResponse> responses;
+    std::atomic<std::size_t> remaining{0};
+};
+
+void SauriApplication::handleBatchRequest(session_id session, Envelope msg) {
+    submitTask([this, session, msg = std::move(msg)]() mutable {
+        auto batch = std::make_shared<BatchCall>();
+        batch->session = session;
+        batch->appId = msg.appId;
+        std::vector<RpcBatchEntry> calls;
+        try {
+            auto decoded = take_rpc_batch(msg);
+            batch->id = std::move(decoded.id);
+            batch->stream = decoded.stream;
+            calls = std::move(decoded.calls);
+        }
+        catch (const json::exception &e) {
+            batch->id = "unknown";
+            RpcResponse response;
+            response.id = "unknown";
+            response.hasError = true;
+            response.error.code = static_cast<int>(RpcErrorCode::payload_invalid);
+            response.error.message = "Invalid payload: " + std::string(e.what());
+            batch->responses.push_back(std::move(response));
+            finishBatch(*batch);
+            return;
+        }
+        if (calls.empty()) {
+            finishBatch(*batch);
+            return;
+        }
+        if (!batch->stream) {
+            batch->responses.resize(calls.size());
+        }
+        batch->remaining = calls.size();
+        // Posted from a worker, the requests land in its own deques for idle workers to steal.
+        // Each goes through its method's lane, pool and limit like a request of its own.
+        // A malformed entry rethrows its error there and gets payload_invalid at its index.
+        for (std::size_t i = 0; i < calls.size(); ++i) {
+            auto *method = calls[i].error ? nullptr : findMethod(calls[i].call.method, calls[i].call.methodId);
+            scheduleCall(method, [this, batch, i, entry = std::move(calls[i])](const auto &gate) mutable {
+                runRpcCall(batch->session, batch->appId, [&entry]() {
+                    if (entry.error) {
+                        std::rethrow_exception(entry.error);
+                    }
+                    return std::move(entry.call);
+                }, batch, i, gate);
+            });
+        }
+    });
+}
+
+struct SauriApplication::PendingCall {
+    session_id session;
+    std::string appId;
+    CodecPtr codec;
+    MessageBuffer frame;
+    std::size_t frameStart = 0;
+    std::optional<rpc::detail::response_writer> writer;
+    // Byte results become attachment frames sent ahead of the response
+    std::vector<SharedBuffer> attachments;
+    std::optional<rpc::detail::result_sink> result;
+    RpcResponse response;
+    // Set for a request of a batch; without stream its response is collected, not sent
+    std::shared_ptr<BatchCall> batch;
+    std::size_t index = 0;
+    // Held for the method's concurrency limit until the response is out
+    std::shared_ptr<ConcurrencyGate> gate;
+};
+
+void SauriApplication::runRpcCall(session_id session, const std::string &appId,
+                                  const std::function<RpcCall()> &takeCall,
+                                  std::shared_ptr<BatchCall> batch, std::size_t index,
+                                  std::shared_ptr<ConcurrencyGate> gate) {
+    // Text responses are streamed into the frame as the result comes in; binary codecs and
+    // collected batch responses keep the result as json. The state lives until the bound
+    // function completes, which may be on another thread.
+    auto pending = std::make_shared<PendingCall>();
+    pending->session = session;
+    pending->appId = appId;
+    pending->codec = codecFor(session);
+    pending->batch = std::move(batch);
+    pending->index = index;
+    pending->gate = std::move(gate);
+    bool collected = pending->batch && !pending->batch->stream;
+    if (!pending->codec->is_binary() && !collected) {
+        auto compact = compactFor(session);
+        pending->frame = BufferPool::shared().acquire(1024);
+        pending->frameStart = begin_frame(*pending->frame, frameMode_);
+        if (compact) {
+            pending->writer.emplace(*pending->frame, compact->token, next_message_number());
+        } else {
+            pending->writer.emplace(*pending->frame, appId, next_message_id());
+        }
     }
+    pending->result.emplace(pending->writer ? &*pending->writer : nullptr,
+                            sendsAttachments(session) && !collected ? &pending->attachments : nullptr);
 
-    // Notify one worker thread that a new task is available
-    task_cv_.notify_one();
+    auto &response = pending->response;
+    response.id = "unknown";
+    try {
+        // Params stay undecoded until the bound function's decoder reads them
+        auto call = takeCall();
+        response.id = call.id;
+        if (pending->writer) {
+            pending->writer->begin(call.id);
+        }
+
+        auto *function = findMethod(call.method, call.methodId);
+        if (function) {
+            function->handler(call.params, *pending->result, [this, pending](std::exception_ptr error) {
+                finishRpcCall(*pending, std::move(error));
+            });
+            return;
+        }
+        response.hasError = true;
+        response.error.code = static_cast<int>(RpcErrorCode::function_not_found);
+        auto method = call.methodId ? "#" + std::to_string(*call.methodId) : call.method;
+        response.error.message = "Method '" + method + "' not found";
+    }
+    catch (const json::exception &e) {
+        response.id = "unknown";
+        response.hasError = true;
+        response.error.code = static_cast<int>(RpcErrorCode::payload_invalid);
+        response.error.message = "Invalid payload: " + std::string(e.what());
+    }
+    finishRpcCall(*pending, nullptr);
+}
+
+void SauriApplication::finishRpcCall(PendingCall &call, std::exception_ptr error) {
+    auto &response = call.response;
+    if (error) {
+        response.hasError = true;
+        response.error.code = static_cast<int>(RpcErrorCode::function_internal_error);
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception &e) {
+            response.error.message = e.what();
+        }
+        catch (...) {
+            response.error.message = "Unknown error";
+        }
+    }
+    if (response.hasError) {
+        call.attachments.clear();
+    }
+
+    // Reply on the connection that made the request
+    if (call.batch && !call.batch->stream) {
+        response.result = std::move(call.result->value());
+        call.batch->responses[call.index] = std::move(response);
+    } else if (!call.writer) {
+        response.result = std::move(call.result->value());
+        sendMessage(call.session, CreateResponseMessage(call.appId, json(response)), std::move(call.attachments));
+    } else {
+        if (response.hasError) {
+            call.writer->fail(response.id, response.error.code, response.error.message);
+        }
+        call.writer->finish(get_current_time_ms());
+        end_frame(*call.frame, call.frameStart, frameMode_);
+        LOG(INFO) << "[D] " << "server send[" << call.session << "]: " << frame_payload(*call.frame, frameMode_);
+        if (call.attachments.empty()) {
+            server_->write(call.session, std::move(call.frame));
+        } else {
+            call.attachments.push_back(std::move(call.frame));
+            server_->write(call.session, std::move(call.attachments));
+        }
+    }
+    // The last request of a batch to complete sends the batch response
+    if (call.batch && call.batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        finishBatch(*call.batch);
+    }
+    if (call.gate) {
+        call.gate->release();
+    }
+}
+
+void SauriApplication::finishBatch(BatchCall &batch) {
+    RpcBatchResponse reply;
+    reply.id = batch.id;
+    reply.responses = std::move(batch.responses);
+    sendMessage(batch.session, CreateBatchResponseMessage(batch.appId, json(reply)));
+}
+
+void SauriApplication::submitTask(std::function<void()> task) {
+    executor_.post(std::move(task));
 }
 
 /*
@@ -353,15 +1052,104 @@ void SauriApplication::emitEvent(const std::string &event_name, const json &data
         LOG(INFO) << "[E] " << "Event not declared: " << event_name;
         return;
     }
-    if (server_->is_connected()) {
-        RpcEvent event{
-                .id = to_string(uuids::uuid_system_generator{}()),
-                .event = event_name,
-                .data = data
-        };
-        auto message = CreateEventMessage(appId_, event);
-        sendMessage(message);
+    broadcastEvent(rpc::detail::event_writer(appId_, event_name), event_name, &data, {});
+}
+
+void SauriApplication::emitEncodedEvent(const std::string &event_name, std::string_view data) {
+    if (!event_list_.contains(event_name)) {
+        LOG(INFO) << "[E] " << "Event not declared: " << event_name;
+        return;
+    }
+    broadcastEvent(rpc::detail::event_writer(appId_, event_name), event_name, nullptr, data);
+}
+
+PreparedEvent SauriApplication::prepareEvent(const std::string &event_name) {
+    if (!event_list_.contains(event_name)) {
+        throw std::runtime_error("Event not declared: " + event_name);
     }
+    return {this, event_name, rpc::detail::event_writer(appId_, event_name)};
+}
+
+void SauriApplication::broadcastEvent(const rpc::detail::event_writer &writer, const std::string &event_name,
+                                      const json *data, std::string_view encoded) {
+    if (!server_->is_connected()) {
+        return;
+    }
+
+    // Parsed once, before anything is written: a line break in the data would end the frame
+    // early, and binary codecs need the value itself
+    std::optional<json> parsed;
+    auto prepare = [&](bool binary) {
+        if (data || !(binary || (frameMode_ == FrameMode::delimited && encoded.find('\n') != std::string_view::npos))) {
+            return true;
+        }
+        try {
+            parsed = json::parse(encoded);
+        } catch (const json::exception &e) {
+            LOG(INFO) << "[E] " << "Event " << event_name << " data is not valid JSON: " << e.what();
+            return false;
+        }
+        data = &*parsed;
+        return true;
+    };
+
+    auto messageId = next_message_id();
+    auto eventId = next_message_id();
+    auto timestamp = static_cast<uint64_t>(get_current_time_ms());
+    // Binary codecs encode a whole message; built once, only when a session uses one
+    std::optional<json> message;
+    // Compact sessions share integer ids, drawn on first use
+    uint64_t messageNumber = 0;
+    uint64_t eventNumber = 0;
+    broadcastFrames([&](const MessageCodec &codec, const CompactEnvelope *compact) {
+        auto buffer = BufferPool::shared().acquire(1024);
+        auto start = begin_frame(*buffer, frameMode_);
+        if (compact && messageNumber == 0) {
+            messageNumber = next_message_number();
+            eventNumber = next_message_number();
+        }
+        if (compact && codec.is_binary()) {
+            json event = {{"event", event_name}, {"id", eventNumber}};
+            event["data"] = *data;
+            codec.encode(json{{"i",  messageNumber},
+                              {"p",  std::move(event)},
+                              {"s",  compact->token},
+                              {"t",  static_cast<int>(MessageType::rpc_event)},
+                              {"ts", timestamp}}, *buffer);
+        } else if (compact) {
+            writer.begin_compact(*buffer, messageNumber);
+            if (data) {
+                rpc::detail::write_json(*buffer, *data);
+            } else {
+                buffer->append(encoded);
+            }
+            writer.end_compact(*buffer, eventNumber, compact->token, timestamp);
+        } else if (codec.is_binary()) {
+            if (!message) {
+                RpcEvent event{eventId, event_name, *data};
+                message = json(BaseRpcMessage{"rpc-event", appId_, messageId, timestamp, json(event)});
+            }
+            codec.encode(*message, *buffer);
+        } else {
+            writer.begin(*buffer, messageId);
+            if (data) {
+                rpc::detail::write_json(*buffer, *data);
+            } else {
+                buffer->append(encoded);
+            }
+            writer.end(*buffer, eventId, timestamp);
+        }
+        end_frame(*buffer, start, frameMode_);
+        return SharedBuffer(std::move(buffer));
+    }, eventOverflowPolicy_, prepare);
+}
+
+void PreparedEvent::emit(const json &data) const {
+    app_->broadcastEvent(writer_, name_, &data, {});
+}
+
+void PreparedEvent::emitEncoded(std::string_view data) const {
+    app_->broadcastEvent(writer_, name_, nullptr, data);
 }
 
 void SauriApplication::declareEvent(const std::string &event_name) {
@@ -375,38 +1163,28 @@ void SauriApplication::declareEvents(const std::vector<std::string> &event_names
 }
 
 void SauriApplication::startWorkerThreads() {
-    for (size_t i = 0; i < num_workers_; ++i) {
-        worker_threads_.emplace_back([this] {
-            while (true) {
-                std::function < void() > task;
-                {
-                    std::unique_lock<std::mutex> lock(task_mutex_);
-                    task_cv_.wait(lock, [this] { return shutdown_ || !tasks_.empty(); });
-
-                    if (shutdown_ && tasks_.empty()) {
-                        return;
-                    }
-
-                    task = std::move(tasks_.front());
-                    tasks_.pop();
-                }
-                task();
-            }
-        });
-    }
+    executor_.start();
+    LOG(INFO) << "[D] " << "worker threads: " << executor_.size();
 }
 
 void SauriApplication::stopWorkerThreads() {
     {
-        std::lock_guard<std::mutex> lock(task_mutex_);
-        shutdown_ = true;
+        // Workers waiting for the rest of a request would never return
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        for (auto &[session, frame]: streamedFrames_) {
+            if (frame.stream) {
+                frame.stream->close();
+            }
+        }
     }
-    task_cv_.notify_all();
-    for (auto &thread: worker_threads_) {
-        if (thread.joinable()) {
-            thread.join();
+    // Queued requests still run
+    executor_.stop();
+    // Calls still waiting on a future are failed rather than answered after the app is gone
+    futureWaiter_.stop();
+    for (auto &[name, method]: function_map_) {
+        if (method.pool) {
+            method.pool->stop();
         }
     }
-    worker_threads_.clear();
 }
 
@@ -0,0 +1,64 @@
+//
+// Created by Right on 25/6/13 15:10.
+//
+
+#include "sauri/rpc/message_id.h"
+
+#include <mutex>
+#include <random>
+#include <vector>
+#include "sauri/rpc/model.h"
+
+namespace {
+    constexpr int kCounterBits = 40;
+    constexpr int kIdChars = 13;
+    constexpr char kBase32[] = "0123456789abcdefghjkmnpqrstvwxyz";
+
+    MessageIdGenerator *default_generator() {
+        static CounterIdGenerator generator;
+        return &generator;
+    }
+
+    std::atomic<MessageIdGenerator *> current{nullptr};
+
+    std::atomic<uint64_t> message_number{0};
+}
+
+CounterIdGenerator::CounterIdGenerator() {
+    std::random_device random;
+    prefix_ = (static_cast<uint64_t>(random()) & 0xffffff) << kCounterBits;
+}
+
+std::string CounterIdGenerator::next() {
+    auto counter = counter_.fetch_add(1, std::memory_order_relaxed);
+    auto value = prefix_ | (counter & ((uint64_t(1) << kCounterBits) - 1));
+
+    std::string id(kIdChars, '0');
+    for (int i = kIdChars - 1; i >= 0; --i) {
+        id[i] = kBase32[value & 31];
+        value >>= 5;
+    }
+    return id;
+}
+
+std::string UuidIdGenerator::next() {
+    return to_string(uuids::uuid_system_generator{}());
+}
+
+void set_message_id_generator(std::shared_ptr<MessageIdGenerator> generator) {
+    // Replaced generators stay alive: a sender may still be inside next()
+    static std::mutex mutex;
+    static std::vector<std::shared_ptr<MessageIdGenerator>> installed;
+    std::lock_guard<std::mutex> lock(mutex);
+    current.store(generator.get(), std::memory_order_release);
+    installed.push_back(std::move(generator));
+}
+
+std::string next_message_id() {
+    auto *generator = current.load(std::memory_order_acquire);
+    return generator ? generator->next() : default_generator()->next();
+}
+
+uint64_t next_message_number() {
+    return message_number.fetch_add(1, std::memory_order_relaxed) + 1;
+}
@@ -0,0 +1,92 @@
+//
+// Created by Right on 25/6/16 15:20.
+//
+
+#include "sauri/rpc/method_table.h"
+
+#include <algorithm>
+
+namespace {
+    // Seeds tried at one table size before the table doubles
+    constexpr uint64_t kSeedsPerSize = 256;
+
+    // FNV-1a with the seed folded into the offset basis, then mixed so that the low bits,
+    // which pick the slot, depend on every byte
+    uint64_t hash(std::string_view name, uint64_t seed) {
+        uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+        for (char c: name) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 0x100000001b3ull;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+}
+
+void MethodTable::freeze(const std::unordered_map<std::string, BoundMethod> &methods) {
+    methods_.clear();
+    methods_.reserve(methods.size());
+    for (const auto &[name, method]: methods) {
+        methods_.push_back({name, method});
+    }
+    std::sort(methods_.begin(), methods_.end(), [](const Method &a, const Method &b) {
+        return a.name < b.name;
+    });
+
+    // At least twice as many slots as names keeps the search for a seed short
+    uint64_t size = 8;
+    while (size < 2 * methods_.size()) {
+        size *= 2;
+    }
+    while (true) {
+        mask_ = size - 1;
+        for (seed_ = 0; seed_ < kSeedsPerSize; ++seed_) {
+            slots_.assign(size, -1);
+            bool collision = false;
+            for (std::size_t id = 0; id < methods_.size() && !collision; ++id) {
+                auto &entry = slots_[slot(methods_[id].name, seed_)];
+                collision = entry >= 0;
+                entry = static_cast<int32_t>(id);
+            }
+            if (!collision) {
+                frozen_ = true;
+                return;
+            }
+        }
+        size *= 2;
+    }
+}
+
+const BoundMethod *MethodTable::find(std::string_view name) const {
+    if (slots_.empty()) {
+        return nullptr;
+    }
+    auto id = slots_[slot(name, seed_)];
+    if (id < 0 || methods_[id].name != name) {
+        return nullptr;
+    }
+    return &methods_[id].method;
+}
+
+std::vector<std::string> MethodTable::names() const {
+    std::vector<std::string> names;
+    names.reserve(methods_.size());
+    for (const auto &method: methods_) {
+        names.push_back(method.name);
+    }
+    return names;
+}
+
+std::map<std::string, uint32_t> MethodTable::ids() const {
+    std::map<std::string, uint32_t> ids;
+    for (uint32_t id = 0; id < methods_.size(); ++id) {
+        ids.emplace(methods_[id].name, id);
+    }
+    return ids;
+}
+
+uint64_t MethodTable::slot(std::string_view name, uint64_t seed) const {
+    return hash(name, seed) & mask_;
+}
@@ -0,0 +1,549 @@
+//
+// Created by Right on 25/6/12 10:20.
+//
+
+#include "sauri/rpc/codec/envelope.h"
+
+#include <algorithm>
+#include <charconv>
+#include "sauri/rpc/message_id.h"
+
+namespace {
+    // Walks the top level of a JSON object. Only unescaped keys and the value types the fields
+    // we extract use are understood; anything else makes scan() fail and the caller parses the
+    // whole text instead, which also produces the proper parse error.
+    class ObjectScanner {
+    public:
+        explicit ObjectScanner(std::string_view text) : text_(text) {}
+
+        // on_field(key) is called with the cursor on the key's value, and must read or skip it;
+        // it returns false to give up
+        template<typename OnField>
+        bool scan(OnField &&on_field) {
+            skip_ws();
+            if (!consume('{')) {
+                return false;
+            }
+            skip_ws();
+            if (consume('}')) {
+                return at_end();
+            }
+            while (true) {
+                skip_ws();
+                auto key_start = pos_;
+                bool escaped = false;
+                if (!skip_string(&escaped) || escaped) {
+                    return false;
+                }
+                auto key = text_.substr(key_start + 1, pos_ - key_start - 2);
+                skip_ws();
+                if (!consume(':')) {
+                    return false;
+                }
+                skip_ws();
+                if (!on_field(key)) {
+                    return false;
+                }
+                skip_ws();
+                if (consume(',')) {
+                    continue;
+                }
+                return consume('}') && at_end();
+            }
+        }
+
+        bool read_string(std::string &out) {
+            auto start = pos_;
+            bool escaped = false;
+            if (!skip_string(&escaped)) {
+                return false;
+            }
+            auto token = text_.substr(start, pos_ - start);
+            if (escaped) {
+                out = json::parse(token).get<std::string>();
+            } else {
+                out.assign(token.substr(1, token.size() - 2));
+            }
+            return true;
+        }
+
+        bool read_uint(uint64_t &out) {
+            auto start = pos_;
+            skip_scalar();
+            auto result = std::from_chars(text_.data() + start, text_.data() + pos_, out);
+            return result.ec == std::errc() && result.ptr == text_.data() + pos_;
+        }
+
+        // A string id, or an integer one from a compact envelope as its decimal text
+        bool read_id(std::string &out) {
+            if (pos_ < text_.size() && text_[pos_] == '"') {
+                return read_string(out);
+            }
+            uint64_t number;
+            if (!read_uint(number)) {
+                return false;
+            }
+            out = std::to_string(number);
+            return true;
+        }
+
+        // A method name, or the numeric id the registration advertised for it
+        bool read_method(std::string &name, std::optional<uint32_t> &id) {
+            if (pos_ < text_.size() && text_[pos_] == '"') {
+                return read_string(name);
+            }
+            uint64_t number;
+            if (!read_uint(number) || number > UINT32_MAX) {
+                return false;
+            }
+            id = static_cast<uint32_t>(number);
+            return true;
+        }
+
+        // Skip the value and return its offset in the text and its size.
+        // Brackets are only counted, not matched; the value is validated when it is parsed.
+        bool skip_value(std::size_t &offset, std::size_t &size) {
+            offset = pos_;
+            bool ok = skip_value();
+            size = pos_ - offset;
+            return ok;
+        }
+
+        bool skip_value() {
+            if (pos_ >= text_.size()) {
+                return false;
+            }
+            char c = text_[pos_];
+            if (c == '"') {
+                return skip_string();
+            }
+            if (c != '{' && c != '[') {
+                auto start = pos_;
+                skip_scalar();
+                return pos_ > start;
+            }
+            int depth = 0;
+            while (pos_ < text_.size()) {
+                c = text_[pos_];
+                if (c == '"') {
+                    if (!skip_string()) {
+                        return false;
+                    }
+                    continue;
+                }
+                if (c == '{' || c == '[') {
+                    ++depth;
+                } else if ((c == '}' || c == ']') && --depth == 0) {
+                    ++pos_;
+                    return true;
+                }
+                ++pos_;
+            }
+            return false;
+        }
+
+        // Text from the cursor on
+        std::string_view rest() const { return text_.substr(pos_); }
+
+    private:
+        void skip_ws() {
+            while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' ||
+                                           text_[pos_] == '\n' || text_[pos_] == '\r')) {
+                ++pos_;
+            }
+        }
+
+        bool consume(char c) {
+            if (pos_ < text_.size() && text_[pos_] == c) {
+                ++pos_;
+                return true;
+            }
+            return false;
+        }
+
+        bool at_end() {
+            skip_ws();
+            return pos_ == text_.size();
+        }
+
+        // Leaves pos_ past the closing quote
+        bool skip_string(bool *escaped = nullptr) {
+            if (!consume('"')) {
+                return false;
+            }
+            while (pos_ < text_.size()) {
+                char c = text_[pos_];
+                if (c == '\\') {
+                    if (escaped) {
+                        *escaped = true;
+                    }
+                    pos_ += 2;
+                } else if (c == '"') {
+                    ++pos_;
+                    return true;
+                } else {
+                    ++pos_;
+                }
+            }
+            return false;
+        }
+
+        // number, true, false or null
+        void skip_scalar() {
+            while (pos_ < text_.size()) {
+                char c = text_[pos_];
+                if (c == ',' || c == '}' || c == ']' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                    break;
+                }
+                ++pos_;
+            }
+        }
+
+        std::string_view text_;
+        std::size_t pos_ = 0;
+    };
+
+    // Sub-slice of slice at a scanner offset
+    BufferSlice subslice(const BufferSlice &slice, std::size_t offset, std::size_t size) {
+        return {slice.buffer, slice.offset + offset, size};
+    }
+
+    MessageType type_from_number(uint64_t number) {
+        return number <= static_cast<uint64_t>(MessageType::rpc_batch_response) ? static_cast<MessageType>(number)
+                                                                                 : MessageType::unknown;
+    }
+
+    std::string app_id(uint64_t token, const CompactEnvelope *session) {
+        return session && session->token == token ? session->appId : std::string();
+    }
+
+    // Payload ids of a compact envelope are numbers whenever they can be
+    bool is_number(std::string_view id) {
+        return !id.empty() && id.size() < 20 && (id[0] != '0' || id.size() == 1) &&
+               std::all_of(id.begin(), id.end(), [](char c) { return c >= '0' && c <= '9'; });
+    }
+
+    // Both the full and the compact keys are accepted, so a dock may switch at any point
+    bool scan_envelope(const BufferSlice &frame, Envelope &envelope, const CompactEnvelope *session) {
+        ObjectScanner scanner(frame.view());
+        return scanner.scan([&](std::string_view key) {
+            if (key == "type") {
+                std::string type;
+                if (!scanner.read_string(type)) {
+                    return false;
+                }
+                envelope.type = message_type(type);
+                return true;
+            }
+            if (key == "t") {
+                uint64_t type;
+                if (!scanner.read_uint(type)) {
+                    return false;
+                }
+                envelope.type = type_from_number(type);
+                return true;
+            }
+            if (key == "id" || key == "i") {
+                return scanner.read_id(envelope.id);
+            }
+            if (key == "appId") {
+                return scanner.read_string(envelope.appId);
+            }
+            if (key == "s") {
+                uint64_t token;
+                if (!scanner.read_uint(token)) {
+                    return false;
+                }
+                envelope.appId = app_id(token, session);
+                return true;
+            }
+            if (key == "timestamp" || key == "ts") {
+                return scanner.read_uint(envelope.timestamp);
+            }
+            if (key == "payload" || key == "p") {
+                std::size_t offset, size;
+                if (!scanner.skip_value(offset, size)) {
+                    return false;
+                }
+                envelope.rawPayload = subslice(frame, offset, size);
+                return true;
+            }
+            return scanner.skip_value();
+        });
+    }
+
+    bool scan_rpc_call(const BufferSlice &payload, RpcCall &call) {
+        ObjectScanner scanner(payload.view());
+        return scanner.scan([&](std::string_view key) {
+            if (key == "id") {
+                return scanner.read_id(call.id);
+            }
+            if (key == "method") {
+                return scanner.read_method(call.method, call.methodId);
+            }
+            if (key == "params") {
+                std::size_t offset, size;
+                if (!scanner.skip_value(offset, size)) {
+                    return false;
+                }
+                call.rawParams = subslice(payload, offset, size);
+                call.params.text = call.rawParams.view();
+                return true;
+            }
+            return scanner.skip_value();
+        });
+    }
+
+    // A string id, or an integer one from a compact envelope as its decimal text
+    std::string id_from_value(const json &id) {
+        return id.is_number_unsigned() ? std::to_string(id.get<uint64_t>()) : id.get<std::string>();
+    }
+
+    RpcCall rpc_call_from_value(json &&payload) {
+        RpcCall call;
+        call.id = id_from_value(payload.at("id"));
+        auto &method = payload.at("method");
+        if (method.is_number_unsigned()) {
+            call.methodId = method.get<uint32_t>();
+        } else {
+            method.get_to(call.method);
+        }
+        auto &params = payload.at("params");
+        if (!params.is_array()) {
+            throw json::type_error::create(302, "params must be an array", &params);
+        }
+        call.params.values = std::move(params);
+        return call;
+    }
+
+    Envelope from_value(json &&message, const CompactEnvelope *session) {
+        Envelope envelope;
+        if (!message.is_object()) {
+            throw json::type_error::create(302, "message must be an object", &message);
+        }
+        auto field = [&message](const char *key) -> json * {
+            auto it = message.find(key);
+            return it != message.end() ? &*it : nullptr;
+        };
+        if (auto *type = field("type")) {
+            envelope.type = message_type(type->get_ref<const std::string &>());
+        } else if (auto *number = field("t")) {
+            envelope.type = type_from_number(number->get<uint64_t>());
+        }
+        if (auto *id = field("id")) {
+            envelope.id = std::move(id->get_ref<std::string &>());
+        } else if (auto *number = field("i")) {
+            envelope.id = id_from_value(*number);
+        }
+        if (auto *appId = field("appId")) {
+            envelope.appId = std::move(appId->get_ref<std::string &>());
+        } else if (auto *token = field("s")) {
+            envelope.appId = app_id(token->get<uint64_t>(), session);
+        }
+        if (auto *timestamp = field("timestamp")) {
+            envelope.timestamp = timestamp->get<uint64_t>();
+        } else if (auto *timestamp = field("ts")) {
+            envelope.timestamp = timestamp->get<uint64_t>();
+        }
+        if (auto *payload = field("payload")) {
+            envelope.payload = std::move(*payload);
+        } else if (auto *payload = field("p")) {
+            envelope.payload = std::move(*payload);
+        }
+        return envelope;
+    }
+}
+
+MessageType message_type(std::string_view name) {
+    if (name == "rpc-request") {
+        return MessageType::rpc_request;
+    }
+    if (name == "rpc-response") {
+        return MessageType::rpc_response;
+    }
+    if (name == "rpc-event") {
+        return MessageType::rpc_event;
+    }
+    if (name == "rpc-batch-request") {
+        return MessageType::rpc_batch_request;
+    }
+    if (name == "rpc-batch-response") {
+        return MessageType::rpc_batch_response;
+    }
+    if (name == "handshake") {
+        return MessageType::handshake;
+    }
+    if (name == "shm-attach") {
+        return MessageType::shm_attach;
+    }
+    return MessageType::unknown;
+}
+
+std::string_view message_type_name(MessageType type) {
+    switch (type) {
+        case MessageType::handshake:
+            return "handshake";
+        case MessageType::shm_attach:
+            return "shm-attach";
+        case MessageType::rpc_request:
+            return "rpc-request";
+        case MessageType::rpc_response:
+            return "rpc-response";
+        case MessageType::rpc_event:
+            return "rpc-event";
+        case MessageType::rpc_batch_request:
+            return "rpc-batch-request";
+        case MessageType::rpc_batch_response:
+            return "rpc-batch-response";
+        case MessageType::unknown:
+            break;
+    }
+    return {};
+}
+
+json compact_message(const json &message, const CompactEnvelope &session) {
+    auto type = message.is_object() && message.contains("type") && message["type"].is_string()
+                ? message_type(message["type"].get_ref<const std::string &>()) : MessageType::unknown;
+    if (type == MessageType::unknown) {
+        return message;
+    }
+    json compact = {
+            {"i", next_message_number()},
+            {"s", session.token},
+            {"t", static_cast<int>(type)},
+    };
+    if (auto it = message.find("timestamp"); it != message.end()) {
+        compact["ts"] = *it;
+    }
+    if (auto it = message.find("payload"); it != message.end()) {
+        auto &payload = compact["p"] = *it;
+        if (payload.is_object()) {
+            auto id = payload.find("id");
+            if (id != payload.end() && id->is_string() && is_number(id->get_ref<const std::string &>())) {
+                *id = std::stoull(id->get_ref<const std::string &>());
+            }
+        }
+    }
+    return compact;
+}
+
+json Envelope::take_payload() {
+    if (rawPayload.buffer) {
+        auto raw = std::move(rawPayload);
+        rawPayload = {};
+        return json::parse(raw.view());
+    }
+    return std::move(payload);
+}
+
+Envelope decode_envelope(const MessageCodec &codec, const BufferSlice &frame, const CompactEnvelope *session) {
+    auto text = frame.view();
+    bool is_text = !codec.is_binary() || (!text.empty() && text.front() == '{');
+    if (is_text) {
+        Envelope envelope;
+        if (scan_envelope(frame, envelope, session)) {
+            return envelope;
+        }
+        return from_value(json::parse(text), session);
+    }
+    return from_value(codec.decode(text), session);
+}
+
+RpcCall take_rpc_call(Envelope &envelope) {
+    RpcCall call;
+    if (envelope.rawPayload.buffer) {
+        auto raw = std::move(envelope.rawPayload);
+        envelope.rawPayload = {};
+        if (!scan_rpc_call(raw, call) || (call.method.empty() && !call.methodId) || call.rawParams.empty()) {
+            call = rpc_call_from_value(json::parse(raw.view()));
+        }
+    } else {
+        call = rpc_call_from_value(std::move(envelope.payload));
+    }
+    call.params.attachments = std::move(envelope.attachments);
+    return call;
+}
+
+bool peek_method(const Envelope &envelope, std::string &method, std::optional<uint32_t> &methodId) {
+    if (envelope.rawPayload.buffer) {
+        ObjectScanner scanner(envelope.rawPayload.view());
+        bool found = false;
+        // Stops at the method, which comes before the params in sorted keys
+        scanner.scan([&](std::string_view key) {
+            if (key == "method") {
+                found = scanner.read_method(method, methodId);
+                return false;
+            }
+            return scanner.skip_value();
+        });
+        return found;
+    }
+    if (!envelope.payload.is_object()) {
+        return false;
+    }
+    auto it = envelope.payload.find("method");
+    if (it == envelope.payload.end()) {
+        return false;
+    }
+    if (it->is_number_unsigned() && it->get<uint64_t>() <= UINT32_MAX) {
+        methodId = it->get<uint32_t>();
+        return true;
+    }
+    if (it->is_string()) {
+        method = it->get<std::string>();
+        return true;
+    }
+    return false;
+}
+
+RpcBatch take_rpc_batch(Envelope &envelope) {
+    auto payload = envelope.take_payload();
+    RpcBatch batch;
+    batch.id = id_from_value(payload.at("id"));
+    if (auto stream = payload.find("stream"); stream != payload.end()) {
+        stream->get_to(batch.stream);
+    }
+    auto &requests = payload.at("requests");
+    if (!requests.is_array()) {
+        throw json::type_error::create(302, "requests must be an array", &requests);
+    }
+    batch.calls.reserve(requests.size());
+    for (auto &request: requests) {
+        auto &entry = batch.calls.emplace_back();
+        try {
+            entry.call = rpc_call_from_value(std::move(request));
+        } catch (const json::exception &) {
+            entry.error = std::current_exception();
+            continue;
+        }
+        // Attachment references count from the start of the message's attachments
+        entry.call.params.attachments = envelope.attachments;
+    }
+    envelope.attachments.clear();
+    return batch;
+}
+
+bool peek_rpc_call(std::string_view prefix, RequestHead &head) {
+    ObjectScanner scanner(prefix);
+    // The prefix ends somewhere in the params, so both scans stop early
+    scanner.scan([&](std::string_view key) {
+        if (key == "appId") {
+            return scanner.read_string(head.appId);
+        }
+        if (key == "payload" || key == "p") {
+            ObjectScanner payload(scanner.rest());
+            payload.scan([&](std::string_view key) {
+                if (key == "id") {
+                    return payload.read_id(head.requestId);
+                }
+                if (key == "method") {
+                    return payload.read_method(head.method, head.methodId);
+                }
+                return payload.skip_value();
+            });
+            return false;
+        }
+        return scanner.skip_value();
+    });
+    return !head.requestId.empty() && (!head.method.empty() || head.methodId);
+}
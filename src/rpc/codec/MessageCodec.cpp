@@ -0,0 +1,119 @@
+//
+// Created by Right on 25/6/11 09:40.
+//
+
+#include "sauri/rpc/codec/message_codec.h"
+
+#include <algorithm>
+#include "sauri/rpc/detail/json_writer.h"
+
+namespace {
+    class JsonCodec : public MessageCodec {
+    public:
+        const std::string &name() const override {
+            static const std::string name = "json";
+            return name;
+        }
+
+        bool is_binary() const override { return false; }
+
+        void encode(const json &message, std::string &out) const override {
+            rpc::detail::dump_to(out, message);
+        }
+
+        json decode(std::string_view data) const override {
+            return json::parse(data);
+        }
+    };
+
+    class MsgpackCodec : public MessageCodec {
+    public:
+        const std::string &name() const override {
+            static const std::string name = "msgpack";
+            return name;
+        }
+
+        bool is_binary() const override { return true; }
+
+        void encode(const json &message, std::string &out) const override {
+            json::to_msgpack(message, nlohmann::detail::output_adapter<char, std::string>(out));
+        }
+
+        json decode(std::string_view data) const override {
+            return json::from_msgpack(data.begin(), data.end());
+        }
+    };
+
+    class CborCodec : public MessageCodec {
+    public:
+        const std::string &name() const override {
+            static const std::string name = "cbor";
+            return name;
+        }
+
+        bool is_binary() const override { return true; }
+
+        void encode(const json &message, std::string &out) const override {
+            json::to_cbor(message, nlohmann::detail::output_adapter<char, std::string>(out));
+        }
+
+        json decode(std::string_view data) const override {
+            return json::from_cbor(data.begin(), data.end());
+        }
+    };
+}
+
+CodecRegistry &CodecRegistry::shared() {
+    static CodecRegistry *registry = [] {
+        auto *r = new CodecRegistry();
+        r->add(json_codec());
+        r->add(std::make_shared<MsgpackCodec>());
+        r->add(std::make_shared<CborCodec>());
+        return r;
+    }();
+    return *registry;
+}
+
+void CodecRegistry::add(CodecPtr codec) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(codecs_.begin(), codecs_.end(), [&codec](const CodecPtr &existing) {
+        return existing->name() == codec->name();
+    });
+    if (it != codecs_.end()) {
+        *it = std::move(codec);
+    } else {
+        codecs_.push_back(std::move(codec));
+    }
+}
+
+CodecPtr CodecRegistry::find(std::string_view name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &codec: codecs_) {
+        if (codec->name() == name) {
+            return codec;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<std::string> CodecRegistry::names() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> names;
+    names.reserve(codecs_.size());
+    for (const auto &codec: codecs_) {
+        names.push_back(codec->name());
+    }
+    return names;
+}
+
+const CodecPtr &CodecRegistry::json_codec() {
+    static const CodecPtr codec = std::make_shared<JsonCodec>();
+    return codec;
+}
+
+json decode_message(const MessageCodec &codec, std::string_view data) {
+    if (codec.is_binary() && !data.empty() && data.front() == '{') {
+        return json::parse(data);
+    }
+    return codec.decode(data);
+}
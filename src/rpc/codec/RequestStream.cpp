@@ -0,0 +1,267 @@
+//
+// Created by Right on 25/6/14 16:40.
+//
+
+#include "sauri/rpc/codec/request_stream.h"
+
+namespace {
+    // Walks JSON objects on a stream buffer one character at a time, without lookahead past the
+    // character it is deciding on. Like the envelope scanner it only finds keys; values are
+    // validated by whoever parses them.
+    class StreamScanner {
+    public:
+        using traits = std::streambuf::traits_type;
+
+        explicit StreamScanner(std::streambuf &in) : in_(in) {}
+
+        // on_field(key) is called with the stream on the key's value, and must read or skip it;
+        // it returns false to stop, leaving the stream where it is
+        template<typename OnField>
+        bool scan(OnField &&on_field) {
+            if (!consume('{')) {
+                return false;
+            }
+            if (consume('}')) {
+                return true;
+            }
+            std::string key;
+            while (true) {
+                if (!read_string(key) || !consume(':')) {
+                    return false;
+                }
+                skip_ws();
+                if (!on_field(key)) {
+                    return false;
+                }
+                if (consume(',')) {
+                    continue;
+                }
+                return consume('}');
+            }
+        }
+
+        bool read_string(std::string &out) {
+            skip_ws();
+            if (peek() != '"') {
+                return false;
+            }
+            bump();
+            std::string token(1, '"');
+            bool escaped = false;
+            while (true) {
+                auto c = in_.sbumpc();
+                if (c == traits::eof()) {
+                    return false;
+                }
+                token.push_back(static_cast<char>(c));
+                ++read_;
+                if (c == '\\') {
+                    escaped = true;
+                    c = in_.sbumpc();
+                    if (c == traits::eof()) {
+                        return false;
+                    }
+                    token.push_back(static_cast<char>(c));
+                    ++read_;
+                } else if (c == '"') {
+                    break;
+                }
+            }
+            if (escaped) {
+                out = json::parse(token).get<std::string>();
+            } else {
+                out.assign(token, 1, token.size() - 2);
+            }
+            return true;
+        }
+
+        // A string id, or an integer one from a compact envelope as its decimal text
+        bool read_id(std::string &out) {
+            skip_ws();
+            if (peek() == '"') {
+                return read_string(out);
+            }
+            std::string digits;
+            while (peek() >= '0' && peek() <= '9' && digits.size() < 20) {
+                digits.push_back(static_cast<char>(peek()));
+                bump();
+            }
+            if (digits.empty() || digits.size() == 20) {
+                return false;
+            }
+            out = std::to_string(std::stoull(digits));
+            return true;
+        }
+
+        // A method name, or the numeric id the registration advertised for it
+        bool read_method(std::string &name, std::optional<uint32_t> &id) {
+            skip_ws();
+            if (peek() == '"') {
+                return read_string(name);
+            }
+            std::string digits;
+            if (!read_id(digits) || digits.size() > 10 || std::stoull(digits) > UINT32_MAX) {
+                return false;
+            }
+            id = static_cast<uint32_t>(std::stoull(digits));
+            return true;
+        }
+
+        // Brackets are only counted, not matched, as in the envelope scanner
+        bool skip_value() {
+            skip_ws();
+            int depth = 0;
+            bool in_string = false;
+            while (true) {
+                auto c = peek();
+                if (c == traits::eof()) {
+                    return false;
+                }
+                if (in_string) {
+                    bump();
+                    if (c == '\\') {
+                        bump();
+                    } else if (c == '"') {
+                        in_string = false;
+                        if (depth == 0) {
+                            return true;
+                        }
+                    }
+                    continue;
+                }
+                if (c == '"') {
+                    in_string = true;
+                } else if (c == '{' || c == '[') {
+                    ++depth;
+                } else if (c == '}' || c == ']') {
+                    if (depth == 0) {
+                        // End of the enclosing object: a scalar ends here
+                        return true;
+                    }
+                    if (--depth == 0) {
+                        bump();
+                        return true;
+                    }
+                } else if (depth == 0 && (c == ',' || is_ws(c))) {
+                    return true;
+                }
+                bump();
+            }
+        }
+
+        // Characters consumed so far, for error positions
+        std::size_t position() const { return read_; }
+
+    private:
+        static bool is_ws(traits::int_type c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+        }
+
+        traits::int_type peek() { return in_.sgetc(); }
+
+        void bump() {
+            in_.sbumpc();
+            ++read_;
+        }
+
+        void skip_ws() {
+            while (is_ws(peek())) {
+                bump();
+            }
+        }
+
+        bool consume(char c) {
+            skip_ws();
+            if (peek() != c) {
+                return false;
+            }
+            bump();
+            return true;
+        }
+
+        std::streambuf &in_;
+        std::size_t read_ = 0;
+    };
+}
+
+void ChunkStream::push(BufferSlice chunk) {
+    if (chunk.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (abandoned_ || closed_) {
+            return;
+        }
+        chunks_.push_back(std::move(chunk));
+    }
+    cv_.notify_one();
+}
+
+void ChunkStream::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_one();
+}
+
+void ChunkStream::abandon() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    abandoned_ = true;
+    closed_ = true;
+    chunks_.clear();
+}
+
+ChunkStream::int_type ChunkStream::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Let go of the piece that was just read before waiting for the next one
+    current_ = {};
+    cv_.wait(lock, [this] { return !chunks_.empty() || closed_; });
+    if (chunks_.empty()) {
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+    current_ = std::move(chunks_.front());
+    chunks_.pop_front();
+    lock.unlock();
+
+    // The get area is never written through
+    auto *begin = const_cast<char *>(current_.view().data());
+    setg(begin, begin, begin + current_.size);
+    return traits_type::to_int_type(*begin);
+}
+
+RpcCall read_rpc_call(std::istream &in) {
+    StreamScanner scanner(*in.rdbuf());
+    RpcCall call;
+    bool at_params = false;
+    scanner.scan([&](const std::string &key) {
+        if (key != "payload" && key != "p") {
+            return scanner.skip_value();
+        }
+        scanner.scan([&](const std::string &key) {
+            if (key == "id") {
+                return scanner.read_id(call.id);
+            }
+            if (key == "method") {
+                return scanner.read_method(call.method, call.methodId);
+            }
+            if (key == "params") {
+                at_params = true;
+                return false;
+            }
+            return scanner.skip_value();
+        });
+        return false;
+    });
+    if (!at_params || call.id.empty() || (call.method.empty() && !call.methodId)) {
+        throw json::parse_error::create(101, scanner.position(),
+                                        "streamed request needs payload id and method ahead of params", nullptr);
+    }
+    call.params.stream = &in;
+    return call;
+}
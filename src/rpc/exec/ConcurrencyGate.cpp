@@ -0,0 +1,46 @@
+//
+// Created by Right on 25/6/17 16:00.
+//
+
+#include "sauri/rpc/exec/concurrency_gate.h"
+
+#include <algorithm>
+
+ConcurrencyGate::ConcurrencyGate(std::size_t limit) : limit_(std::max<std::size_t>(limit, 1)) {}
+
+void ConcurrencyGate::submit(std::function<void()> start) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_ >= limit_) {
+            waiting_.push_back(std::move(start));
+            return;
+        }
+        ++running_;
+    }
+    start();
+}
+
+void ConcurrencyGate::release() {
+    std::function<void()> next;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (waiting_.empty()) {
+            --running_;
+            return;
+        }
+        // The slot passes straight to the next call
+        next = std::move(waiting_.front());
+        waiting_.pop_front();
+    }
+    next();
+}
+
+std::size_t ConcurrencyGate::running() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_;
+}
+
+std::size_t ConcurrencyGate::waiting() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waiting_.size();
+}
@@ -0,0 +1,289 @@
+//
+// Created by Right on 25/6/16 10:30.
+//
+
+#include "sauri/rpc/exec/work_stealing_executor.h"
+
+#include <algorithm>
+#include <random>
+#include <thread>
+
+namespace {
+    // Rounds of looking for work before an idle worker parks; each round yields the core
+    constexpr int kSpinRounds = 64;
+
+    struct CurrentWorker {
+        const WorkStealingExecutor *executor = nullptr;
+        std::size_t index = 0;
+    };
+
+    thread_local CurrentWorker current_worker;
+}
+
+struct WorkStealingExecutor::Worker {
+    std::array<TaskDeque<item *>, kPriorityCount> deques;
+    std::thread thread;
+    // Picks the first victim to steal from
+    std::minstd_rand random;
+    // Next position in turns_
+    std::size_t turn = 0;
+
+    // Queueing time by lane; only this worker writes them
+    struct Counters {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> waitNs{0};
+        std::atomic<uint64_t> maxWaitNs{0};
+    };
+    std::array<Counters, kPriorityCount> counters;
+};
+
+WorkStealingExecutor::WorkStealingExecutor(std::size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers_.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->random.seed(static_cast<unsigned>(i + 1));
+        workers_.push_back(std::move(worker));
+    }
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+    stop();
+    // Whatever was posted too late to run
+    for (std::size_t lane = 0; lane < kPriorityCount; ++lane) {
+        for (auto &worker: workers_) {
+            while (auto *t = worker->deques[lane].take()) {
+                delete t;
+            }
+        }
+        while (auto *t = injection_[lane].pop()) {
+            delete t;
+        }
+        for (auto *t: overflow_[lane]) {
+            delete t;
+        }
+    }
+}
+
+void WorkStealingExecutor::set_lane_scheduling(LaneScheduling scheduling,
+                                               std::array<unsigned, kPriorityCount> weights) {
+    scheduling_ = scheduling;
+    turns_.clear();
+    if (scheduling != LaneScheduling::weighted) {
+        return;
+    }
+    // Smooth weighted round robin: each turn goes to the lane with the most accumulated credit,
+    // which spreads a lane's turns out instead of running them back to back
+    int64_t total = 0;
+    for (auto &weight: weights) {
+        weight = std::max(weight, 1u);
+        total += weight;
+    }
+    std::array<int64_t, kPriorityCount> credit{};
+    for (int64_t turn = 0; turn < total; ++turn) {
+        std::size_t best = 0;
+        for (std::size_t lane = 0; lane < kPriorityCount; ++lane) {
+            credit[lane] += weights[lane];
+            if (credit[lane] > credit[best]) {
+                best = lane;
+            }
+        }
+        credit[best] -= total;
+        turns_.push_back(best);
+    }
+}
+
+void WorkStealingExecutor::start() {
+    if (started_.exchange(true)) {
+        return;
+    }
+    stopping_ = false;
+    for (std::size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->thread = std::thread([this, i] {
+            run(i);
+        });
+    }
+}
+
+void WorkStealingExecutor::stop() {
+    if (!started_.exchange(false)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        stopping_ = true;
+        wake_epoch_.fetch_add(1, std::memory_order_relaxed);
+    }
+    park_cv_.notify_all();
+    for (auto &worker: workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void WorkStealingExecutor::post(task t, Priority priority) {
+    auto lane = static_cast<std::size_t>(priority);
+    auto *entry = new item{std::move(t), std::chrono::steady_clock::now()};
+    if (current_worker.executor == this) {
+        workers_[current_worker.index]->deques[lane].push(entry);
+    } else if (!injection_[lane].push(entry)) {
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        overflow_[lane].push_back(entry);
+        overflow_size_.fetch_add(1, std::memory_order_release);
+    }
+    notify();
+}
+
+LaneStats WorkStealingExecutor::lane_stats(Priority priority) const {
+    auto lane = static_cast<std::size_t>(priority);
+    LaneStats stats;
+    for (const auto &worker: workers_) {
+        const auto &counters = worker->counters[lane];
+        stats.tasks += counters.tasks.load(std::memory_order_relaxed);
+        stats.totalWait += std::chrono::nanoseconds(counters.waitNs.load(std::memory_order_relaxed));
+        stats.maxWait = std::max(stats.maxWait,
+                                 std::chrono::nanoseconds(counters.maxWaitNs.load(std::memory_order_relaxed)));
+    }
+    return stats;
+}
+
+bool WorkStealingExecutor::running_in_this_thread() const {
+    return current_worker.executor == this;
+}
+
+void WorkStealingExecutor::run(std::size_t index) {
+    current_worker = {this, index};
+    auto &worker = *workers_[index];
+    int idle = 0;
+    while (true) {
+        std::size_t lane = 0;
+        if (auto *t = find_task(index, lane)) {
+            std::unique_ptr<item> owned(t);
+            auto wait = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - owned->posted).count());
+            auto &counters = worker.counters[lane];
+            counters.tasks.store(counters.tasks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            counters.waitNs.store(counters.waitNs.load(std::memory_order_relaxed) + wait, std::memory_order_relaxed);
+            if (wait > counters.maxWaitNs.load(std::memory_order_relaxed)) {
+                counters.maxWaitNs.store(wait, std::memory_order_relaxed);
+            }
+            owned->fn();
+            idle = 0;
+            continue;
+        }
+        if (stopping_.load(std::memory_order_acquire)) {
+            // Queues drained; other workers finish what is in their own deques
+            break;
+        }
+        if (++idle < kSpinRounds) {
+            std::this_thread::yield();
+            continue;
+        }
+        park();
+        idle = 0;
+    }
+    current_worker = {};
+}
+
+WorkStealingExecutor::item *WorkStealingExecutor::find_task(std::size_t index, std::size_t &lane) {
+    if (!turns_.empty()) {
+        auto &worker = *workers_[index];
+        auto preferred = turns_[worker.turn];
+        worker.turn = (worker.turn + 1) % turns_.size();
+        if (auto *t = take_from_lane(index, preferred)) {
+            lane = preferred;
+            return t;
+        }
+    }
+    for (lane = 0; lane < kPriorityCount; ++lane) {
+        if (auto *t = take_from_lane(index, lane)) {
+            return t;
+        }
+    }
+    return nullptr;
+}
+
+WorkStealingExecutor::item *WorkStealingExecutor::take_from_lane(std::size_t index, std::size_t lane) {
+    if (auto *t = workers_[index]->deques[lane].take()) {
+        return t;
+    }
+    if (auto *t = injection_[lane].pop()) {
+        return t;
+    }
+    if (overflow_size_.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        if (!overflow_[lane].empty()) {
+            auto *t = overflow_[lane].front();
+            overflow_[lane].pop_front();
+            overflow_size_.fetch_sub(1, std::memory_order_relaxed);
+            return t;
+        }
+    }
+    return steal(index, lane);
+}
+
+WorkStealingExecutor::item *WorkStealingExecutor::steal(std::size_t thief, std::size_t lane) {
+    auto count = workers_.size();
+    if (count < 2) {
+        return nullptr;
+    }
+    // A steal can fail against a concurrent take, so go around twice
+    auto start = workers_[thief]->random() % count;
+    for (std::size_t i = 0; i < 2 * count; ++i) {
+        auto victim = (start + i) % count;
+        auto &deque = workers_[victim]->deques[lane];
+        if (victim == thief || deque.empty()) {
+            continue;
+        }
+        if (auto *t = deque.steal()) {
+            return t;
+        }
+    }
+    return nullptr;
+}
+
+bool WorkStealingExecutor::has_work() const {
+    if (overflow_size_.load(std::memory_order_acquire) > 0) {
+        return true;
+    }
+    for (std::size_t lane = 0; lane < kPriorityCount; ++lane) {
+        if (!injection_[lane].empty()) {
+            return true;
+        }
+        for (const auto &worker: workers_) {
+            if (!worker->deques[lane].empty()) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void WorkStealingExecutor::park() {
+    auto epoch = wake_epoch_.load(std::memory_order_acquire);
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    // Pairs with the fence in notify(): either the poster sees the sleeper, or this sees the task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!has_work() && !stopping_.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        park_cv_.wait(lock, [this, epoch] {
+            return wake_epoch_.load(std::memory_order_relaxed) != epoch;
+        });
+    }
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void WorkStealingExecutor::notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        wake_epoch_.fetch_add(1, std::memory_order_relaxed);
+    }
+    park_cv_.notify_one();
+}
@@ -0,0 +1,73 @@
+//
+// Created by Right on 25/6/6 10:05.
+//
+
+#include "sauri/rpc/pipe/buffer_pool.h"
+
+struct BufferPool::State {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::string>> free;
+    std::size_t max_pooled_buffers;
+    std::size_t max_pooled_capacity;
+    bool closed = false;
+};
+
+BufferPool::BufferPool(std::size_t max_pooled_buffers, std::size_t max_pooled_capacity)
+        : state_(std::make_shared<State>()) {
+    state_->max_pooled_buffers = max_pooled_buffers;
+    state_->max_pooled_capacity = max_pooled_capacity;
+}
+
+BufferPool::~BufferPool() {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->closed = true;
+    state_->free.clear();
+}
+
+BufferPool &BufferPool::shared() {
+    static BufferPool pool;
+    return pool;
+}
+
+MessageBuffer BufferPool::acquire(std::size_t min_capacity) {
+    std::unique_ptr<std::string> buffer;
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (!state_->free.empty()) {
+            buffer = std::move(state_->free.back());
+            state_->free.pop_back();
+        }
+    }
+    if (!buffer) {
+        buffer = std::make_unique<std::string>();
+    }
+    buffer->reserve(min_capacity);
+
+    return {buffer.release(), [state = state_](std::string *released) {
+        release(state, released);
+    }};
+}
+
+MessageBuffer BufferPool::copy(std::string_view data) {
+    auto buffer = acquire(data.size());
+    buffer->assign(data);
+    return buffer;
+}
+
+std::size_t BufferPool::pooled() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->free.size();
+}
+
+void BufferPool::release(const std::shared_ptr<State> &state, std::string *buffer) {
+    std::unique_ptr<std::string> owned(buffer);
+    if (owned->capacity() > state->max_pooled_capacity) {
+        return;
+    }
+
+    owned->clear();
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (!state->closed && state->free.size() < state->max_pooled_buffers) {
+        state->free.push_back(std::move(owned));
+    }
+}
@@ -0,0 +1,218 @@
+//
+// Created by Right on 25/6/13 17:20.
+//
+
+#include "sauri/rpc/pipe/frame_compressor.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "sauri/rpc/pipe/frame_codec.h"
+
+#if defined(SAURI_HAS_LZ4)
+#include <lz4.h>
+#endif
+#if defined(SAURI_HAS_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace {
+    // Original size ahead of the compressed bytes
+    constexpr std::size_t kSizeFieldSize = 4;
+
+    void write_le32(char *out, uint32_t value) {
+        out[0] = static_cast<char>(value & 0xFF);
+        out[1] = static_cast<char>((value >> 8) & 0xFF);
+        out[2] = static_cast<char>((value >> 16) & 0xFF);
+        out[3] = static_cast<char>((value >> 24) & 0xFF);
+    }
+
+    uint32_t read_le32(const char *in) {
+        auto p = reinterpret_cast<const unsigned char *>(in);
+        return static_cast<uint32_t>(p[0]) |
+               (static_cast<uint32_t>(p[1]) << 8) |
+               (static_cast<uint32_t>(p[2]) << 16) |
+               (static_cast<uint32_t>(p[3]) << 24);
+    }
+}
+
+std::string_view compression_name(Compression algorithm) {
+    switch (algorithm) {
+        case Compression::lz4:
+            return "lz4";
+        case Compression::zstd:
+            return "zstd";
+        case Compression::none:
+            break;
+    }
+    return "none";
+}
+
+std::optional<Compression> compression_from_name(std::string_view name) {
+    if (name == "lz4") {
+        return Compression::lz4;
+    }
+    if (name == "zstd") {
+        return Compression::zstd;
+    }
+    if (name == "none") {
+        return Compression::none;
+    }
+    return std::nullopt;
+}
+
+bool compression_supported(Compression algorithm) {
+    switch (algorithm) {
+        case Compression::none:
+            return true;
+        case Compression::lz4:
+#if defined(SAURI_HAS_LZ4)
+            return true;
+#else
+            return false;
+#endif
+        case Compression::zstd:
+#if defined(SAURI_HAS_ZSTD)
+            return true;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+std::vector<std::string> supported_compressions() {
+    std::vector<std::string> names;
+    // lz4 first: frames are compressed on the I/O thread, where latency matters more than ratio
+    for (auto algorithm: {Compression::lz4, Compression::zstd}) {
+        if (compression_supported(algorithm)) {
+            names.emplace_back(compression_name(algorithm));
+        }
+    }
+    return names;
+}
+
+struct FrameCompressor::Contexts {
+#if defined(SAURI_HAS_LZ4)
+    std::string lz4_state;
+#endif
+#if defined(SAURI_HAS_ZSTD)
+    ZSTD_CCtx *zstd_compress = nullptr;
+    ZSTD_DCtx *zstd_decompress = nullptr;
+
+    ~Contexts() {
+        ZSTD_freeCCtx(zstd_compress);
+        ZSTD_freeDCtx(zstd_decompress);
+    }
+#endif
+};
+
+FrameCompressor::FrameCompressor(const CompressionOptions &options)
+        : options_(options),
+          contexts_(std::make_unique<Contexts>()) {
+    if (!compression_supported(options_.algorithm)) {
+        throw std::runtime_error("Compression not supported by this build: " +
+                                 std::string(compression_name(options_.algorithm)));
+    }
+#if defined(SAURI_HAS_LZ4)
+    if (options_.algorithm == Compression::lz4) {
+        contexts_->lz4_state.resize(static_cast<std::size_t>(LZ4_sizeofState()));
+    }
+#endif
+#if defined(SAURI_HAS_ZSTD)
+    if (options_.algorithm == Compression::zstd) {
+        contexts_->zstd_compress = ZSTD_createCCtx();
+        contexts_->zstd_decompress = ZSTD_createDCtx();
+        if (!contexts_->zstd_compress || !contexts_->zstd_decompress) {
+            throw std::runtime_error("Failed to create zstd contexts");
+        }
+    }
+#endif
+}
+
+FrameCompressor::~FrameCompressor() = default;
+
+SharedBuffer FrameCompressor::compress(std::string_view payload) {
+    if (options_.algorithm == Compression::none || payload.size() < options_.threshold ||
+        payload.size() > kFrameLengthMask) {
+        return nullptr;
+    }
+
+    std::size_t bound = 0;
+#if defined(SAURI_HAS_LZ4)
+    if (options_.algorithm == Compression::lz4) {
+        bound = static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(payload.size())));
+    }
+#endif
+#if defined(SAURI_HAS_ZSTD)
+    if (options_.algorithm == Compression::zstd) {
+        bound = ZSTD_compressBound(payload.size());
+    }
+#endif
+    if (bound == 0) {
+        return nullptr;
+    }
+
+    auto frame = BufferPool::shared().acquire(kFrameHeaderSize + kSizeFieldSize + bound);
+    auto start = begin_frame(*frame, FrameMode::length_prefixed);
+    frame->resize(start + kFrameHeaderSize + kSizeFieldSize + bound);
+    write_le32(frame->data() + start + kFrameHeaderSize, static_cast<uint32_t>(payload.size()));
+    [[maybe_unused]] char *out = frame->data() + start + kFrameHeaderSize + kSizeFieldSize;
+
+    std::size_t compressed = 0;
+#if defined(SAURI_HAS_LZ4)
+    if (options_.algorithm == Compression::lz4) {
+        auto written = LZ4_compress_fast_extState(contexts_->lz4_state.data(), payload.data(), out,
+                                                  static_cast<int>(payload.size()), static_cast<int>(bound),
+                                                  std::max(options_.level, 1));
+        compressed = written > 0 ? static_cast<std::size_t>(written) : 0;
+    }
+#endif
+#if defined(SAURI_HAS_ZSTD)
+    if (options_.algorithm == Compression::zstd) {
+        auto written = ZSTD_compressCCtx(contexts_->zstd_compress, out, bound, payload.data(), payload.size(),
+                                         options_.level);
+        compressed = ZSTD_isError(written) ? 0 : written;
+    }
+#endif
+    // Incompressible data goes out as it is
+    if (compressed == 0 || compressed + kSizeFieldSize >= payload.size()) {
+        return nullptr;
+    }
+
+    frame->resize(start + kFrameHeaderSize + kSizeFieldSize + compressed);
+    end_frame(*frame, start, FrameMode::length_prefixed, kFrameCompressed);
+    return frame;
+}
+
+BufferSlice FrameCompressor::decompress(std::string_view payload, std::size_t max_size) {
+    if (payload.size() < kSizeFieldSize) {
+        throw std::runtime_error("Truncated compressed frame");
+    }
+    std::size_t size = read_le32(payload.data());
+    if (size > max_size) {
+        throw std::runtime_error("Compressed frame of " + std::to_string(size) + " bytes exceeds limit");
+    }
+    [[maybe_unused]] const char *in = payload.data() + kSizeFieldSize;
+    [[maybe_unused]] std::size_t in_size = payload.size() - kSizeFieldSize;
+
+    auto buffer = BufferPool::shared().acquire(size);
+    buffer->resize(size);
+    bool ok = false;
+#if defined(SAURI_HAS_LZ4)
+    if (options_.algorithm == Compression::lz4 && in_size <= std::numeric_limits<int>::max()) {
+        auto read = LZ4_decompress_safe(in, buffer->data(), static_cast<int>(in_size), static_cast<int>(size));
+        ok = read >= 0 && static_cast<std::size_t>(read) == size;
+    }
+#endif
+#if defined(SAURI_HAS_ZSTD)
+    if (options_.algorithm == Compression::zstd) {
+        auto read = ZSTD_decompressDCtx(contexts_->zstd_decompress, buffer->data(), size, in, in_size);
+        ok = !ZSTD_isError(read) && read == size;
+    }
+#endif
+    if (!ok) {
+        throw std::runtime_error("Corrupt compressed frame");
+    }
+    return {SharedBuffer(std::move(buffer)), 0, size};
+}
@@ -3,23 +3,41 @@
 //
 #include "sauri/rpc/pipe/named_pipe_client.h"
 
+#include <algorithm>
+#include <cmath>
 #include <utility>
 #include "sauri/logger_helper/logger_helper.h"
 
 
-NamedPipeClient::NamedPipeClient(asio::io_context &io_context, std::string server_name)
+NamedPipeClient::NamedPipeClient(asio::io_context &io_context, std::string server_name, FrameMode frame_mode)
         : io_context_(io_context),
+          strand_(io_context.get_executor()),
           server_name_(std::move(server_name)),
-          pipe_(nullptr),
-          buffer_(4096),
-          connected_(false) {
+          frame_mode_(frame_mode),
+          max_write_batch_(kDefaultMaxWriteBatch),
+          connected_(false),
+          wanted_(false),
+          generation_(0),
+          state_(ConnectionState::disconnected),
+          retry_timer_(io_context),
+          retry_count_(0),
+          rng_(std::random_device{}()),
+          connect_attempts_(0),
+          connect_failures_(0),
+          connects_(0),
+          disconnects_(0),
+          last_recovery_ms_(0) {
 }
 
 bool NamedPipeClient::connect() {
     if (connected_) return true;
 
-    std::string pipe_name = "\\\\.\\pipe\\" + server_name_;
+    ++connect_attempts_;
+    down_since_ = std::chrono::steady_clock::now();
+
+    std::string pipe_name = resolve_pipe_path(server_name_);
     LOG(INFO) << "[D]"<< "connect to: " << pipe_name;
+#if defined(_WIN32)
     // 尝试连接到命名管道
     HANDLE pipe_handle = CreateFileA(
             pipe_name.c_str(),
@@ -38,6 +56,7 @@ bool NamedPipeClient::connect() {
             // 等待管道可用
             if (!WaitNamedPipeA(pipe_name.c_str(), 5000)) {
                 std::cerr << "等待管道超时，错误码: " << GetLastError() << std::endl;
+                ++connect_failures_;
                 return false;
             }
 
@@ -53,60 +72,288 @@ bool NamedPipeClient::connect() {
 
             if (pipe_handle == INVALID_HANDLE_VALUE) {
                 std::cerr << "连接到命名管道失败，错误码: " << GetLastError() << std::endl;
+                ++connect_failures_;
                 return false;
             }
         } else {
             std::cerr << "连接到命名管道失败，错误码: " << error << std::endl;
+            ++connect_failures_;
             return false;
         }
     }
 
     // 创建 stream_handle
-    pipe_ = std::make_unique<asio::windows::stream_handle>(io_context_, pipe_handle);
+    start_session(pipe_stream(io_context_, pipe_handle));
+#else
+    pipe_stream socket(io_context_);
+    boost::system::error_code ec;
+    socket.connect(pipe_endpoint(pipe_name), ec);
+    if (ec) {
+        std::cerr << "连接到命名管道失败: " << ec.message() << std::endl;
+        ++connect_failures_;
+        return false;
+    }
+    start_session(std::move(socket));
+#endif
+
+    return true;
+}
+
+void NamedPipeClient::start() {
+    if (wanted_.exchange(true)) return;
+
+    asio::dispatch(strand_, [self = shared_from_this()]() {
+        if (self->connected_) return;
+        self->down_since_ = std::chrono::steady_clock::now();
+        self->retry_count_ = 0;
+        self->try_connect();
+    });
+}
+
+void NamedPipeClient::try_connect() {
+    if (!wanted_ || connected_) return;
+
+    state_ = ConnectionState::connecting;
+    ++connect_attempts_;
+    std::string pipe_name = resolve_pipe_path(server_name_);
+#if defined(_WIN32)
+    // 不调用 WaitNamedPipeA 阻塞等待：管道忙或不存在时按退避策略重试
+    HANDLE pipe_handle = CreateFileA(
+            pipe_name.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            0, NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED,
+            NULL
+    );
+    if (pipe_handle == INVALID_HANDLE_VALUE) {
+        on_connect_failed();
+        return;
+    }
+    retry_count_ = 0;
+    start_session(pipe_stream(io_context_, pipe_handle));
+#else
+    connecting_ = std::make_unique<pipe_stream>(io_context_);
+    auto *socket = connecting_.get();
+    socket->async_connect(
+            pipe_endpoint(pipe_name),
+            asio::bind_executor(strand_, [self = shared_from_this(), socket](const boost::system::error_code &ec) {
+                // Superseded by close() or a newer attempt
+                if (self->connecting_.get() != socket || ec == asio::error::operation_aborted) return;
+
+                auto stream = std::move(self->connecting_);
+                if (ec) {
+                    self->on_connect_failed();
+                    return;
+                }
+                if (!self->wanted_) return;
+                self->retry_count_ = 0;
+                self->start_session(std::move(*stream));
+            }));
+#endif
+}
+
+void NamedPipeClient::on_connect_failed() {
+    ++connect_failures_;
+    if (!wanted_) {
+        state_ = ConnectionState::disconnected;
+        return;
+    }
+    schedule_retry();
+}
+
+void NamedPipeClient::schedule_retry() {
+    double delay = static_cast<double>(reconnect_.initial_delay.count()) *
+                   std::pow(reconnect_.multiplier, static_cast<double>(retry_count_));
+    delay = std::min(delay, static_cast<double>(reconnect_.max_delay.count()));
+    if (delay < static_cast<double>(reconnect_.max_delay.count())) {
+        ++retry_count_;
+    }
+    double jitter = std::clamp(reconnect_.jitter, 0.0, 1.0);
+    delay *= std::uniform_real_distribution<double>(1.0 - jitter, 1.0 + jitter)(rng_);
+
+    state_ = ConnectionState::connecting;
+    retry_timer_.expires_after(std::chrono::milliseconds(std::llround(delay)));
+    retry_timer_.async_wait(asio::bind_executor(strand_, [self = shared_from_this()](const boost::system::error_code &ec) {
+        if (!ec) {
+            self->try_connect();
+        }
+    }));
+}
+
+void NamedPipeClient::start_session(pipe_stream stream) {
+    auto session = std::make_shared<PipeSession>(0, std::move(stream), frame_mode_);
+    session->set_max_write_batch(max_write_batch_);
+    session->set_write_queue_limits(write_queue_limits_);
+    session->set_heartbeat(heartbeat_);
+    if (writable_handler_) {
+        session->set_writable_handler([handler = writable_handler_](session_id) {
+            handler();
+        });
+    }
+    if (attachment_handler_) {
+        session->set_attachment_handler([handler = attachment_handler_](session_id, const BufferSlice &frame) {
+            handler(frame);
+        });
+    }
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        session_ = session;
+    }
+    uint64_t generation = ++generation_;
     connected_ = true;
+    state_ = ConnectionState::connected;
+    ++connects_;
+    last_recovery_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - down_since_).count();
 
-    // 通知连接成功
+    // 开始读取
+    auto self = shared_from_this();
+    session->start(
+            [this, self](session_id, const BufferSlice &frame) {
+                if (message_handler_) {
+                    message_handler_(frame.view());
+                }
+            },
+            [this, self, generation](session_id, const boost::system::error_code &) {
+                // 连接断开或错误
+                asio::post(strand_, [self, generation]() {
+                    self->on_session_closed(generation);
+                });
+            });
+
+    // 通知连接成功; the session is running, so the handler can write
     if (connection_handler_) {
         connection_handler_(true);
     }
+}
 
-    // 开始读取
-    start_read();
+void NamedPipeClient::on_session_closed(uint64_t generation) {
+    // close() already reported this one
+    if (generation != generation_ || !connected_.exchange(false)) return;
 
-    return true;
+    ++disconnects_;
+    state_ = ConnectionState::disconnected;
+    down_since_ = std::chrono::steady_clock::now();
+
+    // 通知断开连接
+    if (connection_handler_) {
+        connection_handler_(false);
+    }
+
+    if (wanted_ && reconnect_.enabled) {
+        retry_count_ = 0;
+        schedule_retry();
+    } else {
+        wanted_ = false;
+    }
+}
+
+void NamedPipeClient::stop_connecting() {
+    retry_timer_.cancel();
+#if !defined(_WIN32)
+    connecting_.reset();
+#endif
+    if (!connected_) {
+        state_ = ConnectionState::disconnected;
+    }
 }
 
-void NamedPipeClient::write(const std::string &message) {
-    if (!connected_ || !pipe_) return;
+bool NamedPipeClient::write(const std::string &message, OverflowPolicy policy) {
+    auto session = current_session();
+    if (!connected_ || !session) return false;
 
-    auto self = shared_from_this();
+    return session->write(message, policy);
+}
 
-    // 使用strand确保写入操作的顺序
-    asio::post(strand_, [this, self, message]() {
-        bool write_in_progress = !write_queue_.empty();
-        write_queue_.push_back(message);
+bool NamedPipeClient::write(SharedBuffer frame, OverflowPolicy policy) {
+    auto session = current_session();
+    if (!connected_ || !session) return false;
 
-        if (!write_in_progress) {
-            do_write();
-        }
-    });
+    return session->write(std::move(frame), policy);
+}
+
+bool NamedPipeClient::write(std::vector<SharedBuffer> frames, OverflowPolicy policy) {
+    auto session = current_session();
+    if (!connected_ || !session) return false;
+
+    return session->write(std::move(frames), policy);
 }
 
 void NamedPipeClient::set_message_handler(NamedPipeClient::MessageHandler handler) {
     message_handler_ = handler;
 }
 
+void NamedPipeClient::set_frame_mode(FrameMode mode) {
+    frame_mode_ = mode;
+}
+
+void NamedPipeClient::set_max_write_batch(std::size_t bytes) {
+    max_write_batch_ = bytes;
+}
+
+void NamedPipeClient::set_write_queue_limits(const WriteQueueLimits &limits) {
+    write_queue_limits_ = limits;
+}
+
+void NamedPipeClient::set_writable_handler(NamedPipeClient::WritableHandler handler) {
+    writable_handler_ = handler;
+}
+
+void NamedPipeClient::set_attachment_handler(NamedPipeClient::AttachmentHandler handler) {
+    attachment_handler_ = handler;
+}
+
+void NamedPipeClient::set_heartbeat(const HeartbeatOptions &options) {
+    heartbeat_ = options;
+}
+
+bool NamedPipeClient::set_compression(const CompressionOptions &options) {
+    auto session = current_session();
+    return connected_ && session && session->set_compression(options);
+}
+
+bool NamedPipeClient::is_writable() const {
+    auto session = current_session();
+    return connected_ && session && session->is_writable();
+}
+
+bool NamedPipeClient::wait_writable(std::chrono::milliseconds timeout) {
+    auto session = current_session();
+    return connected_ && session && session->wait_writable(timeout);
+}
+
 void NamedPipeClient::set_connection_handler(NamedPipeClient::ConnectionHandler handler) {
     connection_handler_ = handler;
 }
 
+void NamedPipeClient::set_reconnect_policy(const ReconnectPolicy &policy) {
+    reconnect_ = policy;
+}
+
+ConnectionStats NamedPipeClient::stats() const {
+    ConnectionStats stats;
+    stats.state = state_;
+    stats.connect_attempts = connect_attempts_;
+    stats.connect_failures = connect_failures_;
+    stats.connects = connects_;
+    stats.disconnects = disconnects_;
+    stats.last_recovery_time = std::chrono::milliseconds(last_recovery_ms_);
+    return stats;
+}
+
 void NamedPipeClient::close() {
-    if (!connected_) return;
+    // Deliberate: no reconnect after this
+    wanted_ = false;
+    asio::dispatch(strand_, [self = shared_from_this()]() {
+        self->stop_connecting();
+    });
+    if (!connected_.exchange(false)) return;
 
-    connected_ = false;
-    if (pipe_) {
-        pipe_->close();
-        pipe_.reset();
+    state_ = ConnectionState::disconnected;
+    ++disconnects_;
+    if (auto session = current_session()) {
+        session->close();
     }
 
     // 通知断开连接
@@ -115,57 +362,28 @@ void NamedPipeClient::close() {
     }
 }
 
-bool NamedPipeClient::is_connected() const {
-    return connected_;
-}
-
-void NamedPipeClient::start_read() {
-    if (!connected_ || !pipe_) return;
-
-    auto self = shared_from_this();
-    pipe_->async_read_some(asio::buffer(buffer_),
-                           [this, self](const boost::system::error_code &ec, std::size_t bytes_transferred) {
-                               handle_read(ec, bytes_transferred);
-                           });
+std::shared_ptr<PipeSession> NamedPipeClient::current_session() const {
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    return session_;
 }
 
-void NamedPipeClient::handle_read(const boost::system::error_code &ec, std::size_t bytes_transferred) {
-    if (!ec) {
-        // 处理接收到的消息
-        std::string message(buffer_.data(), bytes_transferred);
-
-        // 调用消息处理回调
-        if (message_handler_) {
-            message_handler_(message);
-        }
-
-        // 继续读取
-        start_read();
-    } else {
-        // 连接断开或错误
-        close();
-    }
+bool NamedPipeClient::is_connected() const {
+    return connected_;
 }
 
-void NamedPipeClient::do_write() {
-    if (write_queue_.empty() || !connected_ || !pipe_) {
-        return;
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+bool NamedPipeClient::attach_shm(const std::string &attach_request) {
+    auto session = current_session();
+    if (!connected_ || !session) return false;
+
+    try {
+        auto request = SharedBuffer(BufferPool::shared().copy(encode_frame(attach_request, frame_mode_)));
+        auto channel = ShmChannel::connect(session->executor(), server_name_, request);
+        session->attach_shm(std::move(channel));
+        return true;
+    } catch (const std::exception &e) {
+        std::cerr << "共享内存通道连接失败: " << e.what() << std::endl;
+        return false;
     }
-
-    auto self = shared_from_this();
-    asio::async_write(*pipe_, asio::buffer(write_queue_.front()),
-                      asio::bind_executor(strand_, [this, self](const boost::system::error_code &ec,
-                                                                std::size_t /*bytes_transferred*/) {
-                          if (!ec) {
-                              write_queue_.pop_front();
-
-                              if (!write_queue_.empty()) {
-                                  do_write();
-                              }
-                          } else {
-                              // 写入错误，连接可能已断开
-                              close();
-                          }
-                      }));
 }
-
+#endif
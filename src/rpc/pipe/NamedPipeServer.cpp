@@ -1,29 +1,64 @@
 #include "sauri/rpc/pipe/named_pipe_server.h"
 
-NamedPipeServer::NamedPipeServer(boost::asio::io_context &io_context, const std::string &pipe_name)
+#include <algorithm>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+namespace {
+    // Wait before accepting again after a failed accept, doubling while the failures go on
+    constexpr auto kMinAcceptRetry = std::chrono::milliseconds(10);
+    constexpr auto kMaxAcceptRetry = std::chrono::milliseconds(1000);
+
+    // Errors that just mean the client went away
+    bool is_disconnect_error(const boost::system::error_code &ec) {
+        return ec == boost::asio::error::eof ||
+               ec == boost::asio::error::connection_reset ||
+               ec == boost::asio::error::connection_aborted ||
+               ec == boost::asio::error::broken_pipe ||
+               ec == boost::asio::error::bad_descriptor ||
+               ec == boost::asio::error::operation_aborted
+#if defined(_WIN32)
+               // Pipe-specific codes for a client that closed its end
+               || (ec.category() == boost::system::system_category() &&
+                   (ec.value() == ERROR_NO_DATA || ec.value() == ERROR_PIPE_NOT_CONNECTED))
+#endif
+                ;
+    }
+}
+
+NamedPipeServer::NamedPipeServer(boost::asio::io_context &io_context, const std::string &pipe_name,
+                                 FrameMode frame_mode)
         : io_context_(io_context),
-          pipe_name_("\\\\.\\pipe\\" + pipe_name),
+          pipe_name_(resolve_pipe_path(pipe_name)),
           strand_(io_context.get_executor()),
           pipe_(io_context),
-          timer_(io_context),
-          is_connected_(false),
+          accept_retry_timer_(io_context),
+          accept_retry_delay_(kMinAcceptRetry),
+          frame_mode_(frame_mode),
+          max_sessions_(16),
+          max_write_batch_(kDefaultMaxWriteBatch),
+          io_backend_(IoBackend::asio),
+          accepting_(false),
+          next_session_id_(0),
           is_stopped_(false) {
 
     // Default handlers
-    on_message_ = [](const std::string &message) {
-        std::cout << "Received: " << message << std::endl;
+    on_message_ = [](session_id session, const BufferSlice &message) {
+        std::cout << "Received from " << session << ": " << message.view() << std::endl;
     };
 
     on_error_ = [](const boost::system::error_code &ec) {
         std::cerr << "Error: " << ec.message() << std::endl;
     };
 
-    on_connect_ = []() {
-        std::cout << "Client connected" << std::endl;
+    on_connect_ = [](session_id session) {
+        std::cout << "Client " << session << " connected" << std::endl;
     };
 
-    on_disconnect_ = []() {
-        std::cout << "Client disconnected" << std::endl;
+    on_disconnect_ = [](session_id session) {
+        std::cout << "Client " << session << " disconnected" << std::endl;
     };
 }
 
@@ -35,6 +70,43 @@ void NamedPipeServer::set_message_handler(message_handler handler) {
     on_message_ = handler;
 }
 
+void NamedPipeServer::set_frame_mode(FrameMode mode) {
+    frame_mode_ = mode;
+}
+
+void NamedPipeServer::set_max_sessions(std::size_t max_sessions) {
+    max_sessions_ = std::max<std::size_t>(max_sessions, 1);
+}
+
+void NamedPipeServer::set_max_write_batch(std::size_t bytes) {
+    max_write_batch_ = bytes;
+}
+
+void NamedPipeServer::set_write_queue_limits(const WriteQueueLimits &limits) {
+    write_queue_limits_ = limits;
+}
+
+void NamedPipeServer::set_writable_handler(writable_handler handler) {
+    on_writable_ = handler;
+}
+
+void NamedPipeServer::set_attachment_handler(attachment_handler handler) {
+    on_attachment_ = handler;
+}
+
+void NamedPipeServer::set_chunk_handler(chunk_handler handler, std::size_t threshold) {
+    on_chunk_ = handler;
+    stream_threshold_ = threshold;
+}
+
+void NamedPipeServer::set_heartbeat(const HeartbeatOptions &options) {
+    heartbeat_ = options;
+}
+
+void NamedPipeServer::set_io_backend(IoBackend backend) {
+    io_backend_ = backend;
+}
+
 void NamedPipeServer::set_error_handler(error_handler handler) {
     on_error_ = handler;
 }
@@ -52,15 +124,26 @@ void NamedPipeServer::start() {
         return;
     }
 
+#if defined(SAURI_HAS_IO_URING)
+    if (io_backend_ == IoBackend::io_uring && !uring_) {
+        uring_ = UringService::create(io_context_);
+    }
+    bool uring_ready = uring_ != nullptr;
+#else
+    bool uring_ready = false;
+#endif
+    if (io_backend_ == IoBackend::io_uring && !uring_ready) {
+        std::cerr << "io_uring backend is not available, using asio" << std::endl;
+        io_backend_ = IoBackend::asio;
+    }
+
     try {
         // Create a named pipe
         create_pipe();
 
         // Wait for a client to connect
+        accepting_ = true;
         wait_for_connection();
-
-        // Start the connection check timer
-        start_client_check_timer();
     }
     catch (const std::exception &e) {
         std::cerr << "Exception in start: " << e.what() << std::endl;
@@ -73,40 +156,159 @@ void NamedPipeServer::stop() {
         return;
     }
 
-    // Cancel the timer
-    timer_.cancel();
-
-    // Close the pipe if it's open
+    // Close the pipe instance waiting for a client
     close_pipe();
+
+#if !defined(_WIN32)
+    accept_retry_timer_.cancel();
+    // Stop listening and remove the socket file
+    if (acceptor_) {
+        boost::system::error_code ec;
+        acceptor_->close(ec);
+        acceptor_.reset();
+        ::unlink(pipe_name_.c_str());
+    }
+#endif
+
+    // Close every client session
+    for (auto &session: snapshot_sessions()) {
+        session->close();
+    }
 }
 
-void NamedPipeServer::write(const std::string &message) {
-    if (is_stopped_ || !is_connected_) {
+bool NamedPipeServer::write(session_id session, std::string_view message, OverflowPolicy policy) {
+    if (is_stopped_) {
+        return false;
+    }
+
+    auto target = find_session(session);
+    if (!target) {
+        return false;
+    }
+    return target->write(message, policy);
+}
+
+bool NamedPipeServer::write(session_id session, SharedBuffer frame, OverflowPolicy policy) {
+    if (is_stopped_) {
+        return false;
+    }
+
+    auto target = find_session(session);
+    if (!target) {
+        return false;
+    }
+    return target->write(std::move(frame), policy);
+}
+
+bool NamedPipeServer::write(session_id session, std::vector<SharedBuffer> frames, OverflowPolicy policy) {
+    if (is_stopped_) {
+        return false;
+    }
+
+    auto target = find_session(session);
+    if (!target) {
+        return false;
+    }
+    return target->write(std::move(frames), policy);
+}
+
+void NamedPipeServer::broadcast(std::string_view message, OverflowPolicy policy) {
+    if (is_stopped_) {
         return;
     }
 
-    boost::asio::post(strand_, [this, message]() {
-        bool write_in_progress = !write_queue_.empty();
-        write_queue_.push_back(message);
+    // Frame once, share the buffer between sessions
+    auto frame = BufferPool::shared().acquire(message.size() + kFrameHeaderSize + 1);
+    auto start = begin_frame(*frame, frame_mode_);
+    frame->append(message);
+    end_frame(*frame, start, frame_mode_);
+    broadcast(SharedBuffer(std::move(frame)), policy);
+}
 
-        if (!write_in_progress) {
-            do_write();
-        }
-    });
+void NamedPipeServer::broadcast(SharedBuffer frame, OverflowPolicy policy) {
+    if (is_stopped_) {
+        return;
+    }
+
+    for (auto &session: snapshot_sessions()) {
+        session->write(frame, policy);
+    }
+}
+
+void NamedPipeServer::write(const std::string &message) {
+    broadcast(message);
 }
 
 bool NamedPipeServer::is_connected() const {
-    return is_connected_ && !is_stopped_;
+    return !is_stopped_ && session_count() > 0;
+}
+
+std::size_t NamedPipeServer::session_count() const {
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    return sessions_.size();
+}
+
+std::vector<session_id> NamedPipeServer::session_ids() const {
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    std::vector<session_id> ids;
+    ids.reserve(sessions_.size());
+    for (const auto &entry: sessions_) {
+        ids.push_back(entry.first);
+    }
+    return ids;
+}
+
+bool NamedPipeServer::is_writable(session_id session) const {
+    auto target = find_session(session);
+    return target && target->is_open() && target->is_writable();
+}
+
+bool NamedPipeServer::set_compression(session_id session, const CompressionOptions &options) {
+    auto target = find_session(session);
+    return target && target->set_compression(options);
+}
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+
+std::shared_ptr<ShmChannel> NamedPipeServer::create_shm_channel(session_id session, std::size_t ring_size) {
+    auto target = find_session(session);
+    if (!target) {
+        return nullptr;
+    }
+    return ShmChannel::create(target->executor(), ring_size);
+}
+
+bool NamedPipeServer::attach_shm(session_id session, std::shared_ptr<ShmChannel> channel) {
+    auto target = find_session(session);
+    if (!target || !channel) {
+        return false;
+    }
+    target->attach_shm(std::move(channel));
+    return true;
+}
+
+bool NamedPipeServer::send_fds(session_id session, std::vector<int> fds) {
+    auto target = find_session(session);
+    if (!target) {
+        return false;
+    }
+    target->send_fds(std::move(fds));
+    return true;
 }
 
+#endif
+
+#if defined(_WIN32)
+
 void NamedPipeServer::create_pipe() {
-    // Create the named pipe
+    // Create one more instance of the named pipe
     HANDLE pipe_handle = CreateNamedPipeA(
             pipe_name_.c_str(),
             PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
-            1,  // Only one instance since we're handling only one client
-            4096, 4096, 0, nullptr);
+            // Byte mode: message boundaries come from the frame layer
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+            static_cast<DWORD>(std::min<std::size_t>(max_sessions_, PIPE_UNLIMITED_INSTANCES)),
+            64 * 1024, 64 * 1024, 0, nullptr);
 
     if (pipe_handle == INVALID_HANDLE_VALUE) {
         throw std::runtime_error("CreateNamedPipe failed: " + std::to_string(GetLastError()));
@@ -136,10 +338,9 @@ void NamedPipeServer::wait_for_connection() {
         CloseHandle(overlapped->hEvent);
         delete overlapped;
 
-        // Client is connected
-        is_connected_ = true;
-        on_connect_();
-        start_read();
+        // Hand the connected instance to a session and wait for the next client
+        add_session(std::move(pipe_));
+        accept_next();
     } else if (lastError == ERROR_IO_PENDING) {
         // Connection is pending - create an object_handle to wait for the event
         auto event_handle = std::make_shared<boost::asio::windows::object_handle>(
@@ -148,11 +349,17 @@ void NamedPipeServer::wait_for_connection() {
         // Capture the overlapped pointer for proper cleanup
         event_handle->async_wait(
                 boost::asio::bind_executor(strand_,
-                                           [this, event_handle, overlapped](const boost::system::error_code &ec) {
+                                           [this, weak = weak_from_this(), event_handle, overlapped](
+                                                   const boost::system::error_code &ec) {
                                                // Clean up the event and overlapped structure
                                                CloseHandle(overlapped->hEvent);
                                                delete overlapped;
 
+                                               auto self = weak.lock();
+                                               if (!self) {
+                                                   return;
+                                               }
+
                                                if (ec || is_stopped_) {
                                                    close_pipe();
                                                    if (!is_stopped_) {
@@ -168,9 +375,8 @@ void NamedPipeServer::wait_for_connection() {
                                                }
 
                                                // Client is now connected
-                                               is_connected_ = true;
-                                               on_connect_();
-                                               start_read();
+                                               add_session(std::move(pipe_));
+                                               accept_next();
                                            }
                 )
         );
@@ -192,155 +398,176 @@ void NamedPipeServer::wait_for_connection() {
     }
 }
 
-void NamedPipeServer::close_pipe() {
-    if (pipe_.is_open()) {
-        boost::system::error_code ec;
-        pipe_.close(ec);
-    }
+#else
 
-    if (is_connected_) {
-        is_connected_ = false;
-        on_disconnect_();
-    }
-}
-
-void NamedPipeServer::start_read() {
-    if (is_stopped_ || !is_connected_) {
+void NamedPipeServer::create_pipe() {
+    if (acceptor_) {
+        // Listening socket outlives individual connections
         return;
     }
 
-    buffer_.resize(4096);
+    // Remove a stale socket file left behind by a previous run
+    ::unlink(pipe_name_.c_str());
 
-    pipe_.async_read_some(
-            boost::asio::buffer(buffer_),
-            boost::asio::bind_executor(strand_,
-                                       [this](const boost::system::error_code &ec, std::size_t bytes_transferred) {
-                                           if (!ec) {
-                                               if (bytes_transferred > 0) {
-                                                   // Process received payload
-                                                   std::string received_data(buffer_.begin(),
-                                                                             buffer_.begin() + bytes_transferred);
-
-                                                   // Call the message handler
-                                                   on_message_(received_data);
-                                               }
-
-                                               // Continue reading
-                                               start_read();
-                                           } else {
-                                               handle_error(ec);
-                                           }
-                                       }
-            )
-    );
-}
-
-void NamedPipeServer::do_write() {
-    if (is_stopped_ || !is_connected_ || write_queue_.empty()) {
-        return;
+    auto acceptor = std::make_unique<pipe_acceptor>(io_context_);
+    boost::system::error_code ec;
+    acceptor->open(pipe_endpoint(pipe_name_).protocol(), ec);
+    if (!ec) acceptor->bind(pipe_endpoint(pipe_name_), ec);
+    if (!ec) acceptor->listen(boost::asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+        throw std::runtime_error("Listen on " + pipe_name_ + " failed: " + ec.message());
     }
+    acceptor_ = std::move(acceptor);
+}
 
-    boost::asio::async_write(
+void NamedPipeServer::wait_for_connection() {
+    acceptor_->async_accept(
             pipe_,
-            boost::asio::buffer(write_queue_.front()),
-            boost::asio::bind_executor(strand_,
-                                       [this](const boost::system::error_code &ec, std::size_t /*bytes_transferred*/) {
-                                           if (!ec) {
-                                               write_queue_.pop_front();
-
-                                               if (!write_queue_.empty()) {
-                                                   do_write();
-                                               }
-                                           } else {
-                                               handle_error(ec);
-                                           }
-                                       }
-            )
+            boost::asio::bind_executor(strand_, [this, weak = weak_from_this()](const boost::system::error_code &ec) {
+                auto self = weak.lock();
+                if (!self) {
+                    return;
+                }
+                if (ec || is_stopped_) {
+                    close_pipe();
+                    if (!is_stopped_ && ec != boost::asio::error::operation_aborted) {
+                        retry_accept(ec);
+                    }
+                    return;
+                }
+
+                // Hand the socket to a session and wait for the next client
+                accept_retry_delay_ = kMinAcceptRetry;
+                add_session(std::move(pipe_));
+                accept_next();
+            })
     );
 }
 
-void NamedPipeServer::handle_error(const boost::system::error_code &ec) {
-    // Check for client disconnect
-    if (ec == boost::asio::error::eof ||
-        ec == boost::asio::error::connection_reset ||
-        ec == boost::asio::error::connection_aborted ||
-        ec == boost::asio::error::broken_pipe ||
-        ec == boost::asio::error::bad_descriptor) {
-
-        close_pipe();
-
-        // If not stopped, try to restart the server
-        if (!is_stopped_) {
-            try {
-                create_pipe();
+void NamedPipeServer::retry_accept(const boost::system::error_code &ec) {
+    // Errors such as EMFILE persist, so accepting again at once would spin the io thread
+    on_error_(ec);
+    accept_retry_timer_.expires_after(accept_retry_delay_);
+    accept_retry_delay_ = std::min<std::chrono::milliseconds>(accept_retry_delay_ * 2, kMaxAcceptRetry);
+    accept_retry_timer_.async_wait(
+            boost::asio::bind_executor(strand_, [this, weak = weak_from_this()](const boost::system::error_code &ec) {
+                auto self = weak.lock();
+                if (!self || ec || is_stopped_ || !acceptor_) {
+                    return;
+                }
                 wait_for_connection();
-            }
-            catch (const std::exception &e) {
-                std::cerr << "Error restarting server: " << e.what() << std::endl;
-            }
-        }
-    } else {
-        // Other errors
-        on_error_(ec);
-    }
+            })
+    );
 }
 
-void NamedPipeServer::start_client_check_timer() {
-    if (is_stopped_) return;
+#endif
 
-    // Schedule the timer
-    timer_.expires_after(std::chrono::seconds(5));
-    timer_.async_wait([this](const boost::system::error_code &ec) {
-        if (!ec && !is_stopped_) {
-            check_client_connection();
-            // Reschedule the timer
-            start_client_check_timer();
-        }
-    });
-}
+void NamedPipeServer::accept_next() {
+    if (is_stopped_) {
+        return;
+    }
 
-void NamedPipeServer::check_client_connection() {
-    if (!is_connected_ || is_stopped_) {
+    // At capacity: resume from remove_session() once a client leaves
+    if (session_count() >= max_sessions_) {
+        accepting_ = false;
         return;
     }
 
-    // Check if client is still connected
-    if (!check_pipe_connected()) {
-        close_pipe();
+    accepting_ = true;
+    try {
+        create_pipe();
+        wait_for_connection();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error restarting connection: " << e.what() << std::endl;
+    }
+}
+
+void NamedPipeServer::close_pipe() {
+    if (pipe_.is_open()) {
+        boost::system::error_code ec;
+        pipe_.close(ec);
+    }
+}
 
-        // Try to restart the server
+void NamedPipeServer::add_session(pipe_stream stream) {
+    auto session = std::make_shared<PipeSession>(++next_session_id_, std::move(stream), frame_mode_);
+    session->set_max_write_batch(max_write_batch_);
+    session->set_write_queue_limits(write_queue_limits_);
+    session->set_heartbeat(heartbeat_);
+#if defined(SAURI_HAS_IO_URING)
+    if (uring_) {
         try {
-            create_pipe();
-            wait_for_connection();
-        }
-        catch (const std::exception &e) {
-            std::cerr << "Error restarting server: " << e.what() << std::endl;
+            session->use_uring(uring_);
+        } catch (const std::exception &e) {
+            // This session stays on the asio backend
+            std::cerr << "io_uring setup for session " << session->id() << " failed: " << e.what() << std::endl;
         }
     }
+#endif
+    if (on_writable_) {
+        session->set_writable_handler(on_writable_);
+    }
+    if (on_attachment_) {
+        session->set_attachment_handler(on_attachment_);
+    }
+    if (on_chunk_ && stream_threshold_ > 0) {
+        session->set_chunk_handler(on_chunk_, stream_threshold_);
+    }
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        sessions_.emplace(session->id(), session);
+    }
+
+    on_connect_(session->id());
+    // Sessions can outlive the server: their callbacks only hold it weakly
+    session->start(
+            [weak = weak_from_this()](session_id id, const BufferSlice &frame) {
+                if (auto self = weak.lock()) {
+                    self->on_message_(id, frame);
+                }
+            },
+            [weak = weak_from_this()](session_id id, const boost::system::error_code &ec) {
+                if (auto self = weak.lock()) {
+                    self->remove_session(id, ec);
+                }
+            });
 }
 
-bool NamedPipeServer::check_pipe_connected() {
-    if (!pipe_.is_open()) {
-        return false;
+void NamedPipeServer::remove_session(session_id id, const boost::system::error_code &ec) {
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        if (sessions_.erase(id) == 0) {
+            return;
+        }
     }
 
-    // Peek at the pipe to see if it's still connected
-    DWORD bytes_available = 0;
-    BOOL result = PeekNamedPipe(
-            pipe_.native_handle(),
-            nullptr,
-            0,
-            nullptr,
-            &bytes_available,
-            nullptr
-    );
-
-    if (!result) {
-        DWORD last_error = GetLastError();
-        // ERROR_BROKEN_PIPE or ERROR_BAD_PIPE indicates the client has disconnected
-        return !(last_error == ERROR_BROKEN_PIPE || last_error == ERROR_BAD_PIPE ||
-                 last_error == ERROR_PIPE_NOT_CONNECTED || last_error == ERROR_NO_DATA);
+    if (ec && !is_disconnect_error(ec)) {
+        on_error_(ec);
     }
+    on_disconnect_(id);
 
-    return true;
+    // A slot is free again
+    boost::asio::post(strand_, [weak = weak_from_this()]() {
+        auto self = weak.lock();
+        if (self && !self->accepting_) {
+            self->accept_next();
+        }
+    });
+}
+
+std::shared_ptr<PipeSession> NamedPipeServer::find_session(session_id id) const {
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    auto it = sessions_.find(id);
+    return it == sessions_.end() ? nullptr : it->second;
+}
+
+std::vector<std::shared_ptr<PipeSession>> NamedPipeServer::snapshot_sessions() const {
+    std::vector<std::shared_ptr<PipeSession>> sessions;
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    sessions.reserve(sessions_.size());
+    for (auto &[id, session]: sessions_) {
+        sessions.push_back(session);
+    }
+    return sessions;
 }
@@ -0,0 +1,556 @@
+//
+// Created by Right on 25/6/5 14:20.
+//
+
+#include "sauri/rpc/pipe/pipe_session.h"
+
+#include <cstring>
+#include <iostream>
+
+PipeSession::PipeSession(session_id id, pipe_stream stream, FrameMode frame_mode)
+        : id_(id),
+          stream_(std::move(stream)),
+          strand_(stream_.get_executor()),
+          frame_mode_(frame_mode),
+          decoder_(frame_mode),
+          heartbeat_timer_(strand_) {
+}
+
+void PipeSession::start(frame_handler on_frame, close_handler on_close) {
+    on_frame_ = std::move(on_frame);
+    on_close_ = std::move(on_close);
+    open_ = true;
+
+    boost::asio::dispatch(strand_, [self = shared_from_this()]() {
+        self->last_read_ = self->last_write_ = std::chrono::steady_clock::now();
+        self->update_accepted_flags();
+        self->start_read();
+        self->start_heartbeat();
+    });
+}
+
+bool PipeSession::write(std::string_view message, OverflowPolicy policy) {
+    if (!open_) {
+        return false;
+    }
+
+    auto frame = BufferPool::shared().acquire(message.size() + kFrameHeaderSize + 1);
+    auto start = begin_frame(*frame, frame_mode_);
+    frame->append(message);
+    end_frame(*frame, start, frame_mode_);
+    return write(SharedBuffer(std::move(frame)), policy);
+}
+
+bool PipeSession::write(SharedBuffer frame, OverflowPolicy policy) {
+    if (!open_ || !frame) {
+        return false;
+    }
+
+    if (!admit(frame->size(), 1, policy)) {
+        return false;
+    }
+
+    boost::asio::post(strand_, [self = shared_from_this(), frame = std::move(frame), policy]() mutable {
+        self->last_write_ = std::chrono::steady_clock::now();
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+        if (self->shm_) {
+            auto payload = frame_payload(*frame, self->frame_mode_);
+            auto size = frame->size();
+            // Not moved: a message the ring cannot take goes over the stream below
+            auto result = self->shm_->write(frame, payload);
+            if (result == ShmChannel::WriteResult::written) {
+                self->release(1, size);
+                return;
+            }
+            if (result == ShmChannel::WriteResult::queued) {
+                // Released by the drain handler once it is in the ring
+                return;
+            }
+        }
+#endif
+        self->enqueue(std::move(frame));
+        if (policy == OverflowPolicy::drop_oldest && self->above_high_watermark(0, 0)) {
+            self->drop_oldest();
+        }
+
+        if (!self->write_in_progress_) {
+            self->do_write();
+        }
+    });
+    return true;
+}
+
+bool PipeSession::write(std::vector<SharedBuffer> frames, OverflowPolicy policy) {
+    if (!open_ || frames.empty()) {
+        return false;
+    }
+
+    std::size_t size = 0;
+    for (const auto &frame: frames) {
+        if (!frame) {
+            return false;
+        }
+        size += frame->size();
+    }
+    if (!admit(size, frames.size(), policy)) {
+        return false;
+    }
+
+    boost::asio::post(strand_, [self = shared_from_this(), frames = std::move(frames), policy]() mutable {
+        self->last_write_ = std::chrono::steady_clock::now();
+        for (auto &frame: frames) {
+            self->enqueue(std::move(frame));
+        }
+        if (policy == OverflowPolicy::drop_oldest && self->above_high_watermark(0, 0)) {
+            self->drop_oldest();
+        }
+
+        if (!self->write_in_progress_) {
+            self->do_write();
+        }
+    });
+    return true;
+}
+
+bool PipeSession::admit(std::size_t bytes, std::size_t count, OverflowPolicy policy) {
+    if (above_high_watermark(bytes, count)) {
+        full_ = true;
+        // The strand may have drained the queue between the check and the store
+        if (below_low_watermark()) {
+            mark_writable();
+        } else if (policy == OverflowPolicy::drop_newest) {
+            ++dropped_count_;
+            return false;
+        } else if (policy == OverflowPolicy::block && !on_io_thread()) {
+            std::unique_lock<std::mutex> lock(writable_mutex_);
+            writable_cv_.wait(lock, [this] { return !full_ || !open_; });
+            if (!open_) {
+                return false;
+            }
+        }
+    }
+
+    // Count the message before it reaches the strand so a burst of producers sees it
+    queued_bytes_ += bytes;
+    queued_count_ += count;
+    return true;
+}
+
+void PipeSession::enqueue(SharedBuffer frame) {
+    // On the strand, so the connection's contexts are never shared between threads. Frames that
+    // already carry flags, such as attachments, are sent as they are.
+    if (compressor_ && compress_outgoing_ && frame_flags(*frame, frame_mode_) == 0) {
+        auto size = frame->size();
+        if (auto compressed = compressor_->compress(frame_payload(*frame, frame_mode_))) {
+            frame = std::move(compressed);
+            release(0, size - frame->size());
+        }
+    }
+    write_queue_.push_back(std::move(frame));
+}
+
+void PipeSession::set_chunk_handler(chunk_handler handler, std::size_t threshold) {
+    on_chunk_ = std::move(handler);
+    decoder_.set_stream_threshold(on_chunk_ ? threshold : 0);
+}
+
+void PipeSession::update_accepted_flags() {
+    if (frame_mode_ != FrameMode::length_prefixed) {
+        return;
+    }
+    decoder_.set_accepted_flags((compressor_ ? kFrameCompressed : 0) | (on_attachment_ ? kFrameAttachment : 0));
+}
+
+bool PipeSession::set_compression(const CompressionOptions &options) {
+    if (frame_mode_ != FrameMode::length_prefixed || !compression_supported(options.algorithm)) {
+        return false;
+    }
+
+    // Compressed frames do not name their algorithm, so a frame the peer sent before it saw a
+    // switch could not be told apart: the first algorithm stays for the life of the session
+    std::unique_ptr<FrameCompressor> compressor;
+    if (options.algorithm != Compression::none) {
+        auto expected = Compression::none;
+        if (!compression_.compare_exchange_strong(expected, options.algorithm) &&
+            expected != options.algorithm) {
+            return false;
+        }
+        compressor = std::make_unique<FrameCompressor>(options);
+    }
+    // Posted, not dispatched: writes already on their way to the strand go out as they were
+    boost::asio::post(strand_, [self = shared_from_this(), compressor = std::move(compressor)]() mutable {
+        // Turning compression off stops compressing our frames only; the peer's compressed
+        // frames still in flight are decoded with the compressor kept here
+        self->compress_outgoing_ = compressor != nullptr;
+        if (compressor) {
+            self->compressor_ = std::move(compressor);
+        }
+        self->update_accepted_flags();
+    });
+    return true;
+}
+
+bool PipeSession::wait_writable(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(writable_mutex_);
+    return writable_cv_.wait_for(lock, timeout, [this] { return !full_ || !open_; }) && open_;
+}
+
+void PipeSession::close() {
+    // Producers blocked on a full queue are woken here rather than on the strand, which may
+    // never run again once the owner is shutting down
+    open_ = false;
+    wake_blocked_writers();
+    boost::asio::dispatch(strand_, [self = shared_from_this()]() {
+        self->close(boost::asio::error::operation_aborted);
+    });
+}
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+void PipeSession::attach_shm(std::shared_ptr<ShmChannel> channel) {
+    boost::asio::dispatch(strand_, [self = shared_from_this(), channel = std::move(channel)]() {
+        if (!self->open_) {
+            channel->close();
+            return;
+        }
+
+        self->shm_ = channel;
+        channel->set_drain_handler([weak = std::weak_ptr<PipeSession>(self)](std::size_t count, std::size_t bytes) {
+            if (auto session = weak.lock()) {
+                session->release(count, bytes);
+            }
+        });
+        channel->start([weak = std::weak_ptr<PipeSession>(self)](const BufferSlice &frame) {
+            auto session = weak.lock();
+            if (!session || !session->open_) {
+                return;
+            }
+            session->last_read_ = std::chrono::steady_clock::now();
+            if (session->on_frame_ && !frame.empty()) {
+                session->on_frame_(session->id_, frame);
+            }
+        });
+    });
+}
+
+void PipeSession::send_fds(std::vector<int> fds) {
+    boost::asio::post(strand_, [self = shared_from_this(), fds = std::move(fds)]() {
+        if (!self->open_) {
+            return;
+        }
+        // Control messages bypass the write queue, so only send once it has drained
+        if (self->write_in_progress_) {
+            self->send_fds(fds);
+            return;
+        }
+        if (!::send_fds(self->stream_.native_handle(), fds)) {
+            std::cerr << "Failed to pass descriptors on session " << self->id_ << std::endl;
+            self->close(boost::asio::error::broken_pipe);
+        }
+    });
+}
+#endif
+
+void PipeSession::start_read() {
+    if (!open_) {
+        return;
+    }
+#if defined(SAURI_HAS_IO_URING)
+    if (uring_) {
+        start_uring_read();
+        return;
+    }
+#endif
+
+    stream_.async_read_some(
+            decoder_.prepare(),
+            boost::asio::bind_executor(strand_, [self = shared_from_this()](const boost::system::error_code &ec,
+                                                                           std::size_t bytes_transferred) {
+                if (ec) {
+                    self->close(ec);
+                    return;
+                }
+
+                if (self->on_read(bytes_transferred)) {
+                    self->start_read();
+                }
+            })
+    );
+}
+
+bool PipeSession::on_read(std::size_t bytes_transferred) {
+    last_read_ = std::chrono::steady_clock::now();
+    decoder_.commit(bytes_transferred);
+    try {
+        // One read may carry several frames, or only part of one.
+        // Empty frames are heartbeats.
+        BufferSlice frame;
+        uint32_t flags = 0;
+        FrameChunk chunk;
+        while (true) {
+            if (decoder_.next(frame, flags)) {
+                if (flags & kFrameCompressed) {
+                    frame = compressor_->decompress(frame.view(), decoder_.max_frame_size());
+                }
+                if (flags & kFrameAttachment) {
+                    on_attachment_(id_, frame);
+                } else if (!frame.empty()) {
+                    on_frame_(id_, frame);
+                }
+            } else if (decoder_.next_chunk(chunk)) {
+                on_chunk_(id_, chunk);
+            } else {
+                break;
+            }
+        }
+    } catch (const std::exception &e) {
+        // The stream is out of sync and cannot be recovered
+        std::cerr << "Framing error on session " << id_ << ": " << e.what() << std::endl;
+        close(boost::asio::error::connection_aborted);
+        return false;
+    }
+    return open_;
+}
+
+#if defined(SAURI_HAS_IO_URING)
+void PipeSession::use_uring(std::shared_ptr<UringService> uring) {
+    uring_buffers_ = uring->create_buffer_group();
+    uring_ = std::move(uring);
+}
+
+void PipeSession::start_uring_read() {
+    // Armed once; completions keep coming until the peer closes or the buffers run out
+    uring_receive_ = uring_->receive(
+            stream_.native_handle(), uring_buffers_,
+            [weak = weak_from_this()](const boost::system::error_code &ec, std::size_t bytes, uint16_t buffer,
+                                      bool more) {
+                auto self = weak.lock();
+                if (!self) {
+                    return;
+                }
+                boost::asio::post(self->strand_, [self, ec, bytes, buffer, more]() {
+                    if (bytes > 0) {
+                        // The kernel picked the buffer; copy into the decoder and give it back
+                        auto region = self->decoder_.prepare(bytes);
+                        std::memcpy(region.data(), self->uring_buffers_->data(buffer), bytes);
+                        self->uring_buffers_->recycle(buffer);
+                        if (!self->on_read(bytes)) {
+                            return;
+                        }
+                    }
+                    if (ec && ec != boost::asio::error::no_buffer_space) {
+                        self->close(ec);
+                    } else if (!more) {
+                        // Out of buffers: every one has been recycled by now, so re-arm
+                        self->start_read();
+                    }
+                });
+            });
+    if (uring_receive_ == 0) {
+        close(boost::asio::error::operation_aborted);
+    }
+}
+#endif
+
+void PipeSession::do_write() {
+    if (!open_ || write_queue_.empty()) {
+        write_in_progress_ = false;
+        return;
+    }
+
+    // Drain as much of the queue as fits in one batch
+    write_buffers_.clear();
+    std::size_t batch_bytes = 0;
+    for (const auto &frame: write_queue_) {
+        if (!write_buffers_.empty() &&
+            (batch_bytes + frame->size() > max_write_batch_ || write_buffers_.size() >= kMaxWriteBatchBuffers)) {
+            break;
+        }
+        write_buffers_.emplace_back(boost::asio::buffer(*frame));
+        batch_bytes += frame->size();
+    }
+    write_batch_count_ = write_buffers_.size();
+    write_in_progress_ = true;
+
+    auto on_written = boost::asio::bind_executor(
+            strand_, [self = shared_from_this()](const boost::system::error_code &ec,
+                                                 std::size_t /*bytes_transferred*/) {
+                if (ec) {
+                    self->write_in_progress_ = false;
+                    self->close(ec);
+                    return;
+                }
+
+                std::size_t bytes = 0;
+                for (std::size_t i = 0; i < self->write_batch_count_; ++i) {
+                    bytes += self->write_queue_.front()->size();
+                    self->write_queue_.pop_front();
+                }
+                self->release(self->write_batch_count_, bytes);
+                self->do_write();
+            });
+
+#if defined(SAURI_HAS_IO_URING)
+    if (uring_) {
+        // The frames stay in write_queue_, and the handler keeps the session alive, until it runs
+        uring_send_ = uring_->send(
+                stream_.native_handle(), write_buffers_,
+                [self = shared_from_this(), on_written = std::move(on_written)](const boost::system::error_code &ec,
+                                                                              std::size_t bytes) mutable {
+                    boost::asio::post(self->strand_, [on_written = std::move(on_written), ec, bytes]() mutable {
+                        on_written(ec, bytes);
+                    });
+                });
+        if (uring_send_ == 0) {
+            write_in_progress_ = false;
+            close(boost::asio::error::operation_aborted);
+        }
+        return;
+    }
+#endif
+#if defined(_WIN32)
+    if (write_batch_count_ > 1) {
+        write_staging_.clear();
+        write_staging_.reserve(batch_bytes);
+        for (const auto &buffer: write_buffers_) {
+            write_staging_.append(static_cast<const char *>(buffer.data()), buffer.size());
+        }
+        boost::asio::async_write(stream_, boost::asio::buffer(write_staging_), std::move(on_written));
+        return;
+    }
+#endif
+    boost::asio::async_write(stream_, write_buffers_, std::move(on_written));
+}
+
+void PipeSession::start_heartbeat() {
+    auto period = heartbeat_.interval.count() > 0 ? heartbeat_.interval : heartbeat_.timeout;
+    if (!open_ || period.count() <= 0) {
+        return;
+    }
+
+    heartbeat_timer_.expires_after(period);
+    heartbeat_timer_.async_wait(
+            boost::asio::bind_executor(strand_, [self = shared_from_this()](const boost::system::error_code &ec) {
+                if (ec || !self->open_) {
+                    return;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                if (self->heartbeat_.timeout.count() > 0 && now - self->last_read_ >= self->heartbeat_.timeout) {
+                    // Half-open: the stream is up but the peer stopped talking
+                    self->close(boost::asio::error::timed_out);
+                    return;
+                }
+                if (self->heartbeat_.interval.count() > 0 && now - self->last_write_ >= self->heartbeat_.interval) {
+                    // Not worth queueing behind a full queue, which is traffic anyway
+                    self->write(std::string_view(), OverflowPolicy::drop_newest);
+                }
+                self->start_heartbeat();
+            })
+    );
+}
+
+void PipeSession::close(const boost::system::error_code &ec) {
+    if (closed_.exchange(true)) {
+        return;
+    }
+
+    open_ = false;
+#if defined(SAURI_HAS_IO_URING)
+    // In-flight ring operations hold their own reference to the socket
+    if (uring_) {
+        uring_->cancel(uring_receive_);
+        uring_->cancel(uring_send_);
+    }
+#endif
+    boost::system::error_code ignored;
+    stream_.close(ignored);
+    heartbeat_timer_.cancel();
+    wake_blocked_writers();
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+    if (shm_) {
+        shm_->close();
+        shm_.reset();
+    }
+#endif
+
+    // Drop the handlers so owners captured in them are released
+    on_frame_ = nullptr;
+    on_writable_ = nullptr;
+    auto on_close = std::move(on_close_);
+    if (on_close) {
+        on_close(id_, ec);
+    }
+}
+
+void PipeSession::wake_blocked_writers() {
+    {
+        // Taken so a producer between its check and its wait does not miss the notify
+        std::lock_guard<std::mutex> lock(writable_mutex_);
+    }
+    writable_cv_.notify_all();
+}
+
+bool PipeSession::above_high_watermark(std::size_t incoming_bytes, std::size_t incoming_count) const {
+    std::size_t count = queued_count_;
+    if (count == 0) {
+        // A single message larger than the limit is still accepted
+        return false;
+    }
+    return queued_bytes_ + incoming_bytes > limits_.high_watermark_bytes ||
+           count + incoming_count > limits_.high_watermark_count;
+}
+
+bool PipeSession::below_low_watermark() const {
+    return queued_bytes_ <= limits_.low_watermark_bytes && queued_count_ <= limits_.low_watermark_count;
+}
+
+void PipeSession::release(std::size_t count, std::size_t bytes) {
+    queued_bytes_ -= bytes;
+    queued_count_ -= count;
+    if (full_ && below_low_watermark()) {
+        mark_writable();
+    }
+}
+
+void PipeSession::mark_writable() {
+    {
+        std::lock_guard<std::mutex> lock(writable_mutex_);
+        if (!full_) {
+            return;
+        }
+        full_ = false;
+    }
+    writable_cv_.notify_all();
+
+    boost::asio::dispatch(strand_, [self = shared_from_this()]() {
+        if (self->on_writable_) {
+            self->on_writable_(self->id_);
+        }
+    });
+}
+
+void PipeSession::drop_oldest() {
+    // Frames handed to the stream are still referenced by the in-flight write; never drop the newest
+    std::size_t first = write_in_progress_ ? write_batch_count_ : 0;
+    while (above_high_watermark(0, 0) && write_queue_.size() > first + 1) {
+        // Attachments and the message after them go together or not at all; skip over them
+        auto it = write_queue_.begin() + static_cast<std::ptrdiff_t>(first);
+        if (frame_flags(**it, frame_mode_) & kFrameAttachment) {
+            while (first < write_queue_.size() && frame_flags(*write_queue_[first], frame_mode_) & kFrameAttachment) {
+                ++first;
+            }
+            ++first;
+            continue;
+        }
+        std::size_t size = (*it)->size();
+        write_queue_.erase(it);
+        ++dropped_count_;
+        release(1, size);
+    }
+}
+
+bool PipeSession::on_io_thread() const {
+    auto executor = strand_.get_inner_executor();
+    auto io_executor = executor.target<boost::asio::io_context::executor_type>();
+    return io_executor && io_executor->running_in_this_thread();
+}
@@ -0,0 +1,253 @@
+//
+// Created by Right on 25/6/4 09:30.
+//
+
+#include "sauri/rpc/pipe/frame_codec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    void write_le32(char *out, uint32_t value) {
+        out[0] = static_cast<char>(value & 0xFF);
+        out[1] = static_cast<char>((value >> 8) & 0xFF);
+        out[2] = static_cast<char>((value >> 16) & 0xFF);
+        out[3] = static_cast<char>((value >> 24) & 0xFF);
+    }
+
+    uint32_t read_le32(const char *in) {
+        auto p = reinterpret_cast<const unsigned char *>(in);
+        return static_cast<uint32_t>(p[0]) |
+               (static_cast<uint32_t>(p[1]) << 8) |
+               (static_cast<uint32_t>(p[2]) << 16) |
+               (static_cast<uint32_t>(p[3]) << 24);
+    }
+}
+
+void append_frame(std::string &out, std::string_view payload, FrameMode mode) {
+    if (mode == FrameMode::length_prefixed) {
+        if (payload.size() > kFrameLengthMask) {
+            throw std::runtime_error("Frame payload too large: " + std::to_string(payload.size()));
+        }
+        char header[kFrameHeaderSize];
+        write_le32(header, static_cast<uint32_t>(payload.size()));
+        out.append(header, kFrameHeaderSize);
+        out.append(payload);
+    } else {
+        out.append(payload);
+        out.push_back('\n');
+    }
+}
+
+std::string encode_frame(std::string_view payload, FrameMode mode) {
+    std::string out;
+    out.reserve(payload.size() + kFrameHeaderSize);
+    append_frame(out, payload, mode);
+    return out;
+}
+
+std::size_t begin_frame(std::string &out, FrameMode mode) {
+    std::size_t start = out.size();
+    if (mode == FrameMode::length_prefixed) {
+        out.append(kFrameHeaderSize, '\0');
+    }
+    return start;
+}
+
+void end_frame(std::string &out, std::size_t frame_start, FrameMode mode, uint32_t flags) {
+    if (mode == FrameMode::length_prefixed) {
+        std::size_t length = out.size() - frame_start - kFrameHeaderSize;
+        if (length > kFrameLengthMask) {
+            throw std::runtime_error("Frame payload too large: " + std::to_string(length));
+        }
+        write_le32(out.data() + frame_start, static_cast<uint32_t>(length) | (flags & ~kFrameLengthMask));
+    } else {
+        out.push_back('\n');
+    }
+}
+
+std::string_view frame_payload(std::string_view frame, FrameMode mode) {
+    if (mode == FrameMode::length_prefixed) {
+        return frame.size() < kFrameHeaderSize ? std::string_view() : frame.substr(kFrameHeaderSize);
+    }
+    return frame.empty() || frame.back() != '\n' ? frame : frame.substr(0, frame.size() - 1);
+}
+
+uint32_t frame_flags(std::string_view frame, FrameMode mode) {
+    if (mode != FrameMode::length_prefixed || frame.size() < kFrameHeaderSize) {
+        return 0;
+    }
+    return read_le32(frame.data()) & ~kFrameLengthMask;
+}
+
+FrameDecoder::FrameDecoder(FrameMode mode, std::size_t max_frame_size)
+        : mode_(mode),
+          max_frame_size_(std::min<std::size_t>(max_frame_size, kFrameLengthMask)) {
+}
+
+boost::asio::mutable_buffer FrameDecoder::prepare(std::size_t min_size) {
+    if (!buffer_) {
+        buffer_ = BufferPool::shared().acquire(min_size);
+    }
+    if (begin_ == end_) {
+        begin_ = end_ = 0;
+        scanned_ = 0;
+    }
+
+    // Make room for the rest of a large frame so it can arrive in one read
+    std::size_t want = min_size;
+    if (pending_ > 0) {
+        want = std::max(want, kFrameHeaderSize + pending_ - buffered());
+    }
+
+    bool shared = buffer_.use_count() > 1;
+    if (shared && begin_ == 0 && end_ == 0) {
+        // Every frame was handed out but is still referenced; start over in a fresh buffer
+        buffer_ = BufferPool::shared().acquire(min_size);
+        shared = false;
+    }
+
+    if (buffer_->size() - end_ < want) {
+        std::size_t tail = end_ - begin_;
+        std::size_t capacity = std::max(buffer_->size(), tail + want);
+        if (shared) {
+            // Slices still point into this buffer: move only the unconsumed tail elsewhere
+            auto fresh = BufferPool::shared().acquire(capacity);
+            fresh->resize(capacity);
+            std::memcpy(fresh->data(), buffer_->data() + begin_, tail);
+            buffer_ = std::move(fresh);
+        } else {
+            // Move the unconsumed tail to the front before growing
+            if (begin_ > 0) {
+                std::memmove(buffer_->data(), buffer_->data() + begin_, tail);
+            }
+            if (buffer_->size() < tail + want) {
+                buffer_->resize(std::max(buffer_->size() * 2, tail + want));
+            }
+        }
+        begin_ = 0;
+        end_ = tail;
+    }
+
+    return boost::asio::buffer(buffer_->data() + end_, buffer_->size() - end_);
+}
+
+void FrameDecoder::commit(std::size_t n) {
+    if (buffer_) {
+        end_ = std::min(end_ + n, buffer_->size());
+    }
+}
+
+bool FrameDecoder::next(std::string_view &frame) {
+    std::size_t offset = 0;
+    std::size_t length = 0;
+    uint32_t flags = 0;
+    if (!next_range(offset, length, flags)) {
+        return false;
+    }
+    frame = std::string_view(buffer_->data() + offset, length);
+    return true;
+}
+
+bool FrameDecoder::next(BufferSlice &frame) {
+    uint32_t flags = 0;
+    return next(frame, flags);
+}
+
+bool FrameDecoder::next(BufferSlice &frame, uint32_t &flags) {
+    std::size_t offset = 0;
+    std::size_t length = 0;
+    if (!next_range(offset, length, flags)) {
+        return false;
+    }
+    frame = BufferSlice{buffer_, offset, length};
+    return true;
+}
+
+bool FrameDecoder::next_chunk(FrameChunk &chunk) {
+    if (stream_remaining_ == 0 || buffered() == 0) {
+        return false;
+    }
+    std::size_t size = std::min(buffered(), stream_remaining_);
+    chunk.data = BufferSlice{buffer_, begin_, size};
+    chunk.offset = stream_total_ - stream_remaining_;
+    chunk.total = stream_total_;
+    begin_ += size;
+    stream_remaining_ -= size;
+    return true;
+}
+
+bool FrameDecoder::next_range(std::size_t &offset, std::size_t &length, uint32_t &flags) {
+    if (!buffer_ || stream_remaining_ > 0) {
+        return false;
+    }
+    const char *start = buffer_->data() + begin_;
+
+    if (mode_ == FrameMode::length_prefixed) {
+        if (buffered() < kFrameHeaderSize) {
+            return false;
+        }
+
+        uint32_t header = read_le32(start);
+        flags = header & ~kFrameLengthMask;
+        if (flags & ~accepted_flags_) {
+            throw std::runtime_error("Unsupported frame flags: " + std::to_string(header >> 28));
+        }
+        length = header & kFrameLengthMask;
+        if (length > max_frame_size_) {
+            throw std::runtime_error("Frame of " + std::to_string(length) + " bytes exceeds limit");
+        }
+        if (stream_threshold_ > 0 && flags == 0 && length >= stream_threshold_) {
+            // Hand the payload out piece by piece instead of growing the buffer to hold it
+            begin_ += kFrameHeaderSize;
+            stream_total_ = length;
+            stream_remaining_ = length;
+            return false;
+        }
+        if (buffered() < kFrameHeaderSize + length) {
+            pending_ = length;
+            return false;
+        }
+
+        pending_ = 0;
+        offset = begin_ + kFrameHeaderSize;
+        begin_ += kFrameHeaderSize + length;
+        return true;
+    }
+
+    // Delimited: only search bytes that have not been searched before
+    auto found = static_cast<const char *>(std::memchr(start + scanned_, '\n', buffered() - scanned_));
+    if (!found) {
+        scanned_ = buffered();
+        if (scanned_ > max_frame_size_) {
+            throw std::runtime_error("Frame of " + std::to_string(scanned_) + " bytes exceeds limit");
+        }
+        return false;
+    }
+
+    std::size_t line = found - start;
+    offset = begin_;
+    length = line;
+    flags = 0;
+    if (length > 0 && start[length - 1] == '\r') {
+        --length;
+    }
+    begin_ += line + 1;
+    scanned_ = 0;
+    return true;
+}
+
+void FrameDecoder::set_mode(FrameMode mode) {
+    mode_ = mode;
+    scanned_ = 0;
+    pending_ = 0;
+    stream_remaining_ = 0;
+}
+
+void FrameDecoder::reset() {
+    begin_ = end_ = 0;
+    scanned_ = 0;
+    pending_ = 0;
+    stream_remaining_ = 0;
+}
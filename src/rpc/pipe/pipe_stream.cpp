@@ -0,0 +1,16 @@
+//
+// Created by Right on 25/6/3 10:12.
+//
+
+#include "sauri/rpc/pipe/pipe_stream.h"
+
+std::string resolve_pipe_path(const std::string &pipe_name) {
+#if defined(_WIN32)
+    return "\\\\.\\pipe\\" + pipe_name;
+#else
+    if (!pipe_name.empty() && pipe_name.front() == '/') {
+        return pipe_name;
+    }
+    return "/tmp/" + pipe_name + ".sock";
+#endif
+}
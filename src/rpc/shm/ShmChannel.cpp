@@ -0,0 +1,514 @@
+//
+// Created by Right on 25/6/9 15:40.
+//
+
+#include "sauri/rpc/shm/shm_channel.h"
+
+#if defined(SAURI_HAS_SHM_TRANSPORT)
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "sauri/rpc/pipe/pipe_stream.h"
+
+namespace {
+    constexpr std::size_t kMinRingSize = 64 * 1024;
+
+    std::size_t align8(std::size_t n) {
+        return (n + 7) & ~static_cast<std::size_t>(7);
+    }
+
+    std::size_t round_up_pow2(std::size_t n) {
+        std::size_t size = kMinRingSize;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    void ring_doorbell(int fd) {
+        uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(fd, &one, sizeof(one));
+    }
+
+    void clear_doorbell(int fd) {
+        uint64_t value = 0;
+        [[maybe_unused]] auto n = ::read(fd, &value, sizeof(value));
+    }
+
+    void close_fds(const std::vector<int> &fds) {
+        for (int fd: fds) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+}
+
+ShmRing::ShmRing(void *base, std::size_t capacity, bool initialize)
+        : header_(static_cast<ShmRingHeader *>(base)),
+          data_(static_cast<char *>(base) + sizeof(ShmRingHeader)),
+          capacity_(capacity) {
+    if (initialize) {
+        new(base) ShmRingHeader{};
+        header_->capacity = capacity;
+    }
+}
+
+bool ShmRing::try_write(std::string_view record) {
+    if (record.size() > max_record()) {
+        return false;
+    }
+
+    uint64_t head = header_->head.load(std::memory_order_relaxed);
+    uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    std::size_t need = kRecordHeader + align8(record.size());
+    std::size_t index = head & (capacity_ - 1);
+    std::size_t contiguous = capacity_ - index;
+    std::size_t free = capacity_ - static_cast<std::size_t>(head - tail);
+
+    if (contiguous < need) {
+        // Skip to the start of the ring so the record stays contiguous
+        if (free < contiguous + need) {
+            return false;
+        }
+        uint32_t padding = kPadding;
+        std::memcpy(data_ + index, &padding, sizeof(padding));
+        head += contiguous;
+        index = 0;
+    } else if (free < need) {
+        return false;
+    }
+
+    auto length = static_cast<uint32_t>(record.size());
+    std::memcpy(data_ + index, &length, sizeof(length));
+    std::memcpy(data_ + index + kRecordHeader, record.data(), record.size());
+    header_->head.store(head + need, std::memory_order_release);
+    return true;
+}
+
+bool ShmRing::peek(std::string_view &record) {
+    for (;;) {
+        uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+        uint64_t head = header_->head.load(std::memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+
+        // Positions and lengths come from the peer, so nothing is trusted until it is checked
+        auto available = static_cast<std::size_t>(head - tail);
+        if (available > capacity_ || (tail & 7) != 0) {
+            throw std::runtime_error("shm ring positions are inconsistent");
+        }
+
+        std::size_t index = tail & (capacity_ - 1);
+        std::size_t contiguous = capacity_ - index;
+        uint32_t length;
+        std::memcpy(&length, data_ + index, sizeof(length));
+        if (length == kPadding) {
+            if (contiguous > available) {
+                throw std::runtime_error("shm ring padding runs past the written data");
+            }
+            header_->tail.store(tail + contiguous, std::memory_order_release);
+            continue;
+        }
+
+        std::size_t size = kRecordHeader + align8(length);
+        if (length > max_record() || size > contiguous || size > available) {
+            throw std::runtime_error("shm ring record length out of bounds");
+        }
+        record = std::string_view(data_ + index + kRecordHeader, length);
+        peeked_ = size;
+        return true;
+    }
+}
+
+void ShmRing::pop() {
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    header_->tail.store(tail + peeked_, std::memory_order_release);
+    peeked_ = 0;
+}
+
+ShmChannel::ShmChannel(const boost::asio::any_io_executor &executor, int memfd, std::size_t ring_capacity,
+                       bool creator, const int (&eventfds)[4])
+        : executor_(executor),
+          memfd_(memfd),
+          eventfds_{eventfds[0], eventfds[1], eventfds[2], eventfds[3]},
+          rx_data_(executor),
+          tx_space_(executor),
+          tx_data_fd_(-1),
+          rx_space_fd_(-1) {
+    mapping_size_ = 2 * ShmRing::mapped_size(ring_capacity);
+    mapping_ = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+    if (mapping_ == MAP_FAILED) {
+        mapping_ = nullptr;
+        throw std::runtime_error("mmap failed: " + std::string(std::strerror(errno)));
+    }
+
+    // Ring A carries dock -> app, ring B app -> dock.
+    // eventfds: A data, A space, B data, B space
+    auto base = static_cast<char *>(mapping_);
+    ShmRing ring_a(base, ring_capacity, creator);
+    ShmRing ring_b(base + ShmRing::mapped_size(ring_capacity), ring_capacity, creator);
+    if (creator) {
+        rx_ = ring_a;
+        tx_ = ring_b;
+        rx_data_.assign(::dup(eventfds_[0]));
+        rx_space_fd_ = eventfds_[1];
+        tx_data_fd_ = eventfds_[2];
+        tx_space_.assign(::dup(eventfds_[3]));
+    } else {
+        tx_ = ring_a;
+        rx_ = ring_b;
+        tx_data_fd_ = eventfds_[0];
+        tx_space_.assign(::dup(eventfds_[1]));
+        rx_data_.assign(::dup(eventfds_[2]));
+        rx_space_fd_ = eventfds_[3];
+    }
+}
+
+ShmChannel::~ShmChannel() {
+    boost::system::error_code ignored;
+    rx_data_.close(ignored);
+    tx_space_.close(ignored);
+    if (mapping_) {
+        ::munmap(mapping_, mapping_size_);
+    }
+    close_fds({memfd_, eventfds_[0], eventfds_[1], eventfds_[2], eventfds_[3]});
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::create(const boost::asio::any_io_executor &executor,
+                                               std::size_t ring_capacity) {
+    ring_capacity = round_up_pow2(ring_capacity);
+
+    int memfd = ::memfd_create("sauri-shm", MFD_CLOEXEC);
+    if (memfd < 0) {
+        throw std::runtime_error("memfd_create failed: " + std::string(std::strerror(errno)));
+    }
+    if (::ftruncate(memfd, static_cast<off_t>(2 * ShmRing::mapped_size(ring_capacity))) != 0) {
+        ::close(memfd);
+        throw std::runtime_error("ftruncate failed: " + std::string(std::strerror(errno)));
+    }
+
+    int eventfds[4];
+    for (int &fd: eventfds) {
+        fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    if (eventfds[0] < 0 || eventfds[1] < 0 || eventfds[2] < 0 || eventfds[3] < 0) {
+        close_fds({memfd, eventfds[0], eventfds[1], eventfds[2], eventfds[3]});
+        throw std::runtime_error("eventfd failed: " + std::string(std::strerror(errno)));
+    }
+
+    return std::shared_ptr<ShmChannel>(new ShmChannel(executor, memfd, ring_capacity, true, eventfds));
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::attach(const boost::asio::any_io_executor &executor,
+                                               const std::vector<int> &fds) {
+    if (fds.size() != 5) {
+        close_fds(fds);
+        throw std::runtime_error("Expected 5 shm descriptors, got " + std::to_string(fds.size()));
+    }
+
+    // The segment holds two rings of equal size
+    struct stat st{};
+    if (::fstat(fds[0], &st) != 0 || static_cast<std::size_t>(st.st_size) < 2 * sizeof(ShmRingHeader)) {
+        close_fds(fds);
+        throw std::runtime_error("Invalid shm segment");
+    }
+    std::size_t ring_capacity = (static_cast<std::size_t>(st.st_size) / 2) - sizeof(ShmRingHeader);
+
+    int eventfds[4] = {fds[1], fds[2], fds[3], fds[4]};
+    for (int fd: eventfds) {
+        // Doorbells are drained with non-blocking reads
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return std::shared_ptr<ShmChannel>(new ShmChannel(executor, fds[0], ring_capacity, false, eventfds));
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::connect(const boost::asio::any_io_executor &executor,
+                                                const std::string &pipe_name,
+                                                const SharedBuffer &request_frame,
+                                                std::chrono::milliseconds timeout) {
+    std::string path = resolve_pipe_path(pipe_name);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error("socket failed: " + std::string(std::strerror(errno)));
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        throw std::runtime_error("connect " + path + " failed: " + std::string(std::strerror(errno)));
+    }
+
+    // The side connection only carries the attach request and the descriptors
+    std::size_t sent = 0;
+    while (sent < request_frame->size()) {
+        auto n = ::send(fd, request_frame->data() + sent, request_frame->size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            ::close(fd);
+            throw std::runtime_error("send attach request failed: " + std::string(std::strerror(errno)));
+        }
+        sent += static_cast<std::size_t>(n);
+    }
+
+    auto fds = receive_fds(fd, 5, timeout);
+    ::close(fd);
+    return attach(executor, fds);
+}
+
+std::vector<int> ShmChannel::native_handles() const {
+    return {memfd_, eventfds_[0], eventfds_[1], eventfds_[2], eventfds_[3]};
+}
+
+void ShmChannel::start(frame_handler on_frame) {
+    on_frame_ = std::move(on_frame);
+    open_ = true;
+    wait_for_data();
+}
+
+ShmChannel::WriteResult ShmChannel::write(const SharedBuffer &buffer, std::string_view payload) {
+    if (!open_ || payload.size() > tx_.max_record()) {
+        return WriteResult::too_large;
+    }
+
+    // Keep ordering: once something is pending everything queues behind it
+    if (!pending_.empty() || !tx_.try_write(payload)) {
+        pending_.push_back({buffer, payload});
+        if (!waiting_for_space_) {
+            wait_for_space();
+        }
+        return WriteResult::queued;
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (tx_.header()->consumer_waiting.load(std::memory_order_relaxed)) {
+        ring_doorbell(tx_data_fd_);
+    }
+    return WriteResult::written;
+}
+
+void ShmChannel::close() {
+    if (!open_) {
+        return;
+    }
+    open_ = false;
+    pending_.clear();
+    on_frame_ = nullptr;
+    on_drain_ = nullptr;
+
+    boost::system::error_code ignored;
+    rx_data_.cancel(ignored);
+    tx_space_.cancel(ignored);
+}
+
+void ShmChannel::fail(const std::exception &e) {
+    // The peer broke the ring; messages go over the stream from now on
+    std::cerr << "shm channel closed: " << e.what() << std::endl;
+    close();
+}
+
+void ShmChannel::wait_for_data() {
+    if (!open_) {
+        return;
+    }
+
+    // Announce that we are about to sleep, then re-check so a record published
+    // in between is not missed
+    auto header = rx_.header();
+    header->consumer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    std::string_view record;
+    bool ready;
+    try {
+        ready = rx_.peek(record);
+    } catch (const std::exception &e) {
+        fail(e);
+        return;
+    }
+    if (ready) {
+        header->consumer_waiting.store(0, std::memory_order_relaxed);
+        boost::asio::post(executor_, [self = shared_from_this()]() {
+            self->drain_inbound();
+        });
+        return;
+    }
+
+    rx_data_.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            boost::asio::bind_executor(executor_, [self = shared_from_this()](const boost::system::error_code &ec) {
+                if (ec || !self->open_) {
+                    return;
+                }
+                clear_doorbell(self->rx_data_.native_handle());
+                self->rx_.header()->consumer_waiting.store(0, std::memory_order_relaxed);
+                self->drain_inbound();
+            }));
+}
+
+void ShmChannel::drain_inbound() {
+    // Bounded batch so one busy channel cannot starve the rest of the executor
+    constexpr int kBatch = 256;
+
+    std::string_view record;
+    int consumed = 0;
+    while (open_ && consumed < kBatch) {
+        try {
+            if (!rx_.peek(record)) {
+                break;
+            }
+        } catch (const std::exception &e) {
+            fail(e);
+            return;
+        }
+        BufferSlice slice;
+        slice.buffer = BufferPool::shared().copy(record);
+        slice.size = record.size();
+        rx_.pop();
+        ++consumed;
+
+        if (on_frame_) {
+            on_frame_(slice);
+        }
+    }
+
+    if (consumed > 0) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (rx_.header()->producer_waiting.load(std::memory_order_relaxed)) {
+            ring_doorbell(rx_space_fd_);
+        }
+    }
+
+    if (consumed == kBatch) {
+        boost::asio::post(executor_, [self = shared_from_this()]() {
+            self->drain_inbound();
+        });
+    } else {
+        wait_for_data();
+    }
+}
+
+void ShmChannel::wait_for_space() {
+    if (!open_) {
+        return;
+    }
+
+    auto header = tx_.header();
+    header->producer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    flush_pending();
+    if (pending_.empty()) {
+        header->producer_waiting.store(0, std::memory_order_relaxed);
+        waiting_for_space_ = false;
+        return;
+    }
+
+    waiting_for_space_ = true;
+    tx_space_.async_wait(
+            boost::asio::posix::stream_descriptor::wait_read,
+            boost::asio::bind_executor(executor_, [self = shared_from_this()](const boost::system::error_code &ec) {
+                self->waiting_for_space_ = false;
+                if (ec || !self->open_) {
+                    return;
+                }
+                clear_doorbell(self->tx_space_.native_handle());
+                self->tx_.header()->producer_waiting.store(0, std::memory_order_relaxed);
+                self->flush_pending();
+                if (!self->pending_.empty()) {
+                    self->wait_for_space();
+                }
+            }));
+}
+
+void ShmChannel::flush_pending() {
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+    while (!pending_.empty() && tx_.try_write(pending_.front().payload)) {
+        bytes += pending_.front().buffer->size();
+        ++count;
+        pending_.pop_front();
+    }
+
+    if (count > 0) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (tx_.header()->consumer_waiting.load(std::memory_order_relaxed)) {
+            ring_doorbell(tx_data_fd_);
+        }
+        if (on_drain_) {
+            on_drain_(count, bytes);
+        }
+    }
+}
+
+bool send_fds(int socket, const std::vector<int> &fds) {
+    char marker = 'F';
+    iovec iov{&marker, 1};
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    for (;;) {
+        if (::sendmsg(socket, &msg, MSG_NOSIGNAL) == 1) {
+            return true;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+        pollfd pfd{socket, POLLOUT, 0};
+        if (::poll(&pfd, 1, 1000) <= 0) {
+            return false;
+        }
+    }
+}
+
+std::vector<int> receive_fds(int socket, std::size_t max_fds, std::chrono::milliseconds timeout) {
+    pollfd pfd{socket, POLLIN, 0};
+    if (::poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0) {
+        throw std::runtime_error("Timed out waiting for shm descriptors");
+    }
+
+    char marker = 0;
+    iovec iov{&marker, 1};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    if (::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        throw std::runtime_error("recvmsg failed: " + std::string(std::strerror(errno)));
+    }
+
+    std::vector<int> fds;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.resize(count);
+            std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    }
+    return fds;
+}
+
+#endif
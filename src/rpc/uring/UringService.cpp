@@ -0,0 +1,537 @@
+//
+// Created by Right on 25/6/10 10:05.
+//
+
+#include "sauri/rpc/uring/uring_service.h"
+
+#if defined(SAURI_HAS_IO_URING)
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+namespace {
+    int uring_setup(unsigned entries, io_uring_params *params) {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+        return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    // Multishot receives arrived in 6.0, after provided-buffer rings (5.19)
+    bool kernel_supports_multishot_receive() {
+        utsname name{};
+        if (::uname(&name) != 0) {
+            return false;
+        }
+        int major = 0;
+        if (std::sscanf(name.release, "%d", &major) != 1) {
+            return false;
+        }
+        return major >= 6;
+    }
+
+    // The ring tail overlays the reserved field of the first entry. io_uring_buf_ring is not used
+    // because its flexible array member has a different offset when compiled as C++.
+    uint16_t *buffer_ring_tail(io_uring_buf *ring) {
+        return &ring[0].resv;
+    }
+
+    boost::system::error_code to_error_code(int res) {
+        if (res == -ECANCELED) {
+            return boost::asio::error::operation_aborted;
+        }
+        return {-res, boost::system::system_category()};
+    }
+}
+
+struct UringService::Operation {
+    enum class Kind {
+        receive,
+        send,
+    };
+
+    Kind kind;
+    uint64_t id = 0;
+    int fd = -1;
+    bool cancelled = false;
+
+    // receive
+    std::shared_ptr<BufferGroup> buffers;
+    receive_handler on_receive;
+
+    // send: iovecs[first..] is what is left to send
+    std::vector<iovec> iovecs;
+    std::size_t first = 0;
+    msghdr message{};
+    std::size_t sent = 0;
+    send_handler on_send;
+};
+
+UringService::BufferGroup::BufferGroup(std::shared_ptr<UringService> service, uint16_t id, uint16_t count,
+                                       std::size_t size)
+        : service_(std::move(service)),
+          id_(id),
+          count_(count),
+          size_(size),
+          buffers_(new char[count * size]) {
+    // The ring is shared with the kernel and must be page aligned
+    ring_size_ = count_ * sizeof(io_uring_buf);
+    void *ring = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        throw std::runtime_error("mmap buffer ring failed: " + std::string(std::strerror(errno)));
+    }
+    ring_ = static_cast<io_uring_buf *>(ring);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring_);
+    reg.ring_entries = count_;
+    reg.bgid = id_;
+    if (uring_register(service_->ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int error = errno;
+        ::munmap(ring_, ring_size_);
+        throw std::runtime_error("Register buffer ring failed: " + std::string(std::strerror(error)));
+    }
+
+    for (uint16_t buffer = 0; buffer < count_; ++buffer) {
+        add(buffer);
+    }
+    __atomic_store_n(buffer_ring_tail(ring_), tail_, __ATOMIC_RELEASE);
+}
+
+UringService::BufferGroup::~BufferGroup() {
+    io_uring_buf_reg reg{};
+    reg.bgid = id_;
+    uring_register(service_->ring_fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    ::munmap(ring_, ring_size_);
+    service_->release_group_id(id_);
+}
+
+void UringService::BufferGroup::recycle(uint16_t buffer) {
+    add(buffer);
+    __atomic_store_n(buffer_ring_tail(ring_), tail_, __ATOMIC_RELEASE);
+}
+
+void UringService::BufferGroup::add(uint16_t buffer) {
+    auto &entry = ring_[tail_ & (count_ - 1)];
+    entry.addr = reinterpret_cast<uint64_t>(buffers_.get() + buffer * size_);
+    entry.len = static_cast<uint32_t>(size_);
+    entry.bid = buffer;
+    ++tail_;
+}
+
+std::shared_ptr<UringService> UringService::create(boost::asio::io_context &io_context, unsigned entries) {
+    if (!kernel_supports_multishot_receive()) {
+        return nullptr;
+    }
+
+    std::shared_ptr<UringService> service(new UringService(io_context));
+    if (!service->open(entries)) {
+        return nullptr;
+    }
+    service->wait_completions();
+    return service;
+}
+
+UringService::UringService(boost::asio::io_context &io_context)
+        : io_context_(io_context),
+          completions_(io_context) {
+}
+
+UringService::~UringService() {
+    shutdown();
+    boost::system::error_code ignored;
+    completions_.close(ignored);
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (ring_) ::munmap(ring_, ring_size_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+}
+
+bool UringService::open(unsigned entries) {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+    ring_fd_ = uring_setup(entries, &params);
+    if (ring_fd_ < 0) {
+        std::cerr << "io_uring_setup failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    constexpr unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL |
+                                  IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        return false;
+    }
+
+    // Submission and completion rings share one mapping
+    ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                          params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring_ = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                   IORING_OFF_SQ_RING);
+    if (ring_ == MAP_FAILED) {
+        ring_ = nullptr;
+        return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                        IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    auto *base = static_cast<char *>(ring_);
+    sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries_ = reinterpret_cast<unsigned *>(base + params.sq_off.ring_entries);
+    sq_flags_ = reinterpret_cast<unsigned *>(base + params.sq_off.flags);
+    sq_array_ = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+
+    int event_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+        return false;
+    }
+    completions_.assign(event_fd);
+    if (uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) != 0) {
+        return false;
+    }
+
+    // Buffer rings need 5.19 even when the version string says otherwise (backports, seccomp)
+    try {
+        create_buffer_group(1, 4096);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<UringService::BufferGroup> UringService::create_buffer_group(uint16_t count, std::size_t size) {
+    // Ring entries must be a power of two
+    uint16_t entries = 1;
+    while (entries < count) {
+        entries <<= 1;
+    }
+    return std::make_shared<BufferGroup>(shared_from_this(), allocate_group_id(), entries, size);
+}
+
+uint64_t UringService::receive(int fd, std::shared_ptr<BufferGroup> buffers, receive_handler handler) {
+    auto op = std::make_shared<Operation>();
+    op->kind = Operation::Kind::receive;
+    op->fd = fd;
+    op->buffers = std::move(buffers);
+    op->on_receive = std::move(handler);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+        return 0;
+    }
+    op->id = next_id_++;
+    prepare(*op);
+    operations_.emplace(op->id, op);
+    schedule_flush();
+    return op->id;
+}
+
+uint64_t UringService::send(int fd, const std::vector<boost::asio::const_buffer> &buffers, send_handler handler) {
+    auto op = std::make_shared<Operation>();
+    op->kind = Operation::Kind::send;
+    op->fd = fd;
+    op->iovecs.reserve(buffers.size());
+    for (const auto &buffer: buffers) {
+        op->iovecs.push_back({const_cast<void *>(buffer.data()), buffer.size()});
+    }
+    op->on_send = std::move(handler);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+        return 0;
+    }
+    op->id = next_id_++;
+    prepare(*op);
+    operations_.emplace(op->id, op);
+    schedule_flush();
+    return op->id;
+}
+
+void UringService::cancel(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = operations_.find(id);
+    if (stopped_ || it == operations_.end() || it->second->cancelled) {
+        return;
+    }
+    it->second->cancelled = true;
+
+    auto *sqe = next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = id;
+    // Completions with user_data 0 are ignored
+    sqe->user_data = 0;
+    schedule_flush();
+}
+
+void UringService::shutdown() {
+    std::vector<std::function<void()>> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_ || ring_fd_ < 0 || !ring_) {
+            return;
+        }
+        stopped_ = true;
+
+        for (auto &[id, op]: operations_) {
+            auto *sqe = next_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = id;
+            sqe->user_data = 0;
+        }
+
+        // The kernel may still be reading send buffers or writing receive buffers until the
+        // cancellations complete, so wait for them, but not forever
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (!operations_.empty() && std::chrono::steady_clock::now() < deadline) {
+            __kernel_timespec timeout{0, 10 * 1000 * 1000};
+            io_uring_getevents_arg arg{};
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+            int submitted = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 1,
+                                                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                                       &arg, sizeof(arg)));
+            if (submitted > 0) {
+                to_submit_ -= static_cast<unsigned>(submitted);
+            }
+            reap(dropped);
+        }
+        // Handlers would see a half torn down service; just release what they hold
+        for (auto &[id, op]: operations_) {
+            dropped.emplace_back([op = op]() {});
+        }
+        operations_.clear();
+    }
+    dropped.clear();
+}
+
+io_uring_sqe *UringService::next_sqe() {
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= *sq_entries_) {
+        // Full: hand what is queued to the kernel now
+        submit();
+    }
+
+    unsigned index = tail & *sq_mask_;
+    auto *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqe;
+}
+
+void UringService::prepare(Operation &op) {
+    auto *sqe = next_sqe();
+    sqe->fd = op.fd;
+    sqe->user_data = op.id;
+    if (op.kind == Operation::Kind::receive) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = op.buffers->id();
+    } else {
+        op.message = {};
+        op.message.msg_iov = op.iovecs.data() + op.first;
+        op.message.msg_iovlen = op.iovecs.size() - op.first;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = reinterpret_cast<uint64_t>(&op.message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    }
+}
+
+void UringService::schedule_flush() {
+    if (flush_scheduled_) {
+        return;
+    }
+    flush_scheduled_ = true;
+    // Everything queued until the handler runs goes out in one io_uring_enter
+    boost::asio::post(io_context_, [weak = weak_from_this()]() {
+        if (auto self = weak.lock()) {
+            self->run_once();
+        }
+    });
+}
+
+void UringService::submit() {
+    while (to_submit_ > 0) {
+        int submitted = enter(to_submit_, 0, 0);
+        if (submitted < 0) {
+            if (submitted == -EINTR) {
+                continue;
+            }
+            // EBUSY/EAGAIN: completions are backed up; retry after the next reap
+            break;
+        }
+        to_submit_ -= static_cast<unsigned>(submitted);
+    }
+}
+
+int UringService::enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int result = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags,
+                                            nullptr, 0));
+    return result < 0 ? -errno : result;
+}
+
+void UringService::wait_completions() {
+    completions_.async_read_some(
+            boost::asio::buffer(&completions_count_, sizeof(completions_count_)),
+            [weak = weak_from_this()](const boost::system::error_code &ec, std::size_t) {
+                auto self = weak.lock();
+                if (!self || ec == boost::asio::error::operation_aborted) {
+                    return;
+                }
+                self->run_once();
+                self->wait_completions();
+            });
+}
+
+void UringService::run_once() {
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush_scheduled_ = false;
+        if (stopped_) {
+            return;
+        }
+        submit();
+        reap(ready);
+        if (to_submit_ > 0) {
+            // Re-submitted sends, or a submit that was refused
+            schedule_flush();
+        }
+    }
+    for (auto &handler: ready) {
+        handler();
+    }
+}
+
+void UringService::reap(std::vector<std::function<void()>> &ready) {
+    for (;;) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // Completions that did not fit are flushed back into the ring by the kernel
+            if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+                enter(0, 0, IORING_ENTER_GETEVENTS);
+                if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                    continue;
+                }
+            }
+            return;
+        }
+        for (; head != tail; ++head) {
+            complete(cqes_[head & *cq_mask_], ready);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+}
+
+void UringService::complete(const io_uring_cqe &cqe, std::vector<std::function<void()>> &ready) {
+    if (cqe.user_data == 0) {
+        return;
+    }
+    auto it = operations_.find(cqe.user_data);
+    if (it == operations_.end()) {
+        return;
+    }
+    auto op = it->second;
+
+    if (op->kind == Operation::Kind::receive) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) {
+            operations_.erase(it);
+        }
+        boost::system::error_code ec;
+        std::size_t bytes = 0;
+        uint16_t buffer = 0;
+        if (cqe.res > 0) {
+            bytes = static_cast<std::size_t>(cqe.res);
+            buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        } else if (cqe.res == 0) {
+            ec = boost::asio::error::eof;
+        } else {
+            ec = to_error_code(cqe.res);
+        }
+        if (!more && !ec && op->cancelled) {
+            ec = boost::asio::error::operation_aborted;
+        }
+        ready.emplace_back([op, ec, bytes, buffer, more]() {
+            op->on_receive(ec, bytes, buffer, more);
+        });
+        return;
+    }
+
+    boost::system::error_code ec;
+    if (cqe.res < 0) {
+        ec = to_error_code(cqe.res);
+    } else {
+        // Skip what went out; a short send is resubmitted for the rest
+        auto remaining = static_cast<std::size_t>(cqe.res);
+        op->sent += remaining;
+        while (op->first < op->iovecs.size() && remaining >= op->iovecs[op->first].iov_len) {
+            remaining -= op->iovecs[op->first].iov_len;
+            ++op->first;
+        }
+        if (op->first < op->iovecs.size()) {
+            auto &partial = op->iovecs[op->first];
+            partial.iov_base = static_cast<char *>(partial.iov_base) + remaining;
+            partial.iov_len -= remaining;
+            if (op->cancelled) {
+                ec = boost::asio::error::operation_aborted;
+            } else if (cqe.res == 0) {
+                ec = boost::asio::error::broken_pipe;
+            } else {
+                prepare(*op);
+                return;
+            }
+        }
+    }
+    operations_.erase(it);
+    ready.emplace_back([op, ec]() {
+        op->on_send(ec, op->sent);
+    });
+}
+
+uint16_t UringService::allocate_group_id() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_group_ids_.empty()) {
+        auto id = free_group_ids_.back();
+        free_group_ids_.pop_back();
+        return id;
+    }
+    return next_group_id_++;
+}
+
+void UringService::release_group_id(uint16_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_group_ids_.push_back(id);
+}
+
+#endif